@@ -12,8 +12,8 @@
 //  - Optional strip of binaries/libraries
 //  - Package from DESTDIR to ./packages (tar.zst/tar.xz)
 //  - Remove (undo install) using recorded manifest
-//  - Logs, registry, sha256 verification, colored TTY output, spinner
-//  - Revdep check: scan installed files for broken shared libs with ldd
+//  - Logs, registry, native sha256 verification (SHA-NI/ARMv8/scalar), colored TTY output, spinner
+//  - Revdep check: resolve DT_NEEDED natively (RPATH/RUNPATH, ld.so.conf, ld.so.cache) for installed files
 //  - Hooks: postremove, postsync
 //  - Repo sync: git add/commit/push
 //  - Scaffolding: create recipe & dirs for a program
@@ -22,29 +22,70 @@
 //
 // Build: g++ -std=c++17 -O2 -pthread sbuild.cpp -o sbuild
 //
-// NOTE: This tool shells out to common userland tools: curl, git, tar, unzip, xz, zstd, patch, sha256sum, ldd, file, strip, fakeroot.
-// Ensure they are installed in your environment.
+// NOTE: This tool runs common userland tools: curl, git, tar, unzip, xz, zstd, patch, strip, fakeroot.
+// Ensure they are installed in your environment. They are spawned directly (posix_spawn, argv vectors);
+// only recipe phases and hooks go through /bin/sh.
 
 #include <algorithm>
+#include <array>
 #include <atomic>
 #include <chrono>
 #include <csignal>
+#include <cmath>
+#include <condition_variable>
 #include <cstdio>
 #include <cstdlib>
 #include <cstring>
+#include <deque>
 #include <filesystem>
 #include <fstream>
 #include <functional>
 #include <iostream>
 #include <map>
+#include <memory>
 #include <mutex>
 #include <regex>
 #include <set>
 #include <sstream>
 #include <string>
 #include <thread>
+#include <tuple>
+#include <unordered_map>
 #include <vector>
 
+#include <elf.h>
+#include <dirent.h>
+#include <fcntl.h>
+#include <glob.h>
+#include <netdb.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <poll.h>
+#include <linux/fs.h>
+#include <spawn.h>
+#include <sys/file.h>
+#include <sys/ioctl.h>
+#include <sys/mman.h>
+#include <sys/resource.h>
+#include <sys/sendfile.h>
+#include <sys/socket.h>
+#include <sys/stat.h>
+#include <sys/syscall.h>
+#include <sys/wait.h>
+#include <unistd.h>
+
+#if defined(__x86_64__) || defined(__i386__)
+#include <cpuid.h>
+#include <immintrin.h>
+#endif
+#if defined(__aarch64__)
+#include <arm_neon.h>
+#include <asm/hwcap.h>
+#include <sys/auxv.h>
+#endif
+
+extern char **environ;
+
 namespace fs = std::filesystem;
 
 // =============== Terminal utilities ===============
@@ -105,38 +146,1115 @@ public:
     }
 };
 
-// =============== Helpers ===============
-static std::string run_cmd(const std::string &cmd, int *exitcode=nullptr) {
-    std::array<char, 4096> buf{};
-    std::string out;
-    FILE *pipe = popen((cmd + " 2>&1").c_str(), "r");
-    if (!pipe) return "";
-    while (fgets(buf.data(), (int)buf.size(), pipe)) out += buf.data();
-    int rc = pclose(pipe);
-    if (exitcode) *exitcode = WEXITSTATUS(rc);
-    return out;
+// =============== Process runner ===============
+// Every external tool is started through here: posix_spawn with an argv
+// vector (no implicit /bin/sh), stdout+stderr streamed through a pipe to a
+// sink as they arrive, the child in its own process group so a Ctrl-C can be
+// forwarded to the whole job, and wait4() for exit status and rusage.
+namespace proc {
+    using Argv = std::vector<std::string>;
+    using Sink = std::function<void(const char *data, size_t len)>;
+
+    struct Opts {
+        fs::path cwd;                   // empty = inherit
+        std::vector<std::string> env;   // extra/overriding KEY=VALUE entries
+        Sink out;                       // receives stdout+stderr; empty = discard
+        Sink err;                       // if set, stderr goes here instead of out
+        int in = -1;                    // stdin; -1 = /dev/null
+        bool own_pgroup = true;
+    };
+
+    struct Result {
+        int code = -1;                  // exit code, 128+signal, or -1 if spawn failed
+        double wall = 0;                // seconds
+        struct rusage ru{};
+        bool ok() const { return code == 0; }
+    };
+
+    // Process groups of running children, visible to the signal handler.
+    static std::array<std::atomic<pid_t>, 64> live_groups{};
+
+    static void track(pid_t pg) {
+        for (auto &s : live_groups) { pid_t z = 0; if (s.compare_exchange_strong(z, pg)) return; }
+    }
+    static void untrack(pid_t pg) {
+        for (auto &s : live_groups) { pid_t v = pg; if (s.compare_exchange_strong(v, 0)) return; }
+    }
+
+    static void on_signal(int sig) {
+        for (auto &s : live_groups) { pid_t pg = s.load(); if (pg > 0) kill(-pg, sig); }
+        std::signal(sig, SIG_DFL);
+        std::raise(sig);
+    }
+
+    static void forward_signals() {
+        for (int s : {SIGINT, SIGTERM, SIGHUP}) std::signal(s, on_signal);
+    }
+
+    static std::vector<std::string> merged_env(const std::vector<std::string> &extra) {
+        std::vector<std::string> env;
+        for (char **e = environ; *e; ++e) {
+            std::string kv = *e;
+            std::string key = kv.substr(0, kv.find('=') + 1);
+            bool overridden = std::any_of(extra.begin(), extra.end(),
+                [&](const std::string &x){ return x.compare(0, key.size(), key) == 0; });
+            if (!overridden) env.push_back(std::move(kv));
+        }
+        env.insert(env.end(), extra.begin(), extra.end());
+        return env;
+    }
+
+    static Result run(const Argv &argv, const Opts &o = {}) {
+        Result res;
+        if (argv.empty()) return res;
+        Argv args = argv;
+#if defined(__GLIBC__) && (__GLIBC__ > 2 || (__GLIBC__ == 2 && __GLIBC_MINOR__ >= 29))
+        const bool native_chdir = true;
+#else
+        const bool native_chdir = false;
+        if (!o.cwd.empty()) args.insert(args.begin(), {"/bin/sh", "-c", "cd \"$0\" && exec \"$@\"", o.cwd.string()});
+#endif
+        int fds[2], efds[2] = {-1, -1};
+        if (pipe2(fds, O_CLOEXEC) != 0) return res;
+        if (o.err && pipe2(efds, O_CLOEXEC) != 0) { close(fds[0]); close(fds[1]); return res; }
+
+        posix_spawn_file_actions_t fa;
+        posix_spawn_file_actions_init(&fa);
+        if (o.in >= 0) posix_spawn_file_actions_adddup2(&fa, o.in, 0);
+        else posix_spawn_file_actions_addopen(&fa, 0, "/dev/null", O_RDONLY, 0);
+        posix_spawn_file_actions_adddup2(&fa, fds[1], 1);
+        posix_spawn_file_actions_adddup2(&fa, o.err ? efds[1] : fds[1], 2);
+#if defined(__GLIBC__) && (__GLIBC__ > 2 || (__GLIBC__ == 2 && __GLIBC_MINOR__ >= 29))
+        if (native_chdir && !o.cwd.empty()) posix_spawn_file_actions_addchdir_np(&fa, o.cwd.c_str());
+#endif
+        posix_spawnattr_t at;
+        posix_spawnattr_init(&at);
+        sigset_t dflt, none;
+        sigemptyset(&dflt); sigemptyset(&none);
+        for (int s : {SIGINT, SIGTERM, SIGHUP, SIGQUIT, SIGPIPE}) sigaddset(&dflt, s);
+        posix_spawnattr_setsigdefault(&at, &dflt);
+        posix_spawnattr_setsigmask(&at, &none);
+        short flags = POSIX_SPAWN_SETSIGDEF | POSIX_SPAWN_SETSIGMASK;
+        if (o.own_pgroup) { flags |= POSIX_SPAWN_SETPGROUP; posix_spawnattr_setpgroup(&at, 0); }
+        posix_spawnattr_setflags(&at, flags);
+
+        std::vector<char*> cargv;
+        for (auto &a : args) cargv.push_back(const_cast<char*>(a.c_str()));
+        cargv.push_back(nullptr);
+        std::vector<std::string> env;
+        std::vector<char*> cenv;
+        char **envp = environ;
+        if (!o.env.empty()) {
+            env = merged_env(o.env);
+            for (auto &e : env) cenv.push_back(const_cast<char*>(e.c_str()));
+            cenv.push_back(nullptr);
+            envp = cenv.data();
+        }
+
+        auto t0 = std::chrono::steady_clock::now();
+        pid_t pid = 0;
+        int rc = posix_spawnp(&pid, cargv[0], &fa, &at, cargv.data(), envp);
+        posix_spawn_file_actions_destroy(&fa);
+        posix_spawnattr_destroy(&at);
+        close(fds[1]);
+        if (o.err) close(efds[1]);
+        if (rc != 0) {
+            close(fds[0]);
+            if (o.err) close(efds[0]);
+            if (o.out) {
+                std::string m = "sbuild: cannot run " + args[0] + ": " + std::strerror(rc) + "\n";
+                o.out(m.data(), m.size());
+            }
+            return res;
+        }
+        if (o.own_pgroup) track(pid);
+
+        std::array<char, 65536> buf;
+        if (!o.err) {
+            for (;;) {
+                ssize_t n = read(fds[0], buf.data(), buf.size());
+                if (n > 0) { if (o.out) o.out(buf.data(), (size_t)n); continue; }
+                if (n < 0 && errno == EINTR) continue;
+                break;
+            }
+        } else {
+            struct pollfd pf[2] = {{fds[0], POLLIN, 0}, {efds[0], POLLIN, 0}};
+            while (pf[0].fd >= 0 || pf[1].fd >= 0) {
+                if (poll(pf, 2, -1) < 0) { if (errno == EINTR) continue; break; }
+                for (int i = 0; i < 2; ++i) {
+                    if (pf[i].fd < 0 || !pf[i].revents) continue;
+                    ssize_t n = read(pf[i].fd, buf.data(), buf.size());
+                    if (n > 0) { const Sink &s = i ? o.err : o.out; if (s) s(buf.data(), (size_t)n); }
+                    else if (n == 0 || errno != EINTR) pf[i].fd = -1;
+                }
+            }
+            close(efds[0]);
+        }
+        close(fds[0]);
+
+        int st = 0;
+        while (wait4(pid, &st, 0, &res.ru) < 0 && errno == EINTR) {}
+        if (o.own_pgroup) untrack(pid);
+        res.wall = std::chrono::duration<double>(std::chrono::steady_clock::now() - t0).count();
+        if (WIFEXITED(st)) res.code = WEXITSTATUS(st);
+        else if (WIFSIGNALED(st)) res.code = 128 + WTERMSIG(st);
+        return res;
+    }
+
+    // Small outputs only (tool versions, one-line answers); use a sink for anything else.
+    static std::string capture(const Argv &argv, int *exitcode = nullptr, Opts o = {}) {
+        std::string out;
+        o.out = [&](const char *d, size_t n){ out.append(d, n); };
+        auto r = run(argv, o);
+        if (exitcode) *exitcode = r.code;
+        return out;
+    }
+
+    // Runs argv with in[0,n) on stdin and appends its stdout to out (stderr is dropped).
+    static Result filter(const Argv &argv, const char *in, size_t n, std::string &out) {
+        int fds[2];
+        if (pipe2(fds, O_CLOEXEC) != 0) return {};
+        std::thread feeder([&]{
+            for (size_t done = 0; done < n;) {
+                ssize_t w = ::write(fds[1], in + done, n - done);
+                if (w < 0 && errno == EINTR) continue;
+                if (w <= 0) break;          // child gone: EPIPE once run() closes the read end
+                done += (size_t)w;
+            }
+            close(fds[1]);
+        });
+        Opts o;
+        o.in = fds[0];
+        o.out = [&](const char *d, size_t len){ out.append(d, len); };
+        o.err = [](const char *, size_t){};
+        auto r = run(argv, o);
+        close(fds[0]);
+        feeder.join();
+        return r;
+    }
+
+    static Argv sh(const std::string &script) { return {"/bin/sh", "-c", script}; }
+
+    static std::string summary(const Result &r) {
+        auto secs = [](const timeval &tv){ return tv.tv_sec + tv.tv_usec / 1e6; };
+        char buf[160];
+        std::snprintf(buf, sizeof(buf), "exit=%d wall=%.2fs user=%.2fs sys=%.2fs maxrss=%ldKB",
+                      r.code, r.wall, secs(r.ru.ru_utime), secs(r.ru.ru_stime), r.ru.ru_maxrss);
+        return buf;
+    }
+
+    // Appends child output to a log file as it streams in.
+    class LogSink {
+        int fd = -1;
+    public:
+        explicit LogSink(const std::string &path) {
+            fd = open(path.c_str(), O_WRONLY | O_CREAT | O_APPEND | O_CLOEXEC, 0644);
+        }
+        ~LogSink() { if (fd >= 0) close(fd); }
+        LogSink(const LogSink &) = delete;
+        LogSink &operator=(const LogSink &) = delete;
+        void write(const char *d, size_t n) {
+            while (n && fd >= 0) {
+                ssize_t w = ::write(fd, d, n);
+                if (w < 0) { if (errno == EINTR) continue; break; }
+                d += w; n -= (size_t)w;
+            }
+        }
+        void line(const std::string &s) { std::string l = s + "\n"; write(l.data(), l.size()); }
+        Sink sink() { return [this](const char *d, size_t n){ write(d, n); }; }
+    };
+}
+
+// =============== Work pool ===============
+static unsigned default_jobs() {
+    if (const char *j = std::getenv("SB_JOBS")) { int n = std::atoi(j); if (n > 0) return (unsigned)n; }
+    unsigned n = std::thread::hardware_concurrency();
+    return n ? n : 1;
+}
+
+// Runs fn(i) for every i in [0,n) on up to `jobs` threads (0 = default_jobs()).
+// Items are handed out one at a time, so uneven work balances itself.
+template <class F> static void parallel_for(size_t n, unsigned jobs, F fn) {
+    if (n == 0) return;
+    if (jobs == 0) jobs = default_jobs();
+    jobs = (unsigned)std::min<size_t>(jobs, n);
+    std::atomic<size_t> next{0};
+    auto worker = [&]{ for (size_t i; (i = next.fetch_add(1)) < n;) fn(i); };
+    std::vector<std::thread> pool;
+    for (unsigned t = 1; t < jobs; ++t) pool.emplace_back(worker);
+    worker();
+    for (auto &t : pool) t.join();
+}
+
+// =============== Directory walker ===============
+// Parallel tree walk shared by manifest, strip, revdep, remove and recipe
+// lookup. Directories are read with getdents64 (d_type avoids a stat per
+// entry when only names/types are needed); every worker owns a deque of
+// pending directories, works depth-first on its own end and steals from the
+// other end of its neighbours' deques when it runs dry.
+namespace walk {
+    struct Entry {
+        std::string rel;            // relative to the root, '/'-separated
+        uint8_t type = DT_UNKNOWN;  // DT_REG, DT_DIR, DT_LNK, ...
+        uint32_t mode = 0;          // st_mode, only with Opts::stat
+        uint64_t size = 0;          // st_size, only with Opts::stat
+        int64_t mtime_ns = 0;       // st_mtim, only with Opts::stat
+        uint64_t ino = 0;
+    };
+
+    struct Opts {
+        bool stat = true;           // fill mode/size (one fstatat per entry)
+        unsigned jobs = 0;          // 0 = default_jobs()
+    };
+
+    static std::vector<Entry> tree(const fs::path &root, const Opts &o = {}) {
+        int rootfd = open(root.c_str(), O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+        if (rootfd < 0) return {};
+        unsigned jobs = o.jobs ? o.jobs : default_jobs();
+        struct Queue { std::mutex mu; std::deque<std::string> dirs; };
+        std::vector<Queue> queues(jobs);
+        std::vector<std::vector<Entry>> found(jobs);
+        std::atomic<size_t> pending{1};
+        queues[0].dirs.push_back("");
+
+        auto scan = [&](unsigned self, const std::string &dir, std::vector<char> &buf) {
+            int fd = dir.empty() ? dup(rootfd)
+                                 : openat(rootfd, dir.c_str(), O_RDONLY | O_DIRECTORY | O_NOFOLLOW | O_CLOEXEC);
+            if (fd < 0) return;
+            std::vector<std::string> subdirs;
+            for (;;) {
+                long n = syscall(SYS_getdents64, fd, buf.data(), buf.size());
+                if (n <= 0) break;
+                for (long off = 0; off < n;) {
+                    const char *rec = buf.data() + off;
+                    uint64_t ino; uint16_t reclen;
+                    std::memcpy(&ino, rec, 8);
+                    std::memcpy(&reclen, rec + 16, 2);
+                    uint8_t type = (uint8_t)rec[18];
+                    const char *name = rec + 19;
+                    off += reclen;
+                    if (name[0] == '.' && (name[1] == 0 || (name[1] == '.' && name[2] == 0))) continue;
+                    Entry e;
+                    e.rel = dir.empty() ? std::string(name) : dir + "/" + name;
+                    e.type = type;
+                    e.ino = ino;
+                    if (o.stat || type == DT_UNKNOWN) {
+                        struct stat st{};
+                        if (fstatat(fd, name, &st, AT_SYMLINK_NOFOLLOW) == 0) {
+                            e.type = (uint8_t)IFTODT(st.st_mode);
+                            e.mode = st.st_mode;
+                            e.size = (uint64_t)st.st_size;
+                            e.mtime_ns = (int64_t)st.st_mtim.tv_sec * 1000000000 + st.st_mtim.tv_nsec;
+                        }
+                    }
+                    if (e.type == DT_DIR) subdirs.push_back(e.rel);
+                    found[self].push_back(std::move(e));
+                }
+            }
+            close(fd);
+            if (subdirs.empty()) return;
+            pending += subdirs.size();
+            std::lock_guard<std::mutex> lk(queues[self].mu);
+            for (auto &d : subdirs) queues[self].dirs.push_back(std::move(d));
+        };
+
+        auto worker = [&](unsigned self) {
+            std::vector<char> buf(64 * 1024);
+            for (;;) {
+                std::string dir;
+                bool got = false;
+                {
+                    std::lock_guard<std::mutex> lk(queues[self].mu);
+                    if (!queues[self].dirs.empty()) { dir = std::move(queues[self].dirs.back()); queues[self].dirs.pop_back(); got = true; }
+                }
+                for (unsigned k = 1; !got && k < jobs; ++k) {
+                    auto &q = queues[(self + k) % jobs];
+                    std::lock_guard<std::mutex> lk(q.mu);
+                    if (!q.dirs.empty()) { dir = std::move(q.dirs.front()); q.dirs.pop_front(); got = true; }
+                }
+                if (got) { scan(self, dir, buf); pending--; continue; }
+                if (pending.load() == 0) return;
+                std::this_thread::yield();
+            }
+        };
+        std::vector<std::thread> pool;
+        for (unsigned t = 1; t < jobs; ++t) pool.emplace_back(worker, t);
+        worker(0);
+        for (auto &t : pool) t.join();
+        close(rootfd);
+
+        std::vector<Entry> out;
+        size_t total = 0;
+        for (auto &v : found) total += v.size();
+        out.reserve(total);
+        for (auto &v : found) for (auto &e : v) out.push_back(std::move(e));
+        return out;
+    }
+
+    // Parallel rm -rf: unlink all non-directories on the work pool, then
+    // remove directories level by level, deepest first.
+    static bool remove_tree(const fs::path &root) {
+        struct stat st{};
+        if (lstat(root.c_str(), &st) != 0) return errno == ENOENT;
+        if (!S_ISDIR(st.st_mode)) return unlink(root.c_str()) == 0;
+        auto entries = tree(root, {false, 0});
+        int rootfd = open(root.c_str(), O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+        if (rootfd < 0) return false;
+        std::vector<const Entry*> files;
+        std::map<size_t, std::vector<const Entry*>, std::greater<size_t>> dirs_by_depth;
+        for (auto &e : entries) {
+            if (e.type == DT_DIR) dirs_by_depth[(size_t)std::count(e.rel.begin(), e.rel.end(), '/')].push_back(&e);
+            else files.push_back(&e);
+        }
+        std::atomic<bool> ok{true};
+        parallel_for(files.size(), 0, [&](size_t i){ if (unlinkat(rootfd, files[i]->rel.c_str(), 0) != 0 && errno != ENOENT) ok = false; });
+        for (auto &[depth, dirs] : dirs_by_depth)
+            parallel_for(dirs.size(), 0, [&](size_t i){ if (unlinkat(rootfd, dirs[i]->rel.c_str(), AT_REMOVEDIR) != 0 && errno != ENOENT) ok = false; });
+        close(rootfd);
+        return rmdir(root.c_str()) == 0 && ok;
+    }
+}
+
+// =============== Tree cloning ===============
+// Copies a staging or source tree. Regular files are cloned with FICLONE
+// (shared extents on btrfs/xfs), else hardlinked when the caller allows it
+// (the two copies then share an inode, so neither may be modified in
+// place), else copied with copy_file_range. Modes and mtimes are kept.
+namespace treecopy {
+    struct Stats {
+        std::atomic<size_t> reflinked{0}, linked{0}, copied{0};
+        std::atomic<uint64_t> bytes{0};
+        std::atomic<int> reflink{-1};   // -1 unknown, 0 unsupported here (stop trying), 1 works
+        std::string summary() const {
+            return std::to_string(reflinked.load()) + " reflinked, " + std::to_string(linked.load()) + " hardlinked, " +
+                   std::to_string(copied.load()) + " copied";
+        }
+    };
+
+    static bool copy_fd(int in, int out, uint64_t size) {
+        for (uint64_t done = 0; done < size;) {
+            ssize_t n = copy_file_range(in, nullptr, out, nullptr, (size_t)std::min<uint64_t>(size - done, 1u << 30), 0);
+            if (n > 0) { done += (uint64_t)n; continue; }
+            if (n == 0) return true;
+            if (errno != EXDEV && errno != ENOSYS && errno != EOPNOTSUPP && errno != EINVAL) return false;
+            // No in-kernel copy between these filesystems: plain read/write from the current offset.
+            std::vector<char> buf(1 << 20);
+            lseek(in, (off_t)done, SEEK_SET);
+            lseek(out, (off_t)done, SEEK_SET);
+            for (ssize_t r; (r = ::read(in, buf.data(), buf.size())) > 0;)
+                if (::write(out, buf.data(), (size_t)r) != r) return false;
+            return true;
+        }
+        return true;
+    }
+
+    // dst must not exist yet.
+    static bool file(const fs::path &src, const fs::path &dst, bool allow_link, Stats *st = nullptr) {
+        if (allow_link && st && st->reflink.load() == 0) {
+            struct stat s{};
+            if (::link(src.c_str(), dst.c_str()) == 0 && ::stat(src.c_str(), &s) == 0) {
+                st->linked++; st->bytes += (uint64_t)s.st_size;
+                return true;
+            }
+        }
+        int in = ::open(src.c_str(), O_RDONLY | O_CLOEXEC);
+        if (in < 0) return false;
+        struct stat s{};
+        if (fstat(in, &s) != 0) { ::close(in); return false; }
+        int out = ::open(dst.c_str(), O_WRONLY | O_CREAT | O_EXCL | O_CLOEXEC, s.st_mode & 07777);
+        if (out < 0) { ::close(in); return false; }
+        bool ok = true;
+        bool cloned = (!st || st->reflink.load() != 0) && ioctl(out, FICLONE, in) == 0;
+        if (st && st->reflink.load() < 0) st->reflink = cloned ? 1 : 0;
+        if (cloned) { if (st) st->reflinked++; }
+        else if (allow_link) {
+            ::close(out); ::unlink(dst.c_str());
+            if (::link(src.c_str(), dst.c_str()) == 0) {
+                ::close(in);
+                if (st) { st->linked++; st->bytes += (uint64_t)s.st_size; }
+                return true;
+            }
+            out = ::open(dst.c_str(), O_WRONLY | O_CREAT | O_EXCL | O_CLOEXEC, s.st_mode & 07777);
+            ok = out >= 0 && copy_fd(in, out, (uint64_t)s.st_size);
+            if (ok && st) st->copied++;
+        } else {
+            ok = copy_fd(in, out, (uint64_t)s.st_size);
+            if (ok && st) st->copied++;
+        }
+        if (out >= 0) {
+            fchmod(out, s.st_mode & 07777);     // not narrowed by the umask
+            struct timespec times[2] = {s.st_atim, s.st_mtim};
+            futimens(out, times);
+            ::close(out);
+        }
+        ::close(in);
+        if (ok && st) st->bytes += (uint64_t)s.st_size;
+        return ok;
+    }
+
+    // Recreates src as dst (which must not exist); files go through file() on the work pool.
+    static bool tree(const fs::path &src, const fs::path &dst, bool allow_link, Stats *st = nullptr) {
+        Stats local;
+        if (!st) st = &local;
+        auto entries = walk::tree(src, {true, 0});
+        std::sort(entries.begin(), entries.end(), [](const walk::Entry &a, const walk::Entry &b){ return a.rel < b.rel; });
+        std::error_code ec;
+        fs::create_directories(dst, ec);
+        if (ec) return false;
+        std::vector<const walk::Entry*> files;
+        bool ok = true;
+        for (auto &e : entries) {
+            fs::path to = dst / e.rel;
+            if (e.type == DT_DIR) ok &= ::mkdir(to.c_str(), 0700) == 0;
+            else if (e.type == DT_LNK) {
+                auto target = fs::read_symlink(src / e.rel, ec);
+                ok &= !ec && ::symlink(target.c_str(), to.c_str()) == 0;
+            }
+            else if (e.type == DT_REG) files.push_back(&e);
+        }
+        std::atomic<bool> files_ok{true};
+        parallel_for(files.size(), 0, [&](size_t i){
+            if (!file(src / files[i]->rel, dst / files[i]->rel, allow_link, st)) files_ok = false;
+        });
+        // Directory modes last (a read-only directory would refuse its children), deepest first.
+        for (auto it = entries.rbegin(); it != entries.rend(); ++it) {
+            if (it->type != DT_DIR) continue;
+            struct stat s{};
+            if (::stat((src / it->rel).c_str(), &s) != 0) continue;
+            fs::path to = dst / it->rel;
+            ::chmod(to.c_str(), s.st_mode & 07777);
+            struct timespec times[2] = {s.st_atim, s.st_mtim};
+            utimensat(AT_FDCWD, to.c_str(), times, 0);
+        }
+        struct stat s{};
+        if (::stat(src.c_str(), &s) == 0) ::chmod(dst.c_str(), s.st_mode & 07777);
+        return ok && files_ok;
+    }
+}
+
+// =============== SHA-256 ===============
+// Streaming SHA-256 with the block function picked once at startup:
+// x86 SHA-NI, ARMv8 crypto extensions, or portable scalar code.
+// SB_SHA256=scalar forces the portable path.
+namespace sha256 {
+    using BlockFn = void (*)(uint32_t state[8], const uint8_t *data, size_t nblocks);
+
+    alignas(16) static const uint32_t K[64] = {
+        0x428a2f98, 0x71374491, 0xb5c0fbcf, 0xe9b5dba5, 0x3956c25b, 0x59f111f1, 0x923f82a4, 0xab1c5ed5,
+        0xd807aa98, 0x12835b01, 0x243185be, 0x550c7dc3, 0x72be5d74, 0x80deb1fe, 0x9bdc06a7, 0xc19bf174,
+        0xe49b69c1, 0xefbe4786, 0x0fc19dc6, 0x240ca1cc, 0x2de92c6f, 0x4a7484aa, 0x5cb0a9dc, 0x76f988da,
+        0x983e5152, 0xa831c66d, 0xb00327c8, 0xbf597fc7, 0xc6e00bf3, 0xd5a79147, 0x06ca6351, 0x14292967,
+        0x27b70a85, 0x2e1b2138, 0x4d2c6dfc, 0x53380d13, 0x650a7354, 0x766a0abb, 0x81c2c92e, 0x92722c85,
+        0xa2bfe8a1, 0xa81a664b, 0xc24b8b70, 0xc76c51a3, 0xd192e819, 0xd6990624, 0xf40e3585, 0x106aa070,
+        0x19a4c116, 0x1e376c08, 0x2748774c, 0x34b0bcb5, 0x391c0cb3, 0x4ed8aa4a, 0x5b9cca4f, 0x682e6ff3,
+        0x748f82ee, 0x78a5636f, 0x84c87814, 0x8cc70208, 0x90befffa, 0xa4506ceb, 0xbef9a3f7, 0xc67178f2,
+    };
+
+    static inline uint32_t ror(uint32_t x, int n) { return (x >> n) | (x << (32 - n)); }
+
+    static void blocks_scalar(uint32_t st[8], const uint8_t *p, size_t nblocks) {
+        for (; nblocks--; p += 64) {
+            uint32_t w[64];
+            for (int i = 0; i < 16; ++i)
+                w[i] = (uint32_t)p[4*i] << 24 | (uint32_t)p[4*i+1] << 16 | (uint32_t)p[4*i+2] << 8 | p[4*i+3];
+            for (int i = 16; i < 64; ++i) {
+                uint32_t s0 = ror(w[i-15], 7) ^ ror(w[i-15], 18) ^ (w[i-15] >> 3);
+                uint32_t s1 = ror(w[i-2], 17) ^ ror(w[i-2], 19) ^ (w[i-2] >> 10);
+                w[i] = w[i-16] + s0 + w[i-7] + s1;
+            }
+            uint32_t a = st[0], b = st[1], c = st[2], d = st[3], e = st[4], f = st[5], g = st[6], h = st[7];
+            for (int i = 0; i < 64; ++i) {
+                uint32_t t1 = h + (ror(e, 6) ^ ror(e, 11) ^ ror(e, 25)) + ((e & f) ^ (~e & g)) + K[i] + w[i];
+                uint32_t t2 = (ror(a, 2) ^ ror(a, 13) ^ ror(a, 22)) + ((a & b) ^ (a & c) ^ (b & c));
+                h = g; g = f; f = e; e = d + t1; d = c; c = b; b = a; a = t1 + t2;
+            }
+            st[0] += a; st[1] += b; st[2] += c; st[3] += d; st[4] += e; st[5] += f; st[6] += g; st[7] += h;
+        }
+    }
+
+#if defined(__x86_64__) || defined(__i386__)
+    __attribute__((target("sha,sse4.1,ssse3")))
+    static void blocks_shani(uint32_t st[8], const uint8_t *p, size_t nblocks) {
+        const __m128i MASK = _mm_set_epi64x(0x0c0d0e0f08090a0bULL, 0x0405060700010203ULL);
+        __m128i tmp = _mm_shuffle_epi32(_mm_loadu_si128((const __m128i*)&st[0]), 0xB1);  // CDAB
+        __m128i s1 = _mm_shuffle_epi32(_mm_loadu_si128((const __m128i*)&st[4]), 0x1B);   // EFGH
+        __m128i s0 = _mm_alignr_epi8(tmp, s1, 8);                                         // ABEF
+        s1 = _mm_blend_epi16(s1, tmp, 0xF0);                                              // CDGH
+        for (; nblocks--; p += 64) {
+            __m128i abef = s0, cdgh = s1, w[4];
+            for (int i = 0; i < 16; ++i) {
+                if (i < 4) {
+                    w[i] = _mm_shuffle_epi8(_mm_loadu_si128((const __m128i*)(p + 16*i)), MASK);
+                } else {
+                    __m128i t = _mm_add_epi32(_mm_sha256msg1_epu32(w[i&3], w[(i+1)&3]),
+                                              _mm_alignr_epi8(w[(i+3)&3], w[(i+2)&3], 4));
+                    w[i&3] = _mm_sha256msg2_epu32(t, w[(i+3)&3]);
+                }
+                __m128i m = _mm_add_epi32(w[i&3], _mm_load_si128((const __m128i*)&K[4*i]));
+                s1 = _mm_sha256rnds2_epu32(s1, s0, m);
+                s0 = _mm_sha256rnds2_epu32(s0, s1, _mm_shuffle_epi32(m, 0x0E));
+            }
+            s0 = _mm_add_epi32(s0, abef);
+            s1 = _mm_add_epi32(s1, cdgh);
+        }
+        tmp = _mm_shuffle_epi32(s0, 0x1B);                                                // FEBA
+        s1 = _mm_shuffle_epi32(s1, 0xB1);                                                 // DCHG
+        _mm_storeu_si128((__m128i*)&st[0], _mm_blend_epi16(tmp, s1, 0xF0));               // DCBA
+        _mm_storeu_si128((__m128i*)&st[4], _mm_alignr_epi8(s1, tmp, 8));                  // HGFE
+    }
+
+    static bool have_shani() {
+        unsigned a, b, c, d;
+        if (!__get_cpuid(1, &a, &b, &c, &d) || !(c & bit_SSE4_1)) return false;
+        if (!__get_cpuid_count(7, 0, &a, &b, &c, &d)) return false;
+        return (b & (1u << 29)) != 0;
+    }
+#endif
+
+#if defined(__aarch64__)
+    __attribute__((target("+crypto")))
+    static void blocks_armv8(uint32_t st[8], const uint8_t *p, size_t nblocks) {
+        uint32x4_t s0 = vld1q_u32(&st[0]), s1 = vld1q_u32(&st[4]);
+        for (; nblocks--; p += 64) {
+            uint32x4_t abcd = s0, efgh = s1, w[4];
+            for (int i = 0; i < 16; ++i) {
+                if (i < 4) w[i] = vreinterpretq_u32_u8(vrev32q_u8(vld1q_u8(p + 16*i)));
+                else w[i&3] = vsha256su1q_u32(vsha256su0q_u32(w[i&3], w[(i+1)&3]), w[(i+2)&3], w[(i+3)&3]);
+                uint32x4_t m = vaddq_u32(w[i&3], vld1q_u32(&K[4*i]));
+                uint32x4_t prev = s0;
+                s0 = vsha256hq_u32(s0, s1, m);
+                s1 = vsha256h2q_u32(s1, prev, m);
+            }
+            s0 = vaddq_u32(s0, abcd);
+            s1 = vaddq_u32(s1, efgh);
+        }
+        vst1q_u32(&st[0], s0);
+        vst1q_u32(&st[4], s1);
+    }
+
+    static bool have_armv8_sha2() { return (getauxval(AT_HWCAP) & HWCAP_SHA2) != 0; }
+#endif
+
+    struct Impl { const char *name; BlockFn fn; };
+
+    // Every implementation this CPU can run, fastest first; scalar is always last.
+    static std::vector<Impl> available() {
+        std::vector<Impl> v;
+#if defined(__x86_64__) || defined(__i386__)
+        if (have_shani()) v.push_back({"sha-ni", blocks_shani});
+#endif
+#if defined(__aarch64__)
+        if (have_armv8_sha2()) v.push_back({"armv8-crypto", blocks_armv8});
+#endif
+        v.push_back({"scalar", blocks_scalar});
+        return v;
+    }
+
+    static const Impl &active() {
+        static const Impl impl = []{
+            auto v = available();
+            const char *force = std::getenv("SB_SHA256");
+            for (auto &i : v) if (force && std::strcmp(force, i.name) == 0) return i;
+            return v.front();
+        }();
+        return impl;
+    }
+
+    class Hasher {
+        BlockFn fn;
+        uint32_t st[8] = {0x6a09e667, 0xbb67ae85, 0x3c6ef372, 0xa54ff53a, 0x510e527f, 0x9b05688c, 0x1f83d9ab, 0x5be0cd19};
+        uint64_t total = 0;
+        uint8_t buf[64];
+        size_t nbuf = 0;
+    public:
+        explicit Hasher(BlockFn f = active().fn) : fn(f) {}
+
+        void update(const void *data, size_t len) {
+            auto p = static_cast<const uint8_t*>(data);
+            total += len;
+            if (nbuf) {
+                size_t take = std::min(len, 64 - nbuf);
+                std::memcpy(buf + nbuf, p, take);
+                nbuf += take; p += take; len -= take;
+                if (nbuf < 64) return;
+                fn(st, buf, 1); nbuf = 0;
+            }
+            if (len >= 64) { fn(st, p, len / 64); p += len & ~size_t(63); len &= 63; }
+            if (len) { std::memcpy(buf, p, len); nbuf = len; }
+        }
+
+        std::string hex() {
+            uint64_t bits = total * 8;
+            uint8_t pad[72] = {0x80};
+            size_t padlen = (nbuf < 56 ? 56 : 120) - nbuf;
+            for (int i = 0; i < 8; ++i) pad[padlen + i] = (uint8_t)(bits >> (56 - 8*i));
+            update(pad, padlen + 8);
+            static const char *digits = "0123456789abcdef";
+            std::string out;
+            for (uint32_t w : st) for (int s = 28; s >= 0; s -= 4) out += digits[(w >> s) & 0xf];
+            return out;
+        }
+    };
+
+    static std::string bytes(const std::string &s) { Hasher h; h.update(s.data(), s.size()); return h.hex(); }
+
+    // Hash a file through mmap, or a large aligned buffer when it cannot be mapped.
+    // Returns "" if the file cannot be read.
+    static std::string file(const fs::path &p, BlockFn fn = active().fn) {
+        int fd = open(p.c_str(), O_RDONLY | O_CLOEXEC);
+        if (fd < 0) return "";
+        struct stat st{};
+        if (fstat(fd, &st) != 0) { close(fd); return ""; }
+        Hasher h(fn);
+        bool ok = true, mapped = false;
+        if (S_ISREG(st.st_mode) && st.st_size > 0) {
+            size_t size = (size_t)st.st_size;
+            void *m = mmap(nullptr, size, PROT_READ, MAP_PRIVATE, fd, 0);
+            if (m != MAP_FAILED) {
+                madvise(m, size, MADV_SEQUENTIAL);
+                h.update(m, size);
+                munmap(m, size);
+                mapped = true;
+            }
+        }
+        if (!mapped) {
+            posix_fadvise(fd, 0, 0, POSIX_FADV_SEQUENTIAL);
+            constexpr size_t bufsz = 1 << 20;
+            std::unique_ptr<uint8_t, decltype(&std::free)> buf((uint8_t*)std::aligned_alloc(4096, bufsz), &std::free);
+            for (;;) {
+                ssize_t n = read(fd, buf.get(), bufsz);
+                if (n > 0) { h.update(buf.get(), (size_t)n); continue; }
+                if (n < 0 && errno == EINTR) continue;
+                ok = (n == 0);
+                break;
+            }
+        }
+        close(fd);
+        return ok ? h.hex() : "";
+    }
+
+    // Batch API: hashes every path on the work pool; result[i] belongs to paths[i].
+    static std::vector<std::string> files(const std::vector<fs::path> &paths, unsigned jobs = 0) {
+        std::vector<std::string> out(paths.size());
+        parallel_for(paths.size(), jobs, [&](size_t i){ out[i] = file(paths[i]); });
+        return out;
+    }
+}
+
+// =============== ELF inspection ===============
+// In-process replacement for `file -b | grep ELF`: reads the ELF header and
+// the section header table (never the whole file) of native or foreign
+// class/endianness objects.
+namespace elf {
+    struct Info {
+        bool is_elf = false;
+        int bits = 0;               // 32 or 64
+        bool le = true;
+        uint16_t type = 0;          // ET_REL, ET_EXEC, ET_DYN, ...
+        uint16_t machine = 0;       // EM_*
+        bool has_symtab = false;    // .symtab present
+        bool has_debug = false;     // any .debug_* / .zdebug_* section
+        bool stripped() const { return !has_symtab && !has_debug; }
+        std::string type_name() const {
+            switch (type) { case ET_REL: return "rel"; case ET_EXEC: return "exec"; case ET_DYN: return "dyn"; case ET_CORE: return "core"; }
+            return "other";
+        }
+        std::string machine_name() const {
+            switch (machine) {
+                case EM_X86_64: return "x86-64"; case EM_386: return "i386"; case EM_AARCH64: return "aarch64";
+                case EM_ARM: return "arm"; case EM_RISCV: return "riscv"; case EM_PPC64: return "ppc64";
+                case EM_PPC: return "ppc"; case EM_S390: return "s390"; case EM_MIPS: return "mips";
+            }
+            return "em" + std::to_string(machine);
+        }
+    };
+
+    // Endian-aware field reader over a byte buffer.
+    struct Reader {
+        const uint8_t *p; size_t n; bool le;
+        uint64_t get(size_t off, int width) const {
+            if (off + width > n) return 0;
+            uint64_t v = 0;
+            for (int i = 0; i < width; ++i) v |= (uint64_t)p[off + (le ? i : width - 1 - i)] << (8 * i);
+            return v;
+        }
+        uint16_t u16(size_t off) const { return (uint16_t)get(off, 2); }
+        uint32_t u32(size_t off) const { return (uint32_t)get(off, 4); }
+        uint64_t u64(size_t off) const { return get(off, 8); }
+    };
+
+    static bool pread_all(int fd, void *buf, size_t len, uint64_t off) {
+        auto p = static_cast<uint8_t*>(buf);
+        while (len) {
+            ssize_t n = pread(fd, p, len, (off_t)off);
+            if (n < 0 && errno == EINTR) continue;
+            if (n <= 0) return false;
+            p += n; len -= (size_t)n; off += (uint64_t)n;
+        }
+        return true;
+    }
+
+    static Info classify_fd(int fd) {
+        Info in;
+        uint8_t h[64] = {};
+        ssize_t got = pread(fd, h, sizeof(h), 0);
+        if (got < 52 || std::memcmp(h, ELFMAG, SELFMAG) != 0) return in;
+        if (h[EI_CLASS] != ELFCLASS32 && h[EI_CLASS] != ELFCLASS64) return in;
+        if (h[EI_DATA] != ELFDATA2LSB && h[EI_DATA] != ELFDATA2MSB) return in;
+        in.bits = h[EI_CLASS] == ELFCLASS64 ? 64 : 32;
+        in.le = h[EI_DATA] == ELFDATA2LSB;
+        if (in.bits == 64 && got < 64) return in;
+        Reader r{h, (size_t)got, in.le};
+        in.is_elf = true;
+        in.type = r.u16(16);
+        in.machine = r.u16(18);
+
+        bool b64 = in.bits == 64;
+        uint64_t shoff = b64 ? r.u64(40) : r.u32(32);
+        uint16_t shentsize = r.u16(b64 ? 58 : 46);
+        uint64_t shnum = r.u16(b64 ? 60 : 48);
+        uint32_t shstrndx = r.u16(b64 ? 62 : 50);
+        if (!shoff || shentsize < (b64 ? 64 : 40)) return in;
+        if (shnum == 0 || shstrndx == SHN_XINDEX) {   // extended numbering lives in section 0
+            std::vector<uint8_t> s0(shentsize);
+            if (!pread_all(fd, s0.data(), shentsize, shoff)) return in;
+            Reader z{s0.data(), s0.size(), in.le};
+            if (shnum == 0) shnum = b64 ? z.u64(32) : z.u32(20);
+            if (shstrndx == SHN_XINDEX) shstrndx = z.u32(b64 ? 40 : 24);
+        }
+        if (shnum == 0 || shnum > 65536) return in;
+        std::vector<uint8_t> sh(shnum * shentsize);
+        if (!pread_all(fd, sh.data(), sh.size(), shoff)) return in;
+        Reader s{sh.data(), sh.size(), in.le};
+        auto sec_off = [&](size_t i){ return b64 ? s.u64(i*shentsize + 24) : s.u32(i*shentsize + 16); };
+        auto sec_size = [&](size_t i){ return b64 ? s.u64(i*shentsize + 32) : s.u32(i*shentsize + 20); };
+
+        std::string names;
+        if (shstrndx < shnum && sec_size(shstrndx) < (16u << 20)) {
+            names.resize(sec_size(shstrndx));
+            if (!pread_all(fd, names.data(), names.size(), sec_off(shstrndx))) names.clear();
+        }
+        for (size_t i = 0; i < shnum; ++i) {
+            if (s.u32(i*shentsize + 4) == SHT_SYMTAB) in.has_symtab = true;
+            uint32_t nm = s.u32(i*shentsize);
+            if (nm < names.size()) {
+                const char *n = names.c_str() + nm;
+                if (std::strncmp(n, ".debug_", 7) == 0 || std::strncmp(n, ".zdebug_", 8) == 0) in.has_debug = true;
+            }
+        }
+        return in;
+    }
+
+    static Info classify(const fs::path &p) {
+        int fd = open(p.c_str(), O_RDONLY | O_CLOEXEC | O_NOFOLLOW);
+        if (fd < 0) return {};
+        Info in = classify_fd(fd);
+        close(fd);
+        return in;
+    }
+
+    // Dynamic section contents needed to resolve an object's shared libraries.
+    struct Dynamic {
+        std::vector<std::string> needed, rpath, runpath;
+        std::string soname;
+        bool has_interp = false;    // PT_INTERP: an executable (PIE or not), or libc-style dual object
+    };
+
+    static std::vector<std::string> split_path_list(const std::string &s) {
+        std::vector<std::string> out;
+        std::stringstream ss(s);
+        for (std::string d; std::getline(ss, d, ':');) if (!d.empty()) out.push_back(d);
+        return out;
+    }
+
+    // Reads PT_DYNAMIC through the program headers, so it also works on
+    // objects whose section headers were stripped away.
+    struct Segment { uint32_t type; uint64_t off, vaddr, filesz; };
+
+    static std::vector<Segment> segments(int fd, const Info &in) {
+        std::vector<Segment> out;
+        if (!in.is_elf) return out;
+        bool b64 = in.bits == 64;
+        uint8_t h[64] = {};
+        if (!pread_all(fd, h, b64 ? 64 : 52, 0)) return out;
+        Reader r{h, sizeof(h), in.le};
+        uint64_t phoff = b64 ? r.u64(32) : r.u32(28);
+        uint16_t phentsize = r.u16(b64 ? 54 : 42), phnum = r.u16(b64 ? 56 : 44);
+        if (!phoff || !phnum || phentsize < (b64 ? 56 : 32)) return out;
+        std::vector<uint8_t> ph((size_t)phnum * phentsize);
+        if (!pread_all(fd, ph.data(), ph.size(), phoff)) return out;
+        Reader p{ph.data(), ph.size(), in.le};
+        for (size_t i = 0; i < phnum; ++i) {
+            size_t o = i * phentsize;
+            out.push_back(b64 ? Segment{p.u32(o), p.u64(o + 8), p.u64(o + 16), p.u64(o + 32)}
+                              : Segment{p.u32(o), p.u32(o + 4), p.u32(o + 8), p.u32(o + 16)});
+        }
+        return out;
+    }
+
+    // Hex NT_GNU_BUILD_ID from the PT_NOTE segments, or "" if there is none.
+    static std::string build_id(int fd, const Info &in) {
+        for (auto &s : segments(fd, in)) {
+            if (s.type != PT_NOTE || !s.filesz || s.filesz > (1u << 20)) continue;
+            std::vector<uint8_t> n(s.filesz);
+            if (!pread_all(fd, n.data(), n.size(), s.off)) continue;
+            Reader r{n.data(), n.size(), in.le};
+            for (size_t o = 0; o + 12 <= n.size();) {
+                uint32_t namesz = r.u32(o), descsz = r.u32(o + 4), type = r.u32(o + 8);
+                size_t name = o + 12, desc = name + ((namesz + 3) & ~3u);
+                if (desc + descsz > n.size()) break;
+                if (type == NT_GNU_BUILD_ID && namesz == 4 && std::memcmp(&n[name], "GNU", 4) == 0) {
+                    static const char *digits = "0123456789abcdef";
+                    std::string hex;
+                    for (size_t i = 0; i < descsz; ++i) { hex += digits[n[desc + i] >> 4]; hex += digits[n[desc + i] & 15]; }
+                    return hex;
+                }
+                o = desc + ((descsz + 3) & ~3u);
+            }
+        }
+        return "";
+    }
+
+    static Dynamic dynamic_fd(int fd, const Info &in) {
+        Dynamic dy;
+        bool b64 = in.bits == 64;
+        struct Seg { uint64_t off, vaddr, filesz; };
+        std::vector<Seg> loads;
+        Seg dyn{0, 0, 0};
+        for (auto &s : segments(fd, in)) {
+            if (s.type == PT_LOAD) loads.push_back({s.off, s.vaddr, s.filesz});
+            else if (s.type == PT_DYNAMIC) dyn = {s.off, s.vaddr, s.filesz};
+            else if (s.type == PT_INTERP) dy.has_interp = true;
+        }
+        if (!dyn.filesz || dyn.filesz > (16u << 20)) return dy;
+        std::vector<uint8_t> d(dyn.filesz);
+        if (!pread_all(fd, d.data(), d.size(), dyn.off)) return dy;
+        Reader dr{d.data(), d.size(), in.le};
+
+        size_t esz = b64 ? 16 : 8;
+        uint64_t strtab = 0, strsz = 0, soname = UINT64_MAX;
+        std::vector<uint64_t> needed, rpath, runpath;
+        for (size_t o = 0; o + esz <= d.size(); o += esz) {
+            int64_t tag = b64 ? (int64_t)dr.u64(o) : (int32_t)dr.u32(o);
+            uint64_t val = b64 ? dr.u64(o + 8) : dr.u32(o + 4);
+            if (tag == DT_NULL) break;
+            switch (tag) {
+                case DT_NEEDED: needed.push_back(val); break;
+                case DT_RPATH: rpath.push_back(val); break;
+                case DT_RUNPATH: runpath.push_back(val); break;
+                case DT_SONAME: soname = val; break;
+                case DT_STRTAB: strtab = val; break;
+                case DT_STRSZ: strsz = val; break;
+            }
+        }
+        // DT_STRTAB is a virtual address; map it back to a file offset.
+        uint64_t stroff = UINT64_MAX;
+        for (auto &s : loads) if (strtab >= s.vaddr && strtab < s.vaddr + s.filesz) { stroff = strtab - s.vaddr + s.off; break; }
+        if (stroff == UINT64_MAX || !strsz || strsz > (64u << 20)) return dy;
+        std::string str(strsz, '\0');
+        if (!pread_all(fd, str.data(), str.size(), stroff)) return dy;
+        auto at = [&](uint64_t off){ return off < str.size() ? std::string(str.c_str() + off) : std::string(); };
+        for (auto v : needed) dy.needed.push_back(at(v));
+        for (auto v : rpath) for (auto &x : split_path_list(at(v))) dy.rpath.push_back(x);
+        for (auto v : runpath) for (auto &x : split_path_list(at(v))) dy.runpath.push_back(x);
+        if (soname != UINT64_MAX) dy.soname = at(soname);
+        return dy;
+    }
+
+    // Classification and dynamic section in one open().
+    static Info inspect(const fs::path &p, Dynamic *dy) {
+        int fd = open(p.c_str(), O_RDONLY | O_CLOEXEC | O_NOFOLLOW);
+        if (fd < 0) return {};
+        Info in = classify_fd(fd);
+        if (dy) *dy = dynamic_fd(fd, in);
+        close(fd);
+        return in;
+    }
+}
+
+// =============== Shared library resolution ===============
+// Native stand-in for ldd: resolves DT_NEEDED against RPATH/RUNPATH, the
+// directories from /etc/ld.so.conf, the default lib dirs and the entries of
+// /etc/ld.so.cache, looking inside a staging tree before the host root.
+// Nothing from the inspected objects is ever executed.
+namespace ldso {
+    // soname -> library paths listed in ld.so.cache (glibc "new" format, 1.1).
+    static std::map<std::string, std::vector<std::string>> parse_cache(const fs::path &file) {
+        std::map<std::string, std::vector<std::string>> out;
+        std::ifstream in(file, std::ios::binary);
+        std::string data((std::istreambuf_iterator<char>(in)), std::istreambuf_iterator<char>());
+        static const std::string magic = "glibc-ld.so.cache1.1";
+        size_t base = data.find(magic);   // preceded by the old-format table in compat caches
+        if (base == std::string::npos || data.size() < base + 48) return out;
+        auto u32 = [&](size_t off){ uint32_t v; std::memcpy(&v, data.data() + off, 4); return v; };
+        uint32_t nlibs = u32(base + 20);
+        for (uint32_t i = 0; i < nlibs; ++i) {
+            size_t e = base + 48 + (size_t)i * 24;
+            if (e + 24 > data.size()) break;
+            uint32_t key = u32(e + 4), value = u32(e + 8);
+            if (base + key >= data.size() || base + value >= data.size()) continue;
+            out[data.c_str() + base + key].push_back(data.c_str() + base + value);
+        }
+        return out;
+    }
+
+    static void parse_conf(const fs::path &file, std::vector<std::string> &dirs, int depth = 0) {
+        std::ifstream in(file);
+        for (std::string line; depth < 8 && std::getline(in, line);) {
+            line = line.substr(0, line.find('#'));
+            std::istringstream iss(line);
+            std::string w; iss >> w;
+            if (w.empty()) continue;
+            if (w == "include") {
+                for (std::string pat; iss >> pat;) {
+                    if (pat[0] != '/') pat = (file.parent_path() / pat).string();
+                    glob_t g{};
+                    if (glob(pat.c_str(), 0, nullptr, &g) == 0)
+                        for (size_t i = 0; i < g.gl_pathc; ++i) parse_conf(g.gl_pathv[i], dirs, depth + 1);
+                    globfree(&g);
+                }
+            } else if (w != "hwcap") {
+                dirs.push_back(w);
+            }
+        }
+    }
+
+    struct System {
+        std::map<std::string, std::vector<std::string>> cache;
+        std::vector<std::string> conf_dirs;
+    };
+
+    static const System &system() {
+        static const System s = []{
+            System s;
+            s.cache = parse_cache("/etc/ld.so.cache");
+            parse_conf("/etc/ld.so.conf", s.conf_dirs);
+            return s;
+        }();
+        return s;
+    }
+
+    class Resolver {
+        fs::path staging;    // empty = host only
+        std::mutex mu;
+        std::map<std::string, bool> compat;   // "<bits>:<machine>:<path>" -> usable
+
+        bool usable(const fs::path &cand, const elf::Info &want) {
+            std::string key = std::to_string(want.bits) + ":" + std::to_string(want.machine) + ":" + cand.string();
+            {
+                std::lock_guard<std::mutex> lk(mu);
+                auto it = compat.find(key);
+                if (it != compat.end()) return it->second;
+            }
+            // Follow symlinks here: libfoo.so.1 -> libfoo.so.1.2.3 is the normal case.
+            bool ok = false;
+            int fd = open(cand.c_str(), O_RDONLY | O_CLOEXEC);
+            if (fd >= 0) {
+                auto in = elf::classify_fd(fd);
+                ok = in.is_elf && in.bits == want.bits && in.machine == want.machine;
+                close(fd);
+            }
+            std::lock_guard<std::mutex> lk(mu);
+            compat[key] = ok;
+            return ok;
+        }
+
+        // An installed directory is looked up in the staging tree first, then on the host.
+        bool found_in(const std::string &dir, const std::string &soname, const elf::Info &want) {
+            if (!staging.empty() && usable(staging / fs::path(dir).relative_path() / soname, want)) return true;
+            return usable(fs::path(dir) / soname, want);
+        }
+
+        static std::string expand(std::string d, const std::string &origin, int bits) {
+            auto sub = [&](const std::string &var, const std::string &val) {
+                for (auto v : {"$" + var, "${" + var + "}"})
+                    for (size_t p; (p = d.find(v)) != std::string::npos;) d.replace(p, v.size(), val);
+            };
+            sub("ORIGIN", origin);
+            sub("LIB", bits == 64 ? "lib64" : "lib");
+            return d;
+        }
+
+    public:
+        explicit Resolver(fs::path staging_root = {}) : staging(std::move(staging_root)) {}
+
+        // Sonames from dy.needed that cannot be found for an object installed at `installed`
+        // (its absolute path on the target system, e.g. /usr/bin/foo).
+        std::vector<std::string> missing(const std::string &installed, const elf::Info &in, const elf::Dynamic &dy) {
+            std::vector<std::string> out;
+            std::string origin = fs::path(installed).parent_path().string();
+            std::vector<std::string> dirs;
+            if (dy.runpath.empty()) for (auto &d : dy.rpath) dirs.push_back(expand(d, origin, in.bits));
+            for (auto &d : dy.runpath) dirs.push_back(expand(d, origin, in.bits));
+            const auto &sys = system();
+            for (auto &d : sys.conf_dirs) dirs.push_back(d);
+            if (in.bits == 64) for (auto d : {"/lib64", "/usr/lib64"}) dirs.push_back(d);
+            for (auto d : {"/lib", "/usr/lib"}) dirs.push_back(d);
+
+            for (auto &so : dy.needed) {
+                if (so.find('/') != std::string::npos) {
+                    if (!found_in(fs::path(so).parent_path().string(), fs::path(so).filename().string(), in)) out.push_back(so);
+                    continue;
+                }
+                bool ok = std::any_of(dirs.begin(), dirs.end(), [&](const std::string &d){ return found_in(d, so, in); });
+                if (!ok) {
+                    auto it = sys.cache.find(so);
+                    if (it != sys.cache.end())
+                        ok = std::any_of(it->second.begin(), it->second.end(), [&](const std::string &p){ return usable(p, in); });
+                }
+                if (!ok) out.push_back(so);
+            }
+            return out;
+        }
+    };
 }
 
-static bool run_cmd_checked(const std::string &cmd, const std::string &what, const std::string &logfile) {
+// =============== Helpers ===============
+static bool run_checked(const proc::Argv &argv, const std::string &what, const std::string &logfile, proc::Opts o = {}) {
     Spinner sp; sp.start(what);
-    std::string full = cmd + " >> '" + logfile + "' 2>&1";
-    int ec = std::system(full.c_str());
-    if (ec == 0) { sp.stop_ok(what + " — done"); return true; }
-    sp.stop_fail(what + " — error (code " + std::to_string(WEXITSTATUS(ec)) + ")");
+    proc::LogSink log(logfile);
+    o.out = log.sink();
+    auto r = proc::run(argv, o);
+    log.line("# " + what + ": " + proc::summary(r));
+    if (r.ok()) { sp.stop_ok(what + " — done"); return true; }
+    sp.stop_fail(what + " — error (code " + std::to_string(r.code) + ")");
     return false;
 }
 
-static std::string sha256_file(const fs::path &p) {
-    int ec=0; auto out = run_cmd("sha256sum '" + p.string() + "'", &ec);
-    if (ec != 0) return "";
-    std::istringstream iss(out);
-    std::string hash; iss >> hash; return hash;
+// Absolute path of an executable found in $PATH, or "".
+static std::string find_program(const std::string &name) {
+    const char *path = std::getenv("PATH");
+    std::stringstream ss(path ? path : "/usr/bin:/bin");
+    for (std::string dir; std::getline(ss, dir, ':');) {
+        if (dir.empty()) continue;
+        std::string cand = dir + "/" + name;
+        if (access(cand.c_str(), X_OK) == 0) return cand;
+    }
+    return "";
+}
+
+// IEEE CRC-32 (zlib/zip polynomial); pass the previous value as c to continue.
+static uint32_t crc32(const char *p, size_t n, uint32_t c = 0) {
+    static const auto table = []{
+        std::array<uint32_t, 256> t{};
+        for (uint32_t i = 0; i < 256; ++i) {
+            uint32_t v = i;
+            for (int k = 0; k < 8; ++k) v = (v & 1) ? 0xedb88320u ^ (v >> 1) : v >> 1;
+            t[i] = v;
+        }
+        return t;
+    }();
+    c = ~c;
+    for (size_t i = 0; i < n; ++i) c = table[(c ^ (uint8_t)p[i]) & 0xff] ^ (c >> 8);
+    return ~c;
 }
 
-static bool is_elf(const fs::path &p) {
-    int ec=0; auto out = run_cmd("file -b '" + p.string() + "'", &ec);
-    if (ec!=0) return false;
-    return out.find("ELF ") != std::string::npos;
+static std::string human_size(double bytes) {
+    const char *units[] = {"B", "KiB", "MiB", "GiB", "TiB"};
+    int u = 0;
+    while (std::abs(bytes) >= 1024 && u < 4) { bytes /= 1024; u++; }
+    char buf[32]; std::snprintf(buf, sizeof(buf), u ? "%.1f %s" : "%.0f %s", bytes, units[u]);
+    return buf;
 }
 
 static std::string ts_now() {
@@ -159,6 +1277,20 @@ struct Paths {
     fs::path state = root/".sbuild";
 };
 
+// Command-line switches shared by several commands.
+struct Options {
+    bool paranoid = false;  // --paranoid / SB_PARANOID: never trust cached hashes
+    bool all = false;       // --all: operate on every installed package
+    bool debuginfo = false; // --debuginfo / SB_DEBUGINFO: keep stripped debug info in name-dbg
+    bool overwrite = false; // --overwrite / SB_OVERWRITE: take over paths owned by other packages
+    bool cache = true;      // --no-cache / SB_NO_CACHE turns the build cache off
+    bool force = false;     // --force: rerun every phase, ignoring stamps and the build cache
+    std::string from;       // --from=<phase>: rerun from this phase on
+    bool transcode = false; // --transcode / SB_TRANSCODE: keep a multi-frame .tar.zst of verified sources
+    bool stream = true;     // SB_NO_STREAM turns off extracting tarballs while they download
+    unsigned jobs = 0;      // -j N / --jobs=N: concurrent downloads when fetching several recipes
+};
+
 static void ensure_dirs(const Paths &P) {
     fs::create_directories(P.recipes);
     fs::create_directories(P.sources);
@@ -174,10 +1306,14 @@ static void ensure_dirs(const Paths &P) {
 struct Recipe {
     std::string name, version, homepage, desc, license;
     std::string source_url; // http(s) URL to tarball/zip
+    std::vector<std::string> mirrors; // other URLs of the same file (an entry ending in / gets the file name appended)
     std::string git_url;    // optional git repo URL
+    std::string git_commit, git_tag; // commit= / tag= pin for git= (fetch_source sets git_commit to the commit it resolved)
     std::vector<std::string> patches; // http(s), git, or file path
+    std::map<std::string, std::string> patch_sha256; // patch -> sha256 its content must have ("<patch> sha256=<hex>" in patches=)
     std::string checksum;   // sha256 of source archive (optional)
     bool opt_strip = false;
+    bool opt_debuginfo = false; // split debug info into a name-dbg package when stripping
     bool opt_fakeroot = true;
     std::string pack_fmt = "zst"; // zst|xz|gz
 
@@ -213,15 +1349,39 @@ static bool parse_ini(const fs::path &file, Recipe &r) {
             else if (put("desc")) r.desc = val;
             else if (put("license")) r.license = val;
             else if (put("source")) r.source_url = val;
+            else if (put("mirrors")) {
+                r.mirrors.clear();
+                std::stringstream ss(val);
+                for (std::string item; std::getline(ss,item,',');) if (!trim(item).empty()) r.mirrors.push_back(trim(item));
+            }
             else if (put("git")) r.git_url = val;
+            else if (put("commit")) r.git_commit = val;
+            else if (put("tag")) r.git_tag = val;
             else if (put("checksum")) r.checksum = val;
             else if (put("strip")) r.opt_strip = (val=="1"||val=="true"||val=="yes");
+            else if (put("debuginfo")) r.opt_debuginfo = (val=="1"||val=="true"||val=="yes");
             else if (put("fakeroot")) r.opt_fakeroot = !(val=="0"||val=="false"||val=="no");
             else if (put("pack")) r.pack_fmt = val;
             else if (put("patches")) {
                 r.patches.clear();
+                r.patch_sha256.clear();
                 std::stringstream ss(val);
-                for (std::string item; std::getline(ss,item,',');) r.patches.push_back(trim(item));
+                for (std::string item; std::getline(ss,item,',');) {
+                    // Only a trailing " sha256=<hex>" is a pin; the rest (spaces included) is the path.
+                    std::string p = trim(item), sum;
+                    size_t sp = p.find_last_of(" \t");
+                    if (sp != std::string::npos && p.compare(sp + 1, 7, "sha256=") == 0) {
+                        std::string hex = p.substr(sp + 8);
+                        if (!hex.empty() && hex.find_first_not_of("0123456789abcdefABCDEF") == std::string::npos) {
+                            for (char &c : hex) c = (char)std::tolower((unsigned char)c);
+                            sum = hex;
+                            p = trim(p.substr(0, sp));
+                        }
+                    }
+                    if (p.empty()) continue;
+                    r.patches.push_back(p);
+                    if (!sum.empty()) r.patch_sha256[p] = sum;
+                }
             }
         } else if (sec=="build") {
             if (put("preconfig")) r.preconfig = val;
@@ -248,191 +1408,4361 @@ license=MIT
 desc=Short description.
 # Prefer one of: source= (tarball URL) or git=
 source=
+# other places serving the same file; the fastest answering one is used (list ending in / = directory)
+# mirrors=
 # git=
+# with git=: build this commit or tag (once the mirror has it, no network is used)
+# commit=
+# tag=
 # Optional sha256 of source archive (when using source=)
 checksum=
-# comma-separated list (https://..., git+https://..., file:///path)
+# comma-separated list (https://..., git+https://..., file:///path);
+# "<url> sha256=<hex>" pins the content of a patch
 patches=
 # options
 strip=true
+# keep stripped debug info in a separate name-dbg package
+debuginfo=false
 fakeroot=true
 pack=zst
 
-[build]
-# Commands run in extracted source directory. Env: DESTDIR, PREFIX (/usr), JOBS, MAKEFLAGS
-preconfig=
-config=./configure --prefix=/usr
-build=make -j$JOBS
-install=make DESTDIR="$DESTDIR" install
-postinstall=
+[build]
+# Commands run in extracted source directory. Env: DESTDIR, PREFIX (/usr), JOBS, MAKEFLAGS
+preconfig=
+config=./configure --prefix=/usr
+build=make -j$JOBS
+install=make DESTDIR="$DESTDIR" install
+postinstall=
+
+[hooks]
+postremove=
+postsync=
+)INI";
+}
+
+// =============== Global config ===============
+// .sbuild/config.ini: settings that apply to every recipe, same syntax as a
+// recipe. [mirrors] maps URL prefixes to alternatives for them:
+//   https://ftp.gnu.org/gnu/ = https://mirror.example/gnu/, http://10.0.0.5:8765/gnu/
+namespace config {
+    using Section = std::vector<std::pair<std::string, std::string>>;
+
+    static std::map<std::string, Section> load(const Paths &P) {
+        std::map<std::string, Section> out;
+        std::ifstream in(P.state / "config.ini");
+        std::string sec;
+        for (std::string line; std::getline(in, line);) {
+            line = trim(line);
+            if (line.empty() || line[0]=='#' || line[0]==';') continue;
+            if (line.front()=='[' && line.back()==']') { sec = line.substr(1, line.size()-2); continue; }
+            auto eq = line.find('=');
+            if (eq != std::string::npos) out[sec].emplace_back(trim(line.substr(0, eq)), trim(line.substr(eq + 1)));
+        }
+        return out;
+    }
+
+    // Last value of key in [section], or "" when unset.
+    static std::string get(const Paths &P, const std::string &section, const std::string &key) {
+        std::string v;
+        auto cfg = load(P);
+        for (auto &kv : cfg[section]) if (kv.first == key) v = kv.second;
+        return v;
+    }
+}
+
+// =============== Binary manifest ===============
+// manifest.bin, one per installed package, little-endian:
+//   Header   magic "SBMANIF1", entry count, restart interval, section offsets
+//   Records  count x 48 bytes, sorted by path: type (DT_*), flags, mode, size, sha256
+//   Blocks   one u64 per `restart` entries: offset of that block in the path table
+//   Paths    front-coded: varint shared-prefix length, varint suffix length, suffix;
+//            the first path of every block is stored whole
+// The file is mmap'ed as is; a lookup is a binary search over block heads
+// plus a short scan inside one block. manifest.txt is the text export.
+namespace manifest {
+    struct Header {
+        char magic[8];
+        uint32_t version, count, restart, nblocks;
+        uint64_t records_off, blocks_off, paths_off, paths_size;
+    };
+    struct Record {
+        uint8_t type;           // DT_REG, DT_DIR, DT_LNK, ...
+        uint8_t flags;          // F_ELF
+        uint16_t reserved;
+        uint32_t mode;
+        uint64_t size;
+        uint8_t sha256[32];     // file contents, symlink target, zero for directories
+    };
+    static_assert(sizeof(Record) == 48, "manifest record layout");
+    enum : uint8_t { F_ELF = 1 };
+    static const char MAGIC[8] = {'S', 'B', 'M', 'A', 'N', 'I', 'F', '1'};
+    static const uint32_t RESTART = 16;
+
+    struct Item { std::string path; Record rec{}; };
+
+    static std::string hex(const uint8_t *d, size_t n) {
+        static const char *digits = "0123456789abcdef";
+        std::string s;
+        for (size_t i = 0; i < n; ++i) { s += digits[d[i] >> 4]; s += digits[d[i] & 15]; }
+        return s;
+    }
+    static void unhex(const std::string &h, uint8_t out[32]) {
+        auto v = [](char c){ return c <= '9' ? c - '0' : (c | 0x20) - 'a' + 10; };
+        std::memset(out, 0, 32);
+        for (size_t i = 0; i + 1 < h.size() && i / 2 < 32; i += 2) out[i / 2] = (uint8_t)(v(h[i]) << 4 | v(h[i + 1]));
+    }
+    static const char *type_name(uint8_t t) {
+        switch (t) { case DT_REG: return "file"; case DT_DIR: return "dir"; case DT_LNK: return "link"; }
+        return "other";
+    }
+
+    static void put_varint(std::string &out, uint64_t v) {
+        do { uint8_t b = v & 0x7f; v >>= 7; out += (char)(b | (v ? 0x80 : 0)); } while (v);
+    }
+    static uint64_t get_varint(const uint8_t *&p, const uint8_t *end) {
+        uint64_t v = 0;
+        for (int s = 0; p < end && s < 64; s += 7) { uint8_t b = *p++; v |= (uint64_t)(b & 0x7f) << s; if (!(b & 0x80)) break; }
+        return v;
+    }
+
+    // Writes manifest.bin and its text export atomically (tmp + rename). Paths are sorted here.
+    static bool write(const fs::path &bin, const fs::path &txt, std::vector<Item> items) {
+        std::sort(items.begin(), items.end(), [](const Item &a, const Item &b){ return a.path < b.path; });
+        Header h{};
+        std::memcpy(h.magic, MAGIC, 8);
+        h.version = 1;
+        h.count = (uint32_t)items.size();
+        h.restart = RESTART;
+        h.nblocks = (h.count + RESTART - 1) / RESTART;
+        std::string paths;
+        std::vector<uint64_t> blocks;
+        for (size_t i = 0; i < items.size(); ++i) {
+            size_t shared = 0;
+            if (i % RESTART == 0) blocks.push_back(paths.size());
+            else {
+                auto &prev = items[i - 1].path, &cur = items[i].path;
+                while (shared < prev.size() && shared < cur.size() && prev[shared] == cur[shared]) shared++;
+            }
+            put_varint(paths, shared);
+            put_varint(paths, items[i].path.size() - shared);
+            paths.append(items[i].path, shared, std::string::npos);
+        }
+        h.records_off = sizeof(Header);
+        h.blocks_off = h.records_off + items.size() * sizeof(Record);
+        h.paths_off = h.blocks_off + blocks.size() * sizeof(uint64_t);
+        h.paths_size = paths.size();
+
+        std::string suffix = ".tmp" + std::to_string(getpid());
+        fs::path tmp = bin; tmp += suffix;
+        fs::path ttmp = txt; ttmp += suffix;
+        std::error_code ec;
+        auto fail = [&]{ fs::remove(tmp, ec); fs::remove(ttmp, ec); return false; };
+        {
+            std::ofstream o(tmp, std::ios::binary | std::ios::trunc);
+            o.write(reinterpret_cast<const char*>(&h), sizeof(h));
+            for (auto &it : items) o.write(reinterpret_cast<const char*>(&it.rec), sizeof(Record));
+            o.write(reinterpret_cast<const char*>(blocks.data()), blocks.size() * sizeof(uint64_t));
+            o.write(paths.data(), paths.size());
+            o.close();
+            if (!o) return fail();
+        }
+        {
+            std::ofstream o(ttmp, std::ios::trunc);
+            for (auto &it : items) {
+                char mode[16]; std::snprintf(mode, sizeof(mode), "%04o", it.rec.mode & 07777);
+                o << type_name(it.rec.type) << ' ' << mode << ' ' << it.rec.size << ' '
+                  << (it.rec.type == DT_DIR ? std::string("-") : hex(it.rec.sha256, 32)) << ' ' << it.path << "\n";
+            }
+            o.close();
+            if (!o) return fail();
+        }
+        fs::rename(tmp, bin, ec);
+        if (ec) return fail();
+        fs::rename(ttmp, txt, ec);
+        if (ec) { fs::remove(ttmp, ec); return false; }
+        return true;
+    }
+
+    // Read-only mmap view of a manifest.bin.
+    class View {
+        const uint8_t *base = nullptr;
+        size_t len = 0;
+        const Header *h = nullptr;
+        const Record *recs = nullptr;
+        const uint64_t *blocks = nullptr;
+        const uint8_t *paths = nullptr, *paths_end = nullptr;
+
+        // Decodes entries [block*restart, upto] of one block; calls f(index, path) for each.
+        template <class F> void decode_block(size_t block, size_t upto, F f) const {
+            const uint8_t *p = paths + blocks[block];
+            std::string cur;
+            for (size_t i = block * h->restart; i <= upto && i < h->count; ++i) {
+                uint64_t shared = get_varint(p, paths_end), n = get_varint(p, paths_end);
+                if (shared > cur.size() || n > (uint64_t)(paths_end - p)) return;
+                cur.resize(shared);
+                cur.append(reinterpret_cast<const char*>(p), n);
+                p += n;
+                if (!f(i, cur)) return;
+            }
+        }
+
+    public:
+        View() = default;
+        View(const View &) = delete;
+        View &operator=(const View &) = delete;
+        ~View() { if (base) munmap(const_cast<uint8_t*>(base), len); }
+
+        bool open(const fs::path &file) {
+            int fd = ::open(file.c_str(), O_RDONLY | O_CLOEXEC);
+            if (fd < 0) return false;
+            struct stat st{};
+            bool ok = fstat(fd, &st) == 0 && (size_t)st.st_size >= sizeof(Header);
+            void *m = ok ? mmap(nullptr, (size_t)st.st_size, PROT_READ, MAP_SHARED, fd, 0) : MAP_FAILED;
+            ::close(fd);
+            if (m == MAP_FAILED) return false;
+            base = static_cast<const uint8_t*>(m);
+            len = (size_t)st.st_size;
+            h = reinterpret_cast<const Header*>(base);
+            if (std::memcmp(h->magic, MAGIC, 8) != 0 || h->version != 1 || h->restart == 0 ||
+                h->records_off + (uint64_t)h->count * sizeof(Record) > len ||
+                h->blocks_off + (uint64_t)h->nblocks * 8 > len || h->paths_off + h->paths_size > len ||
+                h->nblocks != (h->count + h->restart - 1) / h->restart) {
+                munmap(const_cast<uint8_t*>(base), len);
+                base = nullptr; h = nullptr;
+                return false;
+            }
+            recs = reinterpret_cast<const Record*>(base + h->records_off);
+            blocks = reinterpret_cast<const uint64_t*>(base + h->blocks_off);
+            paths = base + h->paths_off;
+            paths_end = paths + h->paths_size;
+            for (size_t b = 0; b < h->nblocks; ++b) if (blocks[b] > h->paths_size) { h = nullptr; return false; }
+            return true;
+        }
+
+        size_t size() const { return h ? h->count : 0; }
+        const Record &record(size_t i) const { return recs[i]; }
+
+        std::string path(size_t i) const {
+            std::string out;
+            decode_block(i / h->restart, i, [&](size_t j, const std::string &p){ if (j == i) out = p; return true; });
+            return out;
+        }
+
+        // Index of path, or -1.
+        long find(const std::string &path) const {
+            if (!h || h->count == 0) return -1;
+            size_t lo = 0, hi = h->nblocks;       // last block whose head <= path
+            while (hi - lo > 1) {
+                size_t mid = (lo + hi) / 2;
+                if (this->path(mid * h->restart) <= path) lo = mid; else hi = mid;
+            }
+            long found = -1;
+            decode_block(lo, lo * h->restart + h->restart - 1, [&](size_t j, const std::string &p){
+                if (p == path) { found = (long)j; return false; }
+                return p < path;
+            });
+            return found;
+        }
+
+        // f(path, record) for every entry in path order.
+        template <class F> void each(F f) const {
+            for (size_t b = 0; h && b < h->nblocks; ++b)
+                decode_block(b, (b + 1) * h->restart - 1, [&](size_t j, const std::string &p){ f(p, recs[j]); return true; });
+        }
+    };
+
+    static fs::path bin_of(const fs::path &pkgdir) { return pkgdir / "manifest.bin"; }
+
+    // Every (path, type) of an installed package: from manifest.bin, or from a
+    // manifest.txt written before the binary format existed (paths only).
+    static std::vector<std::pair<std::string, uint8_t>> entries(const fs::path &pkgdir) {
+        std::vector<std::pair<std::string, uint8_t>> out;
+        View v;
+        if (v.open(bin_of(pkgdir))) {
+            out.reserve(v.size());
+            v.each([&](const std::string &p, const Record &r){ out.emplace_back(p, r.type); });
+            return out;
+        }
+        std::ifstream in(pkgdir / "manifest.txt");
+        for (std::string line; std::getline(in, line);) if (!line.empty() && line[0] == '/') out.emplace_back(line, DT_UNKNOWN);
+        return out;
+    }
+}
+
+// =============== Registry database ===============
+// .sbuild/registry.db holds one record per installed package (name, version,
+// install time, size, file count, build hash). The manifests themselves stay
+// in .sbuild/installed/<name>-<version>/. The file is an append-only log:
+//   "SBREGDB1", then records: u32 payload length, u32 crc32(op + payload), u8 op, payload
+// op 'P' (put) carries "key=value\n" lines, op 'D' (delete) the package id.
+// Each commit is one write() + fdatasync(); a torn or corrupt tail is cut off
+// on the next open, so a crash loses at most the commit in flight. Opening
+// replays the log into hash indexes by name-version and by name. When dead
+// records outnumber live ones the log is compacted through a tmp file + rename.
+namespace regdb {
+    static const char MAGIC[8] = {'S', 'B', 'R', 'E', 'G', 'D', 'B', '1'};
+
+    struct Pkg {
+        std::string name, version, time, build;
+        uint64_t size = 0, files = 0;
+        std::string id() const { return name + "-" + version; }
+    };
+
+    static std::string encode(const Pkg &p) {
+        std::ostringstream o;
+        o << "name=" << p.name << "\nversion=" << p.version << "\ntime=" << p.time
+          << "\nsize=" << p.size << "\nfiles=" << p.files << "\nbuild=" << p.build << "\n";
+        return o.str();
+    }
+    static Pkg decode(const std::string &s) {
+        Pkg p;
+        std::istringstream in(s);
+        for (std::string line; std::getline(in, line);) {
+            auto eq = line.find('=');
+            if (eq == std::string::npos) continue;
+            std::string k = line.substr(0, eq), v = line.substr(eq + 1);
+            if (k == "name") p.name = v;
+            else if (k == "version") p.version = v;
+            else if (k == "time") p.time = v;
+            else if (k == "build") p.build = v;
+            else if (k == "size") p.size = std::strtoull(v.c_str(), nullptr, 10);
+            else if (k == "files") p.files = std::strtoull(v.c_str(), nullptr, 10);
+        }
+        return p;
+    }
+
+    static std::string frame(char op, const std::string &payload) {
+        std::string body(1, op); body += payload;
+        uint32_t hdr[2] = {(uint32_t)payload.size(), crc32(body.data(), body.size())};
+        return std::string(reinterpret_cast<const char*>(hdr), sizeof(hdr)) + body;
+    }
+
+    class Db {
+        fs::path file;
+        std::unordered_map<std::string, Pkg> by_id;
+        std::unordered_map<std::string, std::set<std::string>> by_name;   // name -> ids
+        size_t records = 0;     // put/delete records in the log
+        off_t good_end = 0;     // end of the last intact record
+        dev_t dev = 0;          // the file good_end refers to (compaction replaces it)
+        ino_t ino = 0;
+
+        void apply(char op, const std::string &payload) {
+            if (op == 'P') {
+                Pkg p = decode(payload);
+                if (p.name.empty()) return;
+                by_id[p.id()] = p;
+                by_name[p.name].insert(p.id());
+            } else if (op == 'D') {
+                auto it = by_id.find(payload);
+                if (it == by_id.end()) return;
+                auto &ids = by_name[it->second.name];
+                ids.erase(payload);
+                if (ids.empty()) by_name.erase(it->second.name);
+                by_id.erase(it);
+            }
+        }
+
+        static std::string read_from(int fd, off_t from) {
+            std::string data;
+            char buf[1 << 16];
+            for (off_t off = from;;) {
+                ssize_t n = pread(fd, buf, sizeof(buf), off);
+                if (n <= 0) break;
+                data.append(buf, (size_t)n);
+                off += n;
+            }
+            return data;
+        }
+
+        // Applies the intact records in data (the file's bytes from good_end
+        // on) and moves good_end past them; a torn or corrupt record stops it.
+        void replay(const std::string &data) {
+            size_t off = 0;
+            while (off + 9 <= data.size()) {
+                uint32_t hdr[2];
+                std::memcpy(hdr, data.data() + off, sizeof(hdr));
+                if (hdr[0] > data.size() - off - 9) break;
+                const char *body = data.data() + off + 8;
+                if (crc32(body, hdr[0] + 1) != hdr[1]) break;
+                apply(body[0], std::string(body + 1, hdr[0]));
+                off += 9 + hdr[0];
+                records++;
+            }
+            good_end += (off_t)off;
+        }
+
+        void load_from(int fd) {
+            by_id.clear(); by_name.clear(); records = 0; good_end = 0; dev = 0; ino = 0;
+            struct stat st{};
+            if (fstat(fd, &st) != 0) return;
+            dev = st.st_dev; ino = st.st_ino;
+            std::string data = read_from(fd, 0);
+            if (data.size() < 8 || std::memcmp(data.data(), MAGIC, 8) != 0) return;
+            good_end = 8;
+            replay(data.substr(8));
+        }
+
+        // Opens the log locked for writing, with this Db caught up on what
+        // other processes committed since it was read: records past good_end
+        // are replayed, a log compacted meanwhile is read again. -1 on error.
+        int lock_latest() {
+            for (;;) {
+                int fd = ::open(file.c_str(), O_RDWR | O_CREAT | O_CLOEXEC, 0644);
+                if (fd < 0) return -1;
+                flock(fd, LOCK_EX);
+                struct stat a{}, b{};
+                if (fstat(fd, &a) != 0) { ::close(fd); return -1; }
+                // Replaced by a compaction while we waited: lock the new file instead.
+                if (::stat(file.c_str(), &b) != 0 || a.st_dev != b.st_dev || a.st_ino != b.st_ino) { ::close(fd); continue; }
+                if (a.st_dev != dev || a.st_ino != ino || a.st_size < good_end || good_end == 0) load_from(fd);
+                else if (a.st_size > good_end) replay(read_from(fd, good_end));
+                return fd;
+            }
+        }
+
+        // Only a torn tail is cut off: lock_latest() has taken in every intact record.
+        bool append(const std::string &rec) {
+            int fd = lock_latest();
+            if (fd < 0) return false;
+            bool ok = true;
+            if (good_end == 0) { ok = ftruncate(fd, 0) == 0 && ::pwrite(fd, MAGIC, 8, 0) == 8; good_end = 8; }
+            ok = ok && ftruncate(fd, good_end) == 0 && lseek(fd, good_end, SEEK_SET) == good_end &&
+                 ::write(fd, rec.data(), rec.size()) == (ssize_t)rec.size() && fdatasync(fd) == 0;
+            ::close(fd);
+            if (ok) { good_end += rec.size(); records++; }
+            return ok;
+        }
+
+        void maybe_compact() { if (records > 64 && records > 2 * by_id.size()) compact(); }
+
+    public:
+        explicit Db(fs::path f) : file(std::move(f)) {}
+
+        bool exists() const { return fs::exists(file); }
+
+        // Replays the log; a bad tail is dropped (and truncated on the next commit).
+        void load() {
+            int fd = ::open(file.c_str(), O_RDONLY | O_CLOEXEC);
+            if (fd < 0) { by_id.clear(); by_name.clear(); records = 0; good_end = 0; dev = 0; ino = 0; return; }
+            load_from(fd);
+            ::close(fd);
+        }
+
+        bool put(const Pkg &p) {
+            if (!append(frame('P', encode(p)))) return false;
+            apply('P', encode(p));
+            maybe_compact();
+            return true;
+        }
+
+        bool del(const std::string &id) {
+            if (!by_id.count(id)) return true;
+            if (!append(frame('D', id))) return false;
+            apply('D', id);
+            maybe_compact();
+            return true;
+        }
+
+        // Rewrites the log with one put per live package. The old log stays
+        // locked (and caught up) until the new one is renamed over it.
+        bool compact() {
+            int lfd = lock_latest();
+            if (lfd < 0) return false;
+            fs::path tmp = file; tmp += ".tmp" + std::to_string(getpid());
+            std::string out(MAGIC, 8);
+            for (auto &p : list()) out += frame('P', encode(*p));
+            int fd = ::open(tmp.c_str(), O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0644);
+            if (fd < 0) { ::close(lfd); return false; }
+            bool ok = ::write(fd, out.data(), out.size()) == (ssize_t)out.size() && fsync(fd) == 0;
+            struct stat st{};
+            ok = fstat(fd, &st) == 0 && ok;
+            ::close(fd);
+            std::error_code ec;
+            if (ok) fs::rename(tmp, file, ec);
+            if (!ok || ec) { fs::remove(tmp, ec); ::close(lfd); return false; }
+            int dfd = ::open(file.parent_path().c_str(), O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+            if (dfd >= 0) { fsync(dfd); ::close(dfd); }
+            ::close(lfd);
+            records = by_id.size();
+            good_end = (off_t)out.size();
+            dev = st.st_dev; ino = st.st_ino;
+            return true;
+        }
+
+        // By name-version, or by name when exactly one version is installed
+        // (the most recently installed one otherwise).
+        const Pkg *find(const std::string &key) const {
+            auto it = by_id.find(key);
+            if (it != by_id.end()) return &it->second;
+            auto n = by_name.find(key);
+            if (n == by_name.end()) return nullptr;
+            const Pkg *best = nullptr;
+            for (auto &id : n->second) {
+                auto &p = by_id.at(id);
+                if (!best || p.time > best->time) best = &p;
+            }
+            return best;
+        }
+
+        std::vector<const Pkg*> list() const {
+            std::vector<const Pkg*> v;
+            v.reserve(by_id.size());
+            for (auto &kv : by_id) v.push_back(&kv.second);
+            std::sort(v.begin(), v.end(), [](const Pkg *a, const Pkg *b){ return a->id() < b->id(); });
+            return v;
+        }
+
+        size_t size() const { return by_id.size(); }
+        size_t log_records() const { return records; }
+    };
+}
+
+// =============== Ownership index ===============
+// .sbuild/owners.idx maps every installed file and symlink path to the
+// package that owns it. Open-addressing (linear probing) table, little-endian:
+//   Header   magic "SBOWNER1", capacity (power of two), live/deleted slots, string pool size
+//   Slots    capacity x 16 bytes: FNV-1a hash of the path, path offset, package offset
+//   Strings  NUL-terminated paths and (interned) package ids
+// Lookups mmap the file and probe a handful of slots. Install and remove
+// load it, patch the entries of one package and write it back whole; it is
+// only built from all registry manifests when missing. That read-modify-rename
+// runs under an exclusive flock(owners.idx.lock) so parallel installs and
+// removes do not drop each other's entries.
+namespace owners {
+    struct Header {
+        char magic[8];
+        uint32_t version, capacity, used, deleted;
+        uint64_t strings_size, garbage;
+    };
+    struct Slot { uint64_t hash; uint32_t path, pkg; };
+    static_assert(sizeof(Slot) == 16, "owners slot layout");
+    static const char MAGIC[8] = {'S', 'B', 'O', 'W', 'N', 'E', 'R', '1'};
+    static const uint32_t EMPTY = 0xffffffffu, TOMB = 0xfffffffeu;
+
+    static fs::path file(const Paths &P) { return P.state / "owners.idx"; }
+
+    // Exclusive lock on the index across processes; nested locks in one thread are no-ops.
+    class Lock {
+        int fd = -1;
+        static inline thread_local int depth = 0;
+    public:
+        explicit Lock(const Paths &P) {
+            if (depth++) return;
+            fd = ::open((P.state / "owners.idx.lock").c_str(), O_RDWR | O_CREAT | O_CLOEXEC, 0644);
+            if (fd >= 0) while (flock(fd, LOCK_EX) != 0 && errno == EINTR) {}
+        }
+        ~Lock() { --depth; if (fd >= 0) ::close(fd); }
+        Lock(const Lock&) = delete;
+        Lock &operator=(const Lock&) = delete;
+    };
+
+    static uint64_t hash(const std::string &s) {
+        uint64_t h = 1469598103934665603ull;
+        for (unsigned char c : s) { h ^= c; h *= 1099511628211ull; }
+        return h;
+    }
+
+    // In-memory copy used to modify the index.
+    struct Table {
+        std::vector<Slot> slots;
+        std::string strings;
+        uint32_t used = 0, deleted = 0;
+        uint64_t garbage = 0;
+        std::map<std::string, uint32_t> pkgs;   // interned package ids
+
+        Table() { slots.assign(1024, Slot{0, EMPTY, EMPTY}); }
+
+        const char *str(uint32_t off) const { return strings.c_str() + off; }
+        uint32_t add_string(const std::string &s) {
+            uint32_t off = (uint32_t)strings.size();
+            strings.append(s); strings += '\0';
+            return off;
+        }
+        uint32_t intern(const std::string &pkg) {
+            auto it = pkgs.find(pkg);
+            if (it != pkgs.end()) return it->second;
+            return pkgs[pkg] = add_string(pkg);
+        }
+
+        long probe(const std::string &path, uint64_t h) const {
+            size_t mask = slots.size() - 1;
+            for (size_t i = h & mask, n = 0; n < slots.size(); i = (i + 1) & mask, ++n) {
+                auto &s = slots[i];
+                if (s.path == EMPTY) return -1;
+                if (s.path != TOMB && s.hash == h && path == str(s.path)) return (long)i;
+            }
+            return -1;
+        }
+
+        std::string owner(const std::string &path) const {
+            long i = probe(path, hash(path));
+            return i < 0 ? std::string() : std::string(str(slots[i].pkg));
+        }
+
+        // Re-inserts live slots into a table of `cap` slots and drops dead strings.
+        void rehash(size_t cap) {
+            std::vector<std::pair<std::string, std::string>> live;
+            live.reserve(used);
+            for (auto &s : slots) if (s.path < TOMB) live.emplace_back(str(s.path), str(s.pkg));
+            slots.assign(cap, Slot{0, EMPTY, EMPTY});
+            strings.clear(); pkgs.clear();
+            used = deleted = 0; garbage = 0;
+            for (auto &[p, o] : live) set(p, o);
+        }
+
+        void set(const std::string &path, const std::string &pkg) {
+            uint64_t h = hash(path);
+            long i = probe(path, h);
+            if (i >= 0) { slots[i].pkg = intern(pkg); return; }
+            if ((used + deleted + 1) * 10 > slots.size() * 7) {
+                size_t cap = slots.size();
+                while ((used + 1) * 10 > cap * 5) cap *= 2;
+                rehash(cap);
+            }
+            size_t mask = slots.size() - 1, j = h & mask;
+            while (slots[j].path < TOMB) j = (j + 1) & mask;
+            if (slots[j].path == TOMB) deleted--;
+            slots[j] = Slot{h, add_string(path), intern(pkg)};
+            used++;
+        }
+
+        // Drops path if pkg still owns it (another package may have taken it over).
+        void erase(const std::string &path, const std::string &pkg) {
+            long i = probe(path, hash(path));
+            if (i < 0 || pkg != str(slots[i].pkg)) return;
+            garbage += path.size() + 1;
+            slots[i].path = TOMB;
+            used--; deleted++;
+        }
+
+        bool load(const fs::path &f) {
+            std::ifstream in(f, std::ios::binary);
+            Header h{};
+            if (!in.read(reinterpret_cast<char*>(&h), sizeof(h)) || std::memcmp(h.magic, MAGIC, 8) != 0 ||
+                h.version != 1 || h.capacity == 0 || (h.capacity & (h.capacity - 1))) return false;
+            slots.resize(h.capacity);
+            strings.resize(h.strings_size);
+            if (!in.read(reinterpret_cast<char*>(slots.data()), h.capacity * sizeof(Slot)) ||
+                !in.read(&strings[0], h.strings_size)) return false;
+            used = h.used; deleted = h.deleted; garbage = h.garbage;
+            pkgs.clear();
+            for (auto &s : slots) {
+                if (s.path >= TOMB) continue;
+                if (s.path >= strings.size() || s.pkg >= strings.size()) return false;
+                pkgs.emplace(str(s.pkg), s.pkg);
+            }
+            return true;
+        }
+
+        bool save(const fs::path &f) {
+            if (garbage * 2 > strings.size()) rehash(slots.size());
+            Header h{};
+            std::memcpy(h.magic, MAGIC, 8);
+            h.version = 1;
+            h.capacity = (uint32_t)slots.size();
+            h.used = used; h.deleted = deleted;
+            h.strings_size = strings.size(); h.garbage = garbage;
+            fs::path tmp = f; tmp += ".tmp" + std::to_string(getpid());
+            {
+                std::ofstream o(tmp, std::ios::binary | std::ios::trunc);
+                o.write(reinterpret_cast<const char*>(&h), sizeof(h));
+                o.write(reinterpret_cast<const char*>(slots.data()), slots.size() * sizeof(Slot));
+                o.write(strings.data(), strings.size());
+                if (!o) return false;
+            }
+            std::error_code ec; fs::rename(tmp, f, ec);
+            return !ec;
+        }
+    };
+
+    static Table rebuild(const Paths &P) {
+        Lock lk(P);
+        Table t;
+        std::error_code ec;
+        for (auto &d : fs::directory_iterator(P.registry, ec)) {
+            if (!d.is_directory() || !fs::exists(d.path()/"manifest.txt")) continue;
+            std::string pkg = d.path().filename().string();
+            for (auto &[p, type] : manifest::entries(d.path())) if (type != DT_DIR) t.set(p, pkg);
+        }
+        t.save(file(P));
+        return t;
+    }
+
+    static Table load(const Paths &P) {
+        Table t;
+        if (t.load(file(P))) return t;
+        return rebuild(P);
+    }
+
+    // Owner of one path, straight from the mapped file; "" when unowned.
+    static std::string lookup(const Paths &P, const std::string &path) {
+        if (!fs::exists(file(P))) rebuild(P);
+        int fd = ::open(file(P).c_str(), O_RDONLY | O_CLOEXEC);
+        if (fd < 0) return {};
+        struct stat st{};
+        std::string out;
+        if (fstat(fd, &st) == 0 && (size_t)st.st_size >= sizeof(Header)) {
+            void *m = mmap(nullptr, (size_t)st.st_size, PROT_READ, MAP_SHARED, fd, 0);
+            if (m != MAP_FAILED) {
+                auto base = static_cast<const uint8_t*>(m);
+                auto h = reinterpret_cast<const Header*>(base);
+                uint64_t strings_off = sizeof(Header) + (uint64_t)h->capacity * sizeof(Slot);
+                if (std::memcmp(h->magic, MAGIC, 8) == 0 && h->capacity && !(h->capacity & (h->capacity - 1)) &&
+                    strings_off + h->strings_size <= (uint64_t)st.st_size) {
+                    auto slots = reinterpret_cast<const Slot*>(base + sizeof(Header));
+                    auto strings = reinterpret_cast<const char*>(base + strings_off);
+                    auto str_ok = [&](uint32_t off){ return off < h->strings_size && memchr(strings + off, 0, h->strings_size - off); };
+                    uint64_t hv = hash(path);
+                    size_t mask = h->capacity - 1;
+                    for (size_t i = hv & mask, n = 0; n < h->capacity; i = (i + 1) & mask, ++n) {
+                        auto &s = slots[i];
+                        if (s.path == EMPTY) break;
+                        if (s.path == TOMB || s.hash != hv || !str_ok(s.path) || path != strings + s.path) continue;
+                        if (str_ok(s.pkg)) out = strings + s.pkg;
+                        break;
+                    }
+                }
+                munmap(m, (size_t)st.st_size);
+            }
+        }
+        ::close(fd);
+        return out;
+    }
+
+    // Moves pkg from the paths of its previous manifest to its new ones.
+    static void update(const Paths &P, const std::string &pkg, const std::vector<std::string> &old_paths, const std::vector<std::string> &new_paths) {
+        Lock lk(P);
+        Table t = load(P);
+        for (auto &p : old_paths) t.erase(p, pkg);
+        for (auto &p : new_paths) t.set(p, pkg);
+        t.save(file(P));
+    }
+
+    static void drop(const Paths &P, const std::string &pkg, const std::vector<std::string> &paths) { update(P, pkg, paths, {}); }
+}
+
+// =============== Registry and manifests ===============
+static fs::path pkg_id_dir(const Paths &P, const Recipe &r) {
+    return P.registry / (r.name + "-" + r.version);
+}
+static fs::path pkg_manifest(const Paths &P, const Recipe &r) {
+    return pkg_id_dir(P,r)/"manifest.txt";
+}
+
+// Installed size and file count of a registry entry, from its manifest.
+static void manifest_totals(const Paths &P, const fs::path &pkgdir, regdb::Pkg &p) {
+    p.size = p.files = 0;
+    manifest::View v;
+    if (v.open(manifest::bin_of(pkgdir))) {
+        v.each([&](const std::string &, const manifest::Record &rec){
+            if (rec.type == DT_DIR) return;
+            p.files++;
+            if (rec.type == DT_REG) p.size += rec.size;
+        });
+        return;
+    }
+    fs::path staging = P.destdir / pkgdir.filename();
+    for (auto &[path, type] : manifest::entries(pkgdir)) {
+        struct stat st{};
+        p.files++;
+        if (lstat((staging / fs::path(path).relative_path()).c_str(), &st) == 0 && S_ISREG(st.st_mode)) p.size += st.st_size;
+    }
+}
+
+// The registry database; created on first use from the meta.ini files of the
+// old one-directory-per-package layout (which are then removed).
+static regdb::Db open_registry(const Paths &P) {
+    regdb::Db db(P.state / "registry.db");
+    if (db.exists()) { db.load(); return db; }
+    std::vector<fs::path> migrated;
+    std::error_code ec;
+    for (auto &d : fs::directory_iterator(P.registry, ec)) {
+        if (!d.is_directory() || !fs::exists(d.path()/"meta.ini")) continue;
+        regdb::Pkg p;
+        std::ifstream in(d.path()/"meta.ini");
+        for (std::string line; std::getline(in, line);) {
+            auto eq = line.find('=');
+            if (eq == std::string::npos) continue;
+            if (line.compare(0, eq, "name") == 0) p.name = line.substr(eq + 1);
+            else if (line.compare(0, eq, "version") == 0) p.version = line.substr(eq + 1);
+            else if (line.compare(0, eq, "time") == 0) p.time = line.substr(eq + 1);
+        }
+        if (p.name.empty() || p.id() != d.path().filename().string()) continue;
+        manifest_totals(P, d.path(), p);
+        if (db.put(p)) migrated.push_back(d.path()/"meta.ini");
+    }
+    if (!db.exists()) db.compact();   // nothing to migrate: start an empty log
+    for (auto &m : migrated) fs::remove(m, ec);
+    if (!migrated.empty()) term::info("registry: migrated " + std::to_string(migrated.size()) + " package(s) to " + (P.state / "registry.db").string());
+    return db;
+}
+
+static void save_meta(const Paths &P, const Recipe &r, const std::string &build = {}) {
+    regdb::Pkg p;
+    p.name = r.name;
+    p.version = r.version;
+    p.time = ts_now();
+    p.build = build;
+    manifest_totals(P, pkg_id_dir(P,r), p);
+    auto db = open_registry(P);
+    if (!db.put(p)) term::warn("registry: could not record " + p.id());
+}
+
+// Staging tree of the separate debug info package (name-dbg).
+static fs::path dbg_staging(const Paths &P, const std::string &name, const std::string &version) {
+    return P.destdir / (name + "-dbg-" + version);
+}
+
+static fs::path pkg_elf_list(const Paths &P, const Recipe &r) {
+    return pkg_id_dir(P,r)/"elf.txt";
+}
+
+// Package name of an installed package id.
+static std::string installed_name(const regdb::Db &db, const std::string &id) {
+    auto p = db.find(id);
+    return p && p->id() == id ? p->name : std::string();
+}
+
+// Records files, symlinks and directories of the staging tree with mode, size
+// and content hash (hashed and ELF-classified on the work pool) into
+// manifest.bin + manifest.txt; elf.txt lists the ELF objects as
+// "<type> <bits> <machine> <path>" for revdep.
+// Paths already owned by another package are reported and nothing is
+// registered, unless overwrite is set (--overwrite); other versions of the
+// same package are upgrades and simply take their paths over.
+static bool save_manifest_from_destdir(const Paths &P, const Recipe &r, const fs::path &staging, bool overwrite) {
+    auto entries = walk::tree(staging, {true, 0});
+    std::vector<manifest::Item> items(entries.size());
+    std::vector<elf::Info> info(entries.size());
+    parallel_for(entries.size(), 0, [&](size_t i){
+        auto &e = entries[i];
+        auto &it = items[i];
+        it.path = "/" + e.rel;
+        it.rec.type = e.type;
+        it.rec.mode = e.mode;
+        it.rec.size = e.type == DT_DIR ? 0 : e.size;
+        fs::path full = staging / e.rel;
+        if (e.type == DT_REG) {
+            manifest::unhex(sha256::file(full), it.rec.sha256);
+            info[i] = elf::classify(full);
+            if (info[i].is_elf) it.rec.flags |= manifest::F_ELF;
+        } else if (e.type == DT_LNK) {
+            std::error_code ec;
+            manifest::unhex(sha256::bytes(fs::read_symlink(full, ec).string()), it.rec.sha256);
+        }
+    });
+    std::string id = r.name + "-" + r.version;
+    std::vector<std::string> owned;
+    for (auto &it : items) if (it.rec.type != DT_DIR) owned.push_back(it.path);
+    owners::Lock lk(P);   // from the conflict check until the index records the new paths
+    {
+        auto index = owners::load(P);
+        auto db = open_registry(P);
+        std::map<std::string, bool> same;   // owner id -> is another version of r
+        std::vector<std::string> conflicts;
+        for (auto &p : owned) {
+            std::string o = index.owner(p);
+            if (o.empty() || o == id) continue;
+            if (!same.count(o)) same[o] = installed_name(db, o) == r.name;
+            if (!same[o]) conflicts.push_back(p + " (" + o + ")");
+        }
+        if (!conflicts.empty()) {
+            for (size_t i = 0; i < conflicts.size() && i < 20; ++i) (overwrite ? term::warn : term::err)("conflict: " + conflicts[i]);
+            if (conflicts.size() > 20) term::info("... " + std::to_string(conflicts.size() - 20) + " more");
+            if (!overwrite) { term::err(id + ": " + std::to_string(conflicts.size()) + " path(s) owned by other packages; not registered (--overwrite to take them over)"); return false; }
+        }
+    }
+    std::vector<std::string> previous;
+    for (auto &[p, type] : manifest::entries(pkg_id_dir(P,r))) if (type != DT_DIR) previous.push_back(p);
+
+    fs::create_directories(pkg_id_dir(P,r));
+    if (!manifest::write(manifest::bin_of(pkg_id_dir(P,r)), pkg_manifest(P,r), items)) {
+        term::err(id + ": could not write " + pkg_manifest(P,r).string() + "; not registered");
+        return false;
+    }
+    std::vector<std::string> elves;
+    for (size_t i = 0; i < entries.size(); ++i)
+        if (info[i].is_elf) elves.push_back(info[i].type_name() + " " + std::to_string(info[i].bits) + " " + info[i].machine_name() + " " + items[i].path);
+    std::sort(elves.begin(), elves.end(), [](const std::string &a, const std::string &b){
+        return a.substr(a.find(" /")) < b.substr(b.find(" /"));
+    });
+    std::ofstream ef(pkg_elf_list(P,r));
+    for (auto &l : elves) ef << l << "\n";
+    owners::update(P, id, previous, owned);
+    return true;
+}
+
+// =============== Soname index ===============
+// .sbuild/sonames.idx records which installed package provides or needs each soname:
+//   P <soname> <pkg> <path>   <path> in <pkg> is a shared object answering to <soname>
+//   N <soname> <pkg> <path>   <path> in <pkg> has DT_NEEDED <soname>
+// It is built from every registry manifest the first time it is needed and
+// then patched one package at a time on install and remove, under the
+// ownership index lock (owners::Lock).
+namespace sonames {
+    struct Row {
+        char kind;
+        std::string soname, pkg, path;
+        bool operator<(const Row &o) const { return std::tie(pkg, path, kind, soname) < std::tie(o.pkg, o.path, o.kind, o.soname); }
+    };
+
+    static fs::path file(const Paths &P) { return P.state / "sonames.idx"; }
+
+    static bool looks_like_soname(const std::string &n) {
+        return n.rfind("lib", 0) == 0 && n.find(".so") != std::string::npos;
+    }
+
+    // Rows for one package, from its manifest and its staging tree (inspected on the work pool).
+    static std::vector<Row> scan_package(const fs::path &staging, const std::string &pkg, const fs::path &pkgdir) {
+        std::vector<std::string> paths;
+        for (auto &[p, type] : manifest::entries(pkgdir)) if (type != DT_DIR) paths.push_back(p);
+        std::vector<std::vector<Row>> per(paths.size());
+        parallel_for(paths.size(), 0, [&](size_t i){
+            fs::path full = staging / fs::path(paths[i]).relative_path();
+            std::string base = fs::path(paths[i]).filename().string();
+            struct stat st{};
+            if (lstat(full.c_str(), &st) != 0) return;
+            if (S_ISLNK(st.st_mode)) {
+                // libfoo.so / libfoo.so.1 links count as providers of their own name.
+                if (!looks_like_soname(base)) return;
+                int fd = open(full.c_str(), O_RDONLY | O_CLOEXEC);
+                if (fd < 0) return;
+                auto e = elf::classify_fd(fd);
+                close(fd);
+                if (e.is_elf && e.type == ET_DYN) per[i].push_back({'P', base, pkg, paths[i]});
+                return;
+            }
+            if (!S_ISREG(st.st_mode)) return;
+            elf::Dynamic dy;
+            auto e = elf::inspect(full, &dy);
+            if (!e.is_elf) return;
+            if (e.type == ET_DYN) {
+                if (!dy.soname.empty()) per[i].push_back({'P', dy.soname, pkg, paths[i]});
+                if (looks_like_soname(base) && base != dy.soname) per[i].push_back({'P', base, pkg, paths[i]});
+            }
+            for (auto &so : dy.needed) per[i].push_back({'N', so, pkg, paths[i]});
+        });
+        std::vector<Row> rows;
+        for (auto &v : per) rows.insert(rows.end(), v.begin(), v.end());
+        return rows;
+    }
+
+    static void save(const Paths &P, std::vector<Row> &rows) {
+        std::sort(rows.begin(), rows.end());
+        fs::path tmp = file(P); tmp += ".tmp" + std::to_string(getpid());
+        {
+            std::ofstream o(tmp);
+            for (auto &r : rows) o << r.kind << ' ' << r.soname << ' ' << r.pkg << ' ' << r.path << "\n";
+        }
+        std::error_code ec; fs::rename(tmp, file(P), ec);
+    }
+
+    static std::vector<Row> rebuild(const Paths &P) {
+        owners::Lock lk(P);
+        std::vector<Row> rows;
+        std::error_code ec;
+        for (auto &d : fs::directory_iterator(P.registry, ec)) {
+            if (!d.is_directory() || !fs::exists(d.path()/"manifest.txt")) continue;
+            std::string pkg = d.path().filename().string();
+            auto v = scan_package(P.destdir / pkg, pkg, d.path());
+            rows.insert(rows.end(), v.begin(), v.end());
+        }
+        save(P, rows);
+        return rows;
+    }
+
+    static std::vector<Row> load(const Paths &P) {
+        if (!fs::exists(file(P))) return rebuild(P);
+        std::vector<Row> rows;
+        std::ifstream in(file(P));
+        for (std::string line; std::getline(in, line);) {
+            std::istringstream iss(line);
+            Row r;
+            if (!(iss >> r.kind >> r.soname >> r.pkg)) continue;
+            std::getline(iss >> std::ws, r.path);
+            rows.push_back(std::move(r));
+        }
+        return rows;
+    }
+
+    static void replace_package(const Paths &P, const std::string &pkg, const std::vector<Row> &fresh) {
+        owners::Lock lk(P);
+        auto rows = load(P);
+        rows.erase(std::remove_if(rows.begin(), rows.end(), [&](const Row &r){ return r.pkg == pkg; }), rows.end());
+        rows.insert(rows.end(), fresh.begin(), fresh.end());
+        save(P, rows);
+    }
+
+    static void update(const Paths &P, const std::string &pkg, const fs::path &staging, const fs::path &pkgdir) {
+        auto fresh = scan_package(staging, pkg, pkgdir);   // outside the lock
+        replace_package(P, pkg, fresh);
+    }
+
+    static void drop(const Paths &P, const std::string &pkg) { replace_package(P, pkg, {}); }
+
+    static std::set<std::string> provided(const std::vector<Row> &rows) {
+        std::set<std::string> s;
+        for (auto &r : rows) if (r.kind == 'P') s.insert(r.soname);
+        return s;
+    }
+}
+
+// =============== Verified-hash cache ===============
+// sha256 of files under sources/, stored with a stat stamp. While the stamp
+// (dev, inode, size, mtime_ns) still matches, the file is not read again.
+// One line per file: <sha256> <dev> <ino> <size> <mtime_ns> <path>
+namespace hashcache {
+    struct Stamp {
+        uint64_t dev = 0, ino = 0, size = 0;
+        int64_t mtime_ns = 0;
+        bool operator==(const Stamp &o) const { return dev==o.dev && ino==o.ino && size==o.size && mtime_ns==o.mtime_ns; }
+    };
+    struct Entry { Stamp st; std::string sha; };
+
+    static std::mutex mu;
+
+    static bool stamp_of(const fs::path &f, Stamp &s) {
+        struct stat st{};
+        if (stat(f.c_str(), &st) != 0 || !S_ISREG(st.st_mode)) return false;
+        s.dev = st.st_dev; s.ino = st.st_ino; s.size = (uint64_t)st.st_size;
+        s.mtime_ns = (int64_t)st.st_mtim.tv_sec * 1000000000 + st.st_mtim.tv_nsec;
+        return true;
+    }
+
+    static fs::path db(const Paths &P) { return P.cache / "verified.txt"; }
+
+    static std::map<std::string, Entry> load(const Paths &P) {
+        std::map<std::string, Entry> m;
+        std::ifstream in(db(P));
+        for (std::string line; std::getline(in, line);) {
+            std::istringstream iss(line);
+            Entry e; std::string path;
+            if (!(iss >> e.sha >> e.st.dev >> e.st.ino >> e.st.size >> e.st.mtime_ns)) continue;
+            std::getline(iss >> std::ws, path);
+            if (!path.empty()) m[path] = e;
+        }
+        return m;
+    }
+
+    // Re-reads the file before writing, under flock(verified.txt.lock), so
+    // concurrent sbuild runs do not drop each other's entries.
+    static void store(const Paths &P, const fs::path &f, const Entry &e) {
+        std::lock_guard<std::mutex> lk(mu);
+        fs::path lockf = db(P); lockf += ".lock";
+        struct FileLock { int fd; ~FileLock() { if (fd >= 0) ::close(fd); } } flk{::open(lockf.c_str(), O_RDWR | O_CREAT | O_CLOEXEC, 0644)};
+        if (flk.fd >= 0) flock(flk.fd, LOCK_EX);
+        auto m = load(P);
+        m[fs::absolute(f).string()] = e;
+        fs::path tmp = db(P); tmp += ".tmp" + std::to_string(getpid());
+        {
+            std::ofstream o(tmp);
+            for (auto &[path, x] : m)
+                o << x.sha << ' ' << x.st.dev << ' ' << x.st.ino << ' ' << x.st.size << ' ' << x.st.mtime_ns << ' ' << path << "\n";
+        }
+        std::error_code ec; fs::rename(tmp, db(P), ec);
+    }
+
+    // Cached sha256 of f, or "" when there is no entry with a matching stamp.
+    static std::string lookup(const Paths &P, const fs::path &f) {
+        Stamp now; if (!stamp_of(f, now)) return "";
+        std::lock_guard<std::mutex> lk(mu);
+        auto m = load(P);
+        auto it = m.find(fs::absolute(f).string());
+        return (it != m.end() && it->second.st == now) ? it->second.sha : "";
+    }
+}
+
+// sha256 of f, served from the stamp cache unless paranoid. *cached tells which path was taken.
+static std::string verified_sha256(const Paths &P, const fs::path &f, bool paranoid, bool *cached=nullptr) {
+    if (cached) *cached = false;
+    if (!paranoid) {
+        auto hit = hashcache::lookup(P, f);
+        if (!hit.empty()) { if (cached) *cached = true; return hit; }
+    }
+    hashcache::Entry e;
+    if (!hashcache::stamp_of(f, e.st)) return "";
+    e.sha = sha256::file(f);
+    // Only remember the result if the file did not change while it was read.
+    hashcache::Stamp after;
+    if (!e.sha.empty() && hashcache::stamp_of(f, after) && after == e.st) hashcache::store(P, f, e);
+    return e.sha;
+}
+
+// =============== Source store ===============
+// Optional content-addressed store shared by every project root: SB_STORE,
+// or path= under [store] in .sbuild/config.ini (SB_STORE= turns it off).
+// Verified sources are kept read-only as <store>/sha256/<2 hex>/<sha256>;
+// a root that needs a file with a known checksum gets it in sources/ as a
+// reflink or hardlink of that object (a copy across filesystems) instead of
+// downloading it again.
+namespace store {
+    static fs::path root(const Paths &P) {
+        if (const char *s = std::getenv("SB_STORE")) return fs::path(s);
+        return fs::path(config::get(P, "store", "path"));
+    }
+
+    static bool valid(const std::string &sha) {
+        return sha.size() == 64 && std::all_of(sha.begin(), sha.end(), [](char c){ return std::isxdigit((unsigned char)c) && !std::isupper((unsigned char)c); });
+    }
+
+    static fs::path object(const fs::path &root, const std::string &sha) { return root / "sha256" / sha.substr(0, 2) / sha; }
+
+    // Puts the stored object for sha at dest; false when there is none. *how
+    // says whether it was reflinked, hardlinked or copied. dest's stamp goes
+    // into the verified-hash cache, so checking it afterwards reads nothing.
+    static bool take(const Paths &P, const std::string &sha, const fs::path &dest, std::string *how = nullptr) {
+        fs::path r = root(P);
+        if (r.empty() || !valid(sha)) return false;
+        fs::path obj = object(r, sha), tmp = dest;
+        tmp += ".store" + std::to_string(getpid());
+        std::error_code ec;
+        if (!fs::is_regular_file(obj, ec)) return false;
+        fs::remove(tmp, ec);
+        treecopy::Stats st;
+        if (!treecopy::file(obj, tmp, true, &st)) { fs::remove(tmp, ec); return false; }
+        fs::rename(tmp, dest, ec);
+        if (ec) { fs::remove(tmp, ec); return false; }
+        if (how) *how = st.reflinked ? "reflinked" : st.linked ? "hardlinked" : "copied";
+        hashcache::Entry e;
+        if (hashcache::stamp_of(dest, e.st)) { e.sha = sha; hashcache::store(P, dest, e); }
+        return true;
+    }
+
+    // Adds f, whose sha256 was just verified, unless the store already has it.
+    static bool put(const Paths &P, const std::string &sha, const fs::path &f) {
+        fs::path r = root(P);
+        if (r.empty() || !valid(sha)) return false;
+        fs::path obj = object(r, sha), tmp = obj;
+        std::error_code ec;
+        if (fs::exists(obj, ec)) return false;
+        fs::create_directories(obj.parent_path(), ec);
+        tmp += ".tmp" + std::to_string(getpid());
+        fs::remove(tmp, ec);
+        treecopy::Stats st;
+        if (!treecopy::file(f, tmp, true, &st)) { fs::remove(tmp, ec); return false; }
+        ::chmod(tmp.c_str(), 0444);         // shared by every root: nobody edits it in place
+        fs::rename(tmp, obj, ec);
+        return !ec;
+    }
+}
+
+// =============== HTTP ===============
+// Plain HTTP/1.1 over TCP for the remote build cache tier and the bundled
+// `cache-serve`. No TLS: meant for localhost and build LANs (use the
+// shared-directory tier or curl for anything else).
+namespace http {
+    struct Url { std::string host, port = "80", path = "/"; };
+
+    static bool parse_url(const std::string &u, Url &out) {
+        if (u.rfind("http://", 0) != 0) return false;
+        std::string rest = u.substr(7);
+        auto slash = rest.find('/');
+        std::string hostport = rest.substr(0, slash);
+        out.path = slash == std::string::npos ? "/" : rest.substr(slash);
+        if (!hostport.empty() && hostport[0] == '[') {          // [v6]:port
+            auto close = hostport.find(']');
+            if (close == std::string::npos) return false;
+            out.host = hostport.substr(1, close - 1);
+            if (close + 1 < hostport.size() && hostport[close + 1] == ':') out.port = hostport.substr(close + 2);
+        } else {
+            auto colon = hostport.rfind(':');
+            out.host = hostport.substr(0, colon);
+            if (colon != std::string::npos) out.port = hostport.substr(colon + 1);
+        }
+        return !out.host.empty() && !out.port.empty();
+    }
+
+    static bool send_all(int fd, const char *d, size_t n) {
+        while (n) {
+            ssize_t w = ::send(fd, d, n, MSG_NOSIGNAL);
+            if (w < 0) { if (errno == EINTR) continue; return false; }
+            d += w; n -= (size_t)w;
+        }
+        return true;
+    }
+
+    // Connected, blocking socket with I/O timeouts, or -1.
+    static int connect_to(const std::string &host, const std::string &port, int timeout_ms, std::string *err) {
+        addrinfo hints{}, *res = nullptr;
+        hints.ai_family = AF_UNSPEC;
+        hints.ai_socktype = SOCK_STREAM;
+        int rc = getaddrinfo(host.c_str(), port.c_str(), &hints, &res);
+        if (rc != 0) { if (err) *err = host + ": " + gai_strerror(rc); return -1; }
+        int fd = -1;
+        for (auto a = res; a && fd < 0; a = a->ai_next) {
+            fd = socket(a->ai_family, a->ai_socktype | SOCK_CLOEXEC | SOCK_NONBLOCK, a->ai_protocol);
+            if (fd < 0) continue;
+            if (::connect(fd, a->ai_addr, a->ai_addrlen) != 0) {
+                pollfd p{fd, POLLOUT, 0};
+                int e = 0; socklen_t el = sizeof(e);
+                if (errno != EINPROGRESS || poll(&p, 1, timeout_ms) != 1 ||
+                    getsockopt(fd, SOL_SOCKET, SO_ERROR, &e, &el) != 0 || e != 0) {
+                    if (err) *err = host + ":" + port + ": " + std::strerror(e ? e : ETIMEDOUT);
+                    ::close(fd); fd = -1; continue;
+                }
+            }
+        }
+        freeaddrinfo(res);
+        if (fd < 0) return -1;
+        fcntl(fd, F_SETFL, fcntl(fd, F_GETFL) & ~O_NONBLOCK);
+        timeval tv{30, 0};
+        setsockopt(fd, SOL_SOCKET, SO_RCVTIMEO, &tv, sizeof(tv));
+        setsockopt(fd, SOL_SOCKET, SO_SNDTIMEO, &tv, sizeof(tv));
+        int one = 1;
+        setsockopt(fd, IPPROTO_TCP, TCP_NODELAY, &one, sizeof(one));
+        return fd;
+    }
+
+    // Buffered socket reader for header lines and bodies.
+    struct Reader {
+        int fd;
+        std::vector<char> buf = std::vector<char>(65536);
+        size_t pos = 0, end = 0;
+        explicit Reader(int f) : fd(f) {}
+        bool fill() {
+            pos = end = 0;
+            for (;;) {
+                ssize_t n = ::recv(fd, buf.data(), buf.size(), 0);
+                if (n < 0 && errno == EINTR) continue;
+                if (n <= 0) return false;
+                end = (size_t)n;
+                return true;
+            }
+        }
+        bool line(std::string &out) {
+            out.clear();
+            for (;;) {
+                if (pos == end && !fill()) return false;
+                char c = buf[pos++];
+                if (c == '\n') { if (!out.empty() && out.back() == '\r') out.pop_back(); return true; }
+                out += c;
+                if (out.size() > 16384) return false;
+            }
+        }
+        // Up to `max` bytes straight from the buffer/socket; 0 at EOF.
+        size_t some(const char *&data, size_t max) {
+            if (pos == end && !fill()) return 0;
+            size_t n = std::min(max, end - pos);
+            data = buf.data() + pos;
+            pos += n;
+            return n;
+        }
+    };
+
+    static std::string lower(std::string s) {
+        for (auto &c : s) c = (char)std::tolower((unsigned char)c);
+        return s;
+    }
+
+    // Header block after the start line; keys lowercased.
+    static bool read_headers(Reader &rd, std::map<std::string, std::string> &h) {
+        for (std::string l; rd.line(l);) {
+            if (l.empty()) return true;
+            auto colon = l.find(':');
+            if (colon != std::string::npos) h[lower(l.substr(0, colon))] = trim(l.substr(colon + 1));
+        }
+        return false;
+    }
+
+    // Streams a body of `len` bytes (-1: until EOF) or a chunked body to `sink`.
+    static bool read_body(Reader &rd, int64_t len, bool chunked, const proc::Sink &sink) {
+        auto copy = [&](uint64_t n) {
+            while (n) {
+                const char *d;
+                size_t got = rd.some(d, (size_t)std::min<uint64_t>(n, 1 << 20));
+                if (!got) return false;
+                if (sink) sink(d, got);
+                n -= got;
+            }
+            return true;
+        };
+        if (chunked) {
+            for (std::string l;;) {
+                if (!rd.line(l)) return false;
+                uint64_t n = std::strtoull(l.c_str(), nullptr, 16);
+                if (n == 0) { while (rd.line(l) && !l.empty()) {} return true; }
+                if (!copy(n) || !rd.line(l)) return false;
+            }
+        }
+        if (len >= 0) return copy((uint64_t)len);
+        for (const char *d; size_t got = rd.some(d, 1 << 20);) if (sink) sink(d, got);
+        return true;
+    }
+
+    struct Response {
+        int status = 0;                             // 0 = no response (see err)
+        std::map<std::string, std::string> headers;
+        std::string err;
+        bool connected = false, reused = false;     // exchange(): got a connection / a pooled one
+        bool ok() const { return status >= 200 && status < 300; }
+    };
+
+    // One request on a fresh connection. The request body (if any) is read
+    // from body_fd; the response body is streamed to `sink`.
+    static Response request(const std::string &method, const std::string &url, const proc::Sink &sink = {},
+                            int body_fd = -1, uint64_t body_len = 0, const std::vector<std::string> &extra = {}) {
+        Response r;
+        Url u;
+        if (!parse_url(url, u)) { r.err = "not an http:// URL: " + url; return r; }
+        int fd = connect_to(u.host, u.port, 5000, &r.err);
+        if (fd < 0) return r;
+        std::string req = method + " " + u.path + " HTTP/1.1\r\nHost: " + u.host + ":" + u.port +
+                          "\r\nUser-Agent: sbuild\r\nConnection: close\r\n";
+        for (auto &h : extra) req += h + "\r\n";
+        if (body_fd >= 0) req += "Content-Length: " + std::to_string(body_len) + "\r\n";
+        req += "\r\n";
+        bool sent = send_all(fd, req.data(), req.size());
+        for (off_t off = 0; sent && body_fd >= 0 && (uint64_t)off < body_len;) {
+            ssize_t n = sendfile(fd, body_fd, &off, (size_t)std::min<uint64_t>(body_len - (uint64_t)off, 1 << 30));
+            if (n <= 0) sent = false;
+        }
+        Reader rd(fd);
+        std::string status;
+        if (!sent) r.err = "send failed: " + std::string(std::strerror(errno));
+        else if (!rd.line(status) || status.compare(0, 5, "HTTP/") != 0) r.err = "no HTTP response from " + u.host;
+        else if (!read_headers(rd, r.headers)) r.err = "truncated response headers";
+        else {
+            r.status = std::atoi(status.c_str() + status.find(' '));
+            bool chunked = lower(r.headers["transfer-encoding"]).find("chunked") != std::string::npos;
+            int64_t len = r.headers.count("content-length") ? std::atoll(r.headers["content-length"].c_str()) : -1;
+            if (method != "HEAD" && !read_body(rd, len, chunked, r.ok() ? sink : proc::Sink()) && r.ok()) {
+                r.err = "connection lost during body";
+                r.status = 0;
+            }
+        }
+        ::close(fd);
+        return r;
+    }
+
+    // Idle keep-alive connections by host:port, shared by every exchange() caller.
+    class Pool {
+    public:
+        // A pooled connection if one is idle (reused = true), else a new one; -1 on failure.
+        int take(const Url &u, bool &reused, std::string *err) {
+            {
+                std::lock_guard<std::mutex> g(mu_);
+                auto it = idle_.find(u.host + ":" + u.port);
+                if (it != idle_.end()) { int fd = it->second; idle_.erase(it); reused = true; return fd; }
+            }
+            reused = false;
+            return connect_to(u.host, u.port, 5000, err);
+        }
+        void give(const Url &u, int fd) {
+            std::lock_guard<std::mutex> g(mu_);
+            if (idle_.size() >= 64) { ::close(fd); return; }
+            idle_.emplace(u.host + ":" + u.port, fd);
+        }
+    private:
+        std::mutex mu_;
+        std::multimap<std::string, int> idle_;
+    };
+    static Pool &pool() { static Pool p; return p; }
+
+    // GET/HEAD on a pooled keep-alive connection; the body reaches `sink` only
+    // if accept(response headers) agrees (default: 2xx). The connection goes
+    // back to the pool when the response was read to its end and the server
+    // did not ask to close. A reused connection the server has meanwhile
+    // closed is retried once on a fresh one.
+    static Response exchange(const std::string &method, const Url &u, const std::vector<std::string> &extra = {},
+                             const proc::Sink &sink = {}, const std::function<bool(const Response&)> &accept = {}) {
+        for (int attempt = 0;; ++attempt) {
+            Response r;
+            bool reused = false;
+            int fd = pool().take(u, reused, &r.err);
+            if (fd < 0) return r;
+            r.connected = true;
+            r.reused = reused;
+            std::string req = method + " " + u.path + " HTTP/1.1\r\nHost: " + u.host + ":" + u.port + "\r\nUser-Agent: sbuild\r\n";
+            for (auto &h : extra) req += h + "\r\n";
+            req += "\r\n";
+            Reader rd(fd);
+            std::string status;
+            bool sent = send_all(fd, req.data(), req.size());
+            if (!sent || !rd.line(status) || status.compare(0, 5, "HTTP/") != 0) {
+                ::close(fd);
+                if (reused && attempt == 0) continue;
+                r.err = sent ? "no HTTP response from " + u.host : "send failed: " + std::string(std::strerror(errno));
+                return r;
+            }
+            if (!read_headers(rd, r.headers)) { ::close(fd); r.err = "truncated response headers"; return r; }
+            r.status = std::atoi(status.c_str() + status.find(' '));
+            bool chunked = lower(r.headers["transfer-encoding"]).find("chunked") != std::string::npos;
+            int64_t len = r.headers.count("content-length") ? std::atoll(r.headers["content-length"].c_str()) : -1;
+            bool keep = lower(r.headers["connection"]) != "close" && status.compare(0, 8, "HTTP/1.1") == 0 && (chunked || len >= 0 || method == "HEAD");
+            bool wanted = accept ? accept(r) : r.ok();
+            if (method != "HEAD" && r.status != 204 && r.status != 304 && !read_body(rd, len, chunked, wanted ? sink : proc::Sink())) {
+                ::close(fd);
+                r.err = "connection lost during body";
+                if (r.ok()) r.status = 0;
+                return r;
+            }
+            if (keep && rd.pos == rd.end) pool().give(u, fd); else ::close(fd);
+            return r;
+        }
+    }
+
+    // Flat file store for `cache-serve`: GET/HEAD/PUT of /<name> under root,
+    // one thread per connection, keep-alive. A GET whose If-None-Match is the
+    // current ETag gets a 304. Uploads land in a tmp file and are renamed
+    // into place once complete.
+    static bool valid_name(const std::string &p) {
+        if (p.size() < 2 || p[0] != '/' || p[1] == '.') return false;
+        return std::all_of(p.begin() + 1, p.end(), [](char c){ return std::isalnum((unsigned char)c) || c == '.' || c == '-' || c == '_'; });
+    }
+
+    // Test knobs for `cache-serve`, to exercise fetches against slow and flaky servers.
+    struct ServeOpts {
+        uint64_t rate = 0;              // --throttle: bytes per second per response, 0 = unlimited
+        int latency_ms = 0;             // --latency: delay before every response
+        uint64_t drop_after = 0;        // --drop-after: close the connection after this many body bytes
+    };
+
+    // Sends [off, end) of `in`; false if the peer went away or drop_after hit.
+    static bool send_file(int fd, int in, off_t off, off_t end, const ServeOpts &so) {
+        if (so.drop_after) end = std::min<off_t>(end, off + (off_t)so.drop_after);
+        bool dropped = so.drop_after && end - off == (off_t)so.drop_after;
+        if (!so.rate) {
+            while (off < end) if (sendfile(fd, in, &off, (size_t)(end - off)) <= 0) return false;
+            return !dropped;
+        }
+        auto t0 = std::chrono::steady_clock::now();
+        std::vector<char> buf(std::max<uint64_t>(1024, std::min<uint64_t>(so.rate / 20, 1 << 16)));
+        for (uint64_t sent = 0; off < end;) {
+            ssize_t n = pread(in, buf.data(), (size_t)std::min<off_t>((off_t)buf.size(), end - off), off);
+            if (n <= 0 || !send_all(fd, buf.data(), (size_t)n)) return false;
+            off += n; sent += (uint64_t)n;
+            std::this_thread::sleep_until(t0 + std::chrono::microseconds(sent * 1000000 / so.rate));
+        }
+        return !dropped;
+    }
+
+    // "bytes=a-b", "bytes=a-" or "bytes=-n" against a file of `size` bytes; false if unsatisfiable.
+    static bool parse_range(const std::string &v, off_t size, off_t &from, off_t &to) {
+        if (v.rfind("bytes=", 0) != 0 || v.find(',') != std::string::npos) return false;
+        std::string r = v.substr(6);
+        auto dash = r.find('-');
+        if (dash == std::string::npos) return false;
+        std::string a = trim(r.substr(0, dash)), b = trim(r.substr(dash + 1));
+        if (a.empty()) { off_t n = std::atoll(b.c_str()); from = std::max<off_t>(0, size - n); to = size - 1; }
+        else { from = std::atoll(a.c_str()); to = b.empty() ? size - 1 : std::min<off_t>(std::atoll(b.c_str()), size - 1); }
+        return from <= to && from < size;
+    }
+
+    static void serve_conn(int fd, const fs::path &root, ServeOpts so) {
+        Reader rd(fd);
+        for (std::string line; rd.line(line);) {
+            if (line.empty()) continue;
+            std::istringstream rl(line);
+            std::string method, path, version;
+            rl >> method >> path >> version;
+            std::map<std::string, std::string> h;
+            if (!read_headers(rd, h)) break;
+            bool keep = lower(h["connection"]) != "close" && version == "HTTP/1.1";
+            auto reply = [&](int code, const std::string &reason, uint64_t len, const std::string &hdrs = {}) {
+                if (so.latency_ms) std::this_thread::sleep_for(std::chrono::milliseconds(so.latency_ms));
+                std::string s = "HTTP/1.1 " + std::to_string(code) + " " + reason + "\r\nContent-Length: " + std::to_string(len) +
+                                "\r\nServer: sbuild-cache\r\n" + hdrs + (keep ? "" : "Connection: close\r\n") + "\r\n";
+                return send_all(fd, s.data(), s.size());
+            };
+            std::cout << (ts_now() + " " + method + " " + path + "\n") << std::flush;
+            int64_t len = h.count("content-length") ? std::atoll(h["content-length"].c_str()) : 0;
+            if (!valid_name(path)) {
+                if (method == "PUT" && !read_body(rd, len, false, {})) break;
+                if (!reply(400, "Bad Request", 0)) break;
+            } else if (method == "GET" || method == "HEAD") {
+                fs::path f = root / path.substr(1);
+                int in = ::open(f.c_str(), O_RDONLY | O_CLOEXEC);
+                struct stat st{};
+                if (in < 0 || fstat(in, &st) != 0) { if (in >= 0) ::close(in); if (!reply(404, "Not Found", 0)) break; continue; }
+                char etag[64];
+                std::snprintf(etag, sizeof(etag), "\"%llx-%llx\"", (unsigned long long)st.st_size, (unsigned long long)st.st_mtim.tv_sec);
+                std::string hdrs = "Accept-Ranges: bytes\r\nETag: " + std::string(etag) + "\r\n";
+                off_t from = 0, to = st.st_size - 1;
+                bool ranged = h.count("range") && (!h.count("if-range") || h["if-range"] == etag);
+                bool ok;
+                if (ranged && !parse_range(h["range"], st.st_size, from, to)) {
+                    ok = reply(416, "Range Not Satisfiable", 0, "Content-Range: bytes */" + std::to_string(st.st_size) + "\r\n");
+                    ::close(in);
+                    if (!ok) break;
+                    continue;
+                }
+                if (!ranged && h.count("if-none-match") && h["if-none-match"] == etag) {
+                    ok = reply(304, "Not Modified", 0, hdrs);
+                    ::close(in);
+                    if (!ok) break;
+                    continue;
+                }
+                if (ranged) ok = reply(206, "Partial Content", (uint64_t)(to - from + 1), hdrs + "Content-Range: bytes " + std::to_string(from) + "-" +
+                                       std::to_string(to) + "/" + std::to_string(st.st_size) + "\r\n");
+                else ok = reply(200, "OK", (uint64_t)st.st_size, hdrs);
+                if (ok && method == "GET") ok = send_file(fd, in, from, to + 1, so);
+                ::close(in);
+                if (!ok) break;
+            } else if (method == "PUT") {
+                fs::path f = root / path.substr(1);
+                fs::path tmp = root / (".up-" + std::to_string(getpid()) + "-" + std::to_string(fd) + "-" + path.substr(1));
+                int out = ::open(tmp.c_str(), O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0644);
+                bool wrote = out >= 0;
+                bool got = read_body(rd, len, false, [&](const char *d, size_t n){
+                    wrote = wrote && ::write(out, d, n) == (ssize_t)n;
+                });
+                if (out >= 0) ::close(out);
+                std::error_code ec;
+                if (got && wrote) fs::rename(tmp, f, ec); else fs::remove(tmp, ec);
+                if (!got) break;
+                if (!reply(wrote && !ec ? 201 : 500, wrote && !ec ? "Created" : "Internal Server Error", 0)) break;
+            } else if (!reply(405, "Method Not Allowed", 0)) break;
+            if (!keep) break;
+        }
+        ::close(fd);
+    }
+
+    static int serve(const fs::path &root, const std::string &host, const std::string &port, const ServeOpts &so = {}) {
+        addrinfo hints{}, *res = nullptr;
+        hints.ai_family = AF_UNSPEC;
+        hints.ai_socktype = SOCK_STREAM;
+        hints.ai_flags = AI_PASSIVE;
+        int rc = getaddrinfo(host.empty() ? nullptr : host.c_str(), port.c_str(), &hints, &res);
+        if (rc != 0) { term::err(std::string("cache-serve: ") + gai_strerror(rc)); return 1; }
+        int lfd = socket(res->ai_family, res->ai_socktype | SOCK_CLOEXEC, res->ai_protocol);
+        int one = 1;
+        if (lfd >= 0) setsockopt(lfd, SOL_SOCKET, SO_REUSEADDR, &one, sizeof(one));
+        if (lfd < 0 || bind(lfd, res->ai_addr, res->ai_addrlen) != 0 || listen(lfd, 64) != 0) {
+            term::err("cache-serve: cannot listen on " + host + ":" + port + ": " + std::strerror(errno));
+            freeaddrinfo(res);
+            return 1;
+        }
+        freeaddrinfo(res);
+        term::ok("cache-serve: " + root.string() + " on http://" + (host.empty() ? "0.0.0.0" : host) + ":" + port + "/");
+        for (;;) {
+            int fd = accept4(lfd, nullptr, nullptr, SOCK_CLOEXEC);
+            if (fd < 0) { if (errno == EINTR) continue; break; }
+            setsockopt(fd, IPPROTO_TCP, TCP_NODELAY, &one, sizeof(one));
+            std::thread(serve_conn, fd, root, so).detach();
+        }
+        ::close(lfd);
+        return 1;
+    }
+}
+
+// =============== Downloads ===============
+// Source downloads go to <dest>.part and are renamed into place once
+// complete, so an interrupted fetch never looks like a finished file.
+// http:// URLs use http::exchange (keep-alive connections pooled per host),
+// anything else runs curl. When the server reports a size and byte ranges,
+// files of at least 2*MIN_SEGMENT are fetched as parallel ranges
+// (SB_FETCH_SEGMENTS, default 4) written in place with pwrite.
+// <dest>.part.state records size, validator (ETag or Last-Modified) and
+// each range's progress, so a rerun after a crash or a dropped connection
+// continues every range where it stopped; a changed validator or size
+// starts over. A dropped range is retried from its current offset; with
+// Opts::mirrors, a range that makes no progress moves to the next mirror
+// serving the same size and resumes there.
+namespace download {
+    static constexpr uint64_t MIN_SEGMENT = 4u << 20;
+    static constexpr int RETRIES = 5;           // consecutive attempts without progress
+
+    struct Opts {
+        unsigned segments = 0;                  // 0 = SB_FETCH_SEGMENTS or 4
+        std::vector<std::string> mirrors;       // other URLs of the same file, tried in this order when url fails
+        proc::Sink tee;                         // gets the whole file in order as it lands (resumed bytes too)
+        std::function<bool()> commit;           // runs when all bytes are in; false discards the download
+    };
+
+    struct Stats {
+        uint64_t bytes = 0, resumed = 0;        // transferred now / already there from an earlier run
+        double secs = 0;
+        unsigned segments = 1;
+        size_t retries = 0, opened = 0, reused = 0, failovers = 0;
+        std::string via, from;                  // from: the mirror it started on (set when there were mirrors)
+        std::string summary() const {
+            char buf[96];
+            std::snprintf(buf, sizeof(buf), " in %.1fs (%s/s)", secs, human_size(bytes / std::max(secs, 1e-3)).c_str());
+            std::string s = human_size((double)bytes) + buf + " via " + via + (from.empty() ? "" : " from " + from);
+            if (segments > 1) s += ", " + std::to_string(segments) + " ranges";
+            if (resumed) s += ", resumed after " + human_size((double)resumed);
+            if (retries) s += ", " + std::to_string(retries) + " retries";
+            if (failovers) s += ", " + std::to_string(failovers) + " mirror switches";
+            if (opened || reused) s += ", " + std::to_string(opened + reused) + " connections (" + std::to_string(reused) + " reused)";
+            return s;
+        }
+    };
+
+    // Connections one fetch() opened or took from http::pool() (other fetches share the pool).
+    struct Conns {
+        std::atomic<size_t> opened{0}, reused{0};
+        void count(const http::Response &r) { if (r.connected) (r.reused ? reused : opened)++; }
+    };
+
+    struct Info {
+        int64_t size = -1;
+        bool ranges = false;
+        std::string validator = "-", url, err;
+        bool unreachable = false;               // err is a connect failure or timeout: the host, not the file
+    };
+
+    static bool native(const std::string &url) { return url.rfind("http://", 0) == 0; }
+
+    // scheme://authority of a URL: the unit the per-host limit counts in.
+    static std::string host_of(const std::string &url) {
+        auto s = url.find("://");
+        if (s == std::string::npos) return url;
+        return url.substr(0, url.find('/', s + 3));
+    }
+
+    // Requests in flight per host across every download of this process
+    // (SB_FETCH_PER_HOST, default 6), so a bulk fetch with several ranges per
+    // file does not open dozens of connections to one mirror.
+    class HostGate {
+    public:
+        HostGate() {
+            if (const char *s = std::getenv("SB_FETCH_PER_HOST")) { int n = std::atoi(s); if (n > 0) limit_ = (unsigned)n; }
+        }
+        class Slot {
+        public:
+            Slot(HostGate &g, std::string host) : g_(g), host_(std::move(host)) {
+                std::unique_lock<std::mutex> lk(g_.mu_);
+                g_.freed_.wait(lk, [&]{ return g_.busy_[host_] < g_.limit_; });
+                g_.busy_[host_]++;
+            }
+            ~Slot() {
+                std::lock_guard<std::mutex> lk(g_.mu_);
+                g_.busy_[host_]--;
+                g_.freed_.notify_all();
+            }
+            Slot(const Slot &) = delete;
+            Slot &operator=(const Slot &) = delete;
+        private:
+            HostGate &g_;
+            std::string host_;
+        };
+        unsigned limit() const { return limit_; }
+    private:
+        std::mutex mu_;
+        std::condition_variable freed_;
+        std::map<std::string, unsigned> busy_;
+        unsigned limit_ = 6;
+    };
+    static HostGate &gate() { static HostGate g; return g; }
+
+    static Info head(const std::string &url, Conns *cn = nullptr) {
+        Info in;
+        in.url = url;
+        std::map<std::string, std::string> h;
+        if (native(url)) {
+            for (int hop = 0; hop < 5; ++hop) {
+                http::Url u;
+                if (!http::parse_url(in.url, u)) { in.err = "bad URL " + in.url; return in; }
+                auto r = http::exchange("HEAD", u);
+                if (cn) cn->count(r);
+                in.unreachable = r.status == 0;
+                if (r.status >= 300 && r.status < 400 && r.headers.count("location")) {
+                    std::string loc = r.headers["location"];
+                    in.url = loc.find("://") != std::string::npos ? loc : "http://" + u.host + ":" + u.port + (loc[0] == '/' ? "" : "/") + loc;
+                    if (!native(in.url)) return head(in.url, cn);
+                    continue;
+                }
+                if (!r.ok()) { in.err = r.status ? "HTTP " + std::to_string(r.status) : r.err; return in; }
+                h = r.headers;
+                break;
+            }
+        } else {
+            int code = 0;
+            std::string out = proc::capture({"curl", "-sSIL", "--fail", url}, &code);
+            if (code != 0) {
+                in.err = "curl -I failed (code " + std::to_string(code) + ")";
+                in.unreachable = code == 5 || code == 6 || code == 7 || code == 28 || code == 35;   // resolve, connect, timeout, TLS connect
+                return in;
+            }
+            std::istringstream ss(out);
+            for (std::string l; std::getline(ss, l);) {
+                if (l.rfind("HTTP/", 0) == 0) h.clear();            // keep the last hop only
+                auto colon = l.find(':');
+                if (colon != std::string::npos) h[http::lower(l.substr(0, colon))] = trim(l.substr(colon + 1));
+            }
+        }
+        if (h.count("content-length")) in.size = std::atoll(h["content-length"].c_str());
+        in.ranges = http::lower(h["accept-ranges"]) == "bytes";
+        if (h.count("etag")) in.validator = h["etag"];
+        else if (h.count("last-modified")) in.validator = h["last-modified"];
+        return in;
+    }
+
+    // Bytes [from, to] (to < 0: to the end) of url into sink. A server that
+    // ignores the range for from > 0 is an error ("ignored Range").
+    static bool get(const std::string &url, uint64_t from, int64_t to, const std::string &validator, const proc::Sink &sink, std::string &err,
+                    Conns *cn = nullptr) {
+        HostGate::Slot slot(gate(), host_of(url));
+        bool ranged = from > 0 || to >= 0;
+        std::string range = std::to_string(from) + "-" + (to >= 0 ? std::to_string(to) : "");
+        if (native(url)) {
+            http::Url u;
+            if (!http::parse_url(url, u)) { err = "bad URL " + url; return false; }
+            std::vector<std::string> hdrs;
+            if (ranged) {
+                hdrs.push_back("Range: bytes=" + range);
+                if (validator != "-") hdrs.push_back("If-Range: " + validator);
+            }
+            // A 200 to a range request is the whole file: fine from 0, useless from anywhere else.
+            auto r = http::exchange("GET", u, hdrs, sink, [&](const http::Response &resp){ return resp.status == 206 || (resp.ok() && from == 0); });
+            if (cn) cn->count(r);
+            if (r.ok() && r.status != 206 && from > 0) { err = "server ignored Range"; return false; }
+            if (!r.ok()) { err = r.status ? "HTTP " + std::to_string(r.status) : r.err; return false; }
+            return true;
+        }
+        proc::Argv cmd = {"curl", "-sSL", "--fail"};
+        if (ranged) { cmd.push_back("-r"); cmd.push_back(range); }
+        cmd.push_back(url);
+        proc::Opts o;
+        std::string msg;
+        o.out = sink;
+        o.err = [&](const char *d, size_t n){ if (msg.size() < 4096) msg.append(d, n); };
+        auto r = proc::run(cmd, o);
+        if (!r.ok()) err = msg.empty() ? "curl failed (code " + std::to_string(r.code) + ")" : trim(msg);
+        return r.ok();
+    }
+
+    struct Seg { uint64_t start, end, pos; };   // end exclusive; UINT64_MAX while the size is unknown
+
+    static fs::path part_of(const fs::path &dest) { fs::path p = dest; p += ".part"; return p; }
+    static fs::path state_of(const fs::path &dest) { fs::path p = dest; p += ".part.state"; return p; }
+
+    // A validator as one word of .part.state (a Last-Modified date has spaces).
+    // Only the state file sees this form; If-Range gets the raw value.
+    static std::string state_word(std::string v) {
+        for (auto &c : v) if (c == ' ') c = '_';
+        return v;
+    }
+
+    // The validator only means something to the server that issued it; a
+    // .part begun on another mirror is trusted on its size (and the checksum).
+    static bool load_state(const fs::path &dest, const Info &in, std::vector<Seg> &segs) {
+        std::ifstream f(state_of(dest));
+        std::string k, validator, url;
+        int64_t size = -2;
+        if (!(f >> k >> size) || k != "size" || !(f >> k >> validator) || k != "validator" || !(f >> k >> url) || k != "url") return false;
+        if (size != in.size || (url == in.url && validator != state_word(in.validator)) || in.size < 0 || !in.ranges) return false;
+        for (Seg s; f >> k >> s.start >> s.end >> s.pos && k == "seg";) {
+            if (s.pos < s.start || s.pos > s.end || s.end > (uint64_t)in.size) return false;
+            segs.push_back(s);
+        }
+        return !segs.empty();
+    }
+
+    static void save_state(const fs::path &dest, const Info &in, const std::vector<Seg> &segs) {
+        fs::path tmp = state_of(dest); tmp += ".tmp";
+        {
+            std::ofstream o(tmp);
+            o << "size " << in.size << "\nvalidator " << state_word(in.validator) << "\nurl " << in.url << "\n";
+            for (auto &s : segs) o << "seg " << s.start << ' ' << s.end << ' ' << s.pos << "\n";
+        }
+        std::error_code ec; fs::rename(tmp, state_of(dest), ec);
+    }
+
+    static unsigned default_segments() {
+        if (const char *s = std::getenv("SB_FETCH_SEGMENTS")) { int n = std::atoi(s); if (n > 0) return (unsigned)n; }
+        return 4;
+    }
+
+    // teed / teed_sha are for the restart at the end: the first teed bytes
+    // (sha256 teed_sha) already went to o.tee, so this attempt only checks
+    // them and tees what follows.
+    static bool fetch(const std::string &url, const fs::path &dest, const Opts &o, Stats &st, std::string &err,
+                      uint64_t teed = 0, const std::string &teed_sha = "") {
+        auto t0 = std::chrono::steady_clock::now();
+        Conns cn;
+        // The first mirror that answers HEAD sets size and validator for the whole download.
+        std::vector<std::string> urls = {url};
+        urls.insert(urls.end(), o.mirrors.begin(), o.mirrors.end());
+        Info in;
+        size_t first = 0;
+        for (int round = 0; round < 3; ++round) {
+            for (first = 0; first < urls.size(); ++first) {
+                { HostGate::Slot slot(gate(), host_of(urls[first])); in = head(urls[first], &cn); }
+                if (in.err.empty()) break;
+            }
+            if (in.err.empty()) break;
+            std::this_thread::sleep_for(std::chrono::milliseconds(300 << round));
+        }
+        if (!in.err.empty() && native(url)) { err = in.err; return false; }
+        if (!in.err.empty()) { in = Info{-1, false, "-", url, ""}; first = 0; }     // e.g. ftp: no HEAD, plain download
+        st.via = native(in.url) ? "http" : "curl";
+
+        // Other mirrors are checked when a range first needs one: same size and byte ranges, or not usable.
+        struct Mirror { std::string url, validator = "-"; int state = 0; };     // state: 0 unchecked, 1 usable, 2 only from byte 0, -1 not
+        std::vector<Mirror> mir(urls.size());
+        for (size_t i = 0; i < urls.size(); ++i) { mir[i].url = urls[i]; if (i < first) mir[i].state = -1; }
+        mir[first] = {in.url, in.validator, 1};
+        if (mir.size() > 1) st.from = host_of(in.url).substr(host_of(in.url).find("://") + 3);
+        std::mutex probe_mu;
+        auto next_mirror = [&](size_t m) {
+            std::lock_guard<std::mutex> g(probe_mu);
+            for (size_t k = 1; k < mir.size(); ++k) {
+                Mirror &x = mir[(m + k) % mir.size()];
+                if (x.state == 0) {
+                    Info alt;
+                    { HostGate::Slot slot(gate(), host_of(x.url)); alt = head(x.url, &cn); }
+                    x.state = alt.err.empty() && alt.size == in.size ? (alt.ranges ? 1 : 2) : -1;
+                    if (x.state > 0) { x.url = alt.url; x.validator = alt.validator; }
+                }
+                if (x.state == 1 || (x.state == 2 && !in.ranges)) return (m + k) % mir.size();
+            }
+            return m;
+        };
+
+        fs::path part = part_of(dest);
+        std::vector<Seg> segs;
+        std::error_code ec;
+        struct stat ps{};
+        bool have_part = ::stat(part.c_str(), &ps) == 0;
+        if (have_part && !load_state(dest, in, segs)) {
+            segs.clear();
+            // A lone .part (crash before any state was written, or an old curl -o): one range from its end.
+            if (!fs::exists(state_of(dest)) && in.ranges && in.size >= 0 && (int64_t)ps.st_size <= in.size)
+                segs.push_back({0, (uint64_t)in.size, (uint64_t)ps.st_size});
+            else { fs::remove(part, ec); have_part = false; }
+        }
+        if (segs.empty()) {
+            unsigned n = o.segments ? o.segments : default_segments();
+            if (in.size >= 0 && in.ranges) n = (unsigned)std::max<uint64_t>(1, std::min<uint64_t>(n, (uint64_t)in.size / MIN_SEGMENT));
+            else n = 1;
+            uint64_t size = in.size >= 0 ? (uint64_t)in.size : UINT64_MAX;
+            for (unsigned i = 0; i < n; ++i) {
+                uint64_t a = size == UINT64_MAX ? 0 : size * i / n, b = size == UINT64_MAX ? size : size * (i + 1) / n;
+                segs.push_back({a, b, a});
+            }
+        }
+        int fd = ::open(part.c_str(), O_RDWR | O_CREAT | O_CLOEXEC | (have_part ? 0 : O_TRUNC), 0644);
+        if (fd < 0) { err = "cannot write " + part.string() + ": " + std::strerror(errno); return false; }
+        if (segs.size() > 1 && ftruncate(fd, in.size) != 0) { ::close(fd); err = "cannot size " + part.string(); return false; }
+        st.segments = (unsigned)segs.size();
+        for (auto &s : segs) st.resumed += s.pos - s.start;
+        if (in.ranges && in.size >= 0) save_state(dest, in, segs);
+
+        std::mutex mu;
+        std::condition_variable moved;
+        bool done = false, failed = false, restart = false;
+        uint64_t unsaved = 0;
+        std::atomic<uint64_t> bytes{0};
+        std::atomic<size_t> retries{0}, failovers{0};
+        // First byte not yet on disk counting from the start of the file.
+        auto frontier = [&]{
+            for (auto &s : segs) if (s.pos < s.end) return s.pos;
+            return segs.back().end == UINT64_MAX ? segs.back().pos : segs.back().end;
+        };
+        std::thread teer;
+        uint64_t fed = 0;                   // bytes the tee thread has read, teed ones included
+        sha256::Hasher again;               // over [0, teed): must be what the earlier attempt teed
+        bool diverged = false;
+        if (o.tee) teer = std::thread([&]{
+            std::vector<char> buf(1 << 20);
+            for (uint64_t &off = fed;;) {
+                uint64_t upto;
+                {
+                    std::unique_lock<std::mutex> g(mu);
+                    moved.wait(g, [&]{ return frontier() > off || done || failed; });
+                    upto = frontier();
+                    if (upto <= off || diverged) return;
+                }
+                while (off < upto) {
+                    ssize_t n = pread(fd, buf.data(), (size_t)std::min<uint64_t>(buf.size(), upto - off), (off_t)off);
+                    if (n <= 0) return;
+                    size_t skip = off < teed ? (size_t)std::min<uint64_t>((uint64_t)n, teed - off) : 0;
+                    if (skip) again.update(buf.data(), skip);
+                    if (skip && off + skip == teed && again.hex() != teed_sha) {
+                        std::lock_guard<std::mutex> g(mu);
+                        diverged = failed = true;
+                        err = "file changed on the server during download";
+                        return;
+                    }
+                    if ((size_t)n > skip) o.tee(buf.data() + skip, (size_t)n - skip);
+                    off += (uint64_t)n;
+                }
+            }
+        });
+        // A range that stops making progress moves to the next usable mirror and
+        // carries on from its offset; backoff only once every mirror had a turn.
+        auto worker = [&](size_t i) {
+            Seg &s = segs[i];
+            size_t m = first, from_zero = 0;
+            for (int idle = 0;;) {
+                uint64_t before, pos, end;
+                { std::lock_guard<std::mutex> g(mu); if (failed || s.pos >= s.end) return; before = pos = s.pos; end = s.end; }
+                std::string e, werr;
+                bool ok = get(mir[m].url, pos, end == UINT64_MAX ? -1 : (int64_t)end - 1, mir[m].validator, [&](const char *d, size_t n){
+                    if (!werr.empty()) return;
+                    n = (size_t)std::min<uint64_t>(n, end - pos);
+                    for (size_t w = 0; w < n;) {
+                        ssize_t k = pwrite(fd, d + w, n - w, (off_t)(pos + w));
+                        if (k < 0 && errno == EINTR) continue;
+                        if (k <= 0) { werr = "cannot write " + part.string() + ": " + std::strerror(k < 0 ? errno : ENOSPC); return; }
+                        w += (size_t)k;
+                    }
+                    pos += n;
+                    bytes += n;
+                    std::lock_guard<std::mutex> g(mu);
+                    s.pos = pos;
+                    if ((unsaved += n) >= (8u << 20) && in.ranges && in.size >= 0) { save_state(dest, in, segs); unsaved = 0; }
+                    moved.notify_all();
+                }, e, &cn);
+                bool ignored = e == "server ignored Range";
+                {
+                    std::lock_guard<std::mutex> g(mu);
+                    if (!werr.empty()) { failed = true; err = werr; return; }     // a local problem: no mirror fixes it
+                    if (ok && end == UINT64_MAX) { s.end = s.pos; moved.notify_all(); return; }
+                    if (ok && s.pos >= s.end) return;
+                    if (ignored && mir.size() == 1) { restart = failed = true; err = e; return; }
+                    if (!in.ranges && mir.size() == 1) { failed = true; err = e.empty() ? "short read" : e; return; }   // nothing to resume from
+                    idle = s.pos > before ? 0 : idle + 1;
+                    if (idle > RETRIES + (int)mir.size() - 1) { failed = true; err = e.empty() ? "short read" : e; return; }
+                }
+                retries++;
+                // Without ranges there is nothing to resume: the next mirror starts the file over.
+                if (!in.ranges) {
+                    size_t n = next_mirror(m);
+                    std::lock_guard<std::mutex> g(mu);
+                    if (n == m || ++from_zero >= mir.size()) { failed = true; err = e.empty() ? "short read" : e; return; }
+                    m = n;
+                    failovers++;
+                    s.pos = s.start;
+                    if (ftruncate(fd, 0) != 0) { failed = true; err = "cannot truncate " + part.string(); return; }
+                    continue;
+                }
+                if (ignored) { std::lock_guard<std::mutex> g(probe_mu); mir[m].state = -1; }
+                if (idle && mir.size() > 1) {
+                    size_t n = next_mirror(m);
+                    if (n != m) { m = n; failovers++; if (idle < (int)mir.size()) continue; }
+                    else if (ignored) { std::lock_guard<std::mutex> g(mu); restart = failed = true; err = e; return; }
+                }
+                if (idle) std::this_thread::sleep_for(std::chrono::milliseconds(200 << std::min(idle, 4)));
+            }
+        };
+        parallel_for(segs.size(), (unsigned)segs.size(), worker);
+        {
+            std::lock_guard<std::mutex> g(mu);
+            done = true;
+            if (!failed && in.ranges && in.size >= 0) save_state(dest, in, segs);
+            moved.notify_all();
+        }
+        if (teer.joinable()) teer.join();
+        st.bytes = bytes;
+        st.retries = retries;
+        st.failovers = failovers;
+        st.opened = cn.opened;
+        st.reused = cn.reused;
+        st.secs = std::chrono::duration<double>(std::chrono::steady_clock::now() - t0).count();
+        bool ok = !failed && fsync(fd) == 0;
+        ok = ::close(fd) == 0 && ok;
+        if (o.tee && fed < teed && !diverged) { ok = false; err = "file changed on the server during download"; }
+        if (restart && !diverged) {         // ranges are not honoured after all: one plain download
+            // The tee already has [0, fed): the new attempt must bring the same bytes first.
+            std::string sha;
+            if (o.tee && fed > 0) {
+                sha256::Hasher h;
+                std::ifstream in(part, std::ios::binary);
+                std::vector<char> buf(1 << 20);
+                for (uint64_t left = fed; left > 0 && in;) {
+                    in.read(buf.data(), (std::streamsize)std::min<uint64_t>(buf.size(), left));
+                    h.update(buf.data(), (size_t)in.gcount());
+                    left -= (uint64_t)in.gcount();
+                }
+                sha = h.hex();
+            }
+            fs::remove(part, ec); fs::remove(state_of(dest), ec);
+            if (o.segments == 1 && !have_part) return false;
+            Opts plain = o;
+            plain.segments = 1;
+            err.clear();
+            Stats more;
+            bool r = fetch(url, dest, plain, more, err, o.tee ? fed : 0, sha);
+            st.bytes += more.bytes; st.secs += more.secs; st.segments = 1;
+            return r;
+        }
+        if (!ok) { if (err.empty()) err = "cannot write " + part.string(); return false; }
+        if (o.commit && !o.commit()) { fs::remove(part, ec); fs::remove(state_of(dest), ec); return false; }
+        fs::rename(part, dest, ec);
+        fs::remove(state_of(dest));
+        if (ec) { err = "cannot rename " + part.string() + ": " + ec.message(); return false; }
+        return true;
+    }
+}
+
+// =============== Mirrors ===============
+// Where a source can come from: the recipe's source= and mirrors=, plus the
+// alternatives .sbuild/config.ini lists under [mirrors] for a prefix of it.
+// Hosts are ranked by HEAD round-trip, probed concurrently; the result is
+// kept per host in .sbuild/cache/mirrors.txt for SB_MIRROR_TTL seconds
+// (default 3600), so only hosts without a fresh entry are probed again.
+// download::fetch starts on the first URL and fails over down the list.
+// One line per host: <scheme://host[:port]> <ms, -1 = no answer> <unix time>
+namespace mirrors {
+    struct Rank { int64_t ms = -1, when = 0; };
+
+    static std::mutex mu;
+
+    static fs::path db(const Paths &P) { return P.cache / "mirrors.txt"; }
+
+    static std::map<std::string, Rank> load(const Paths &P) {
+        std::map<std::string, Rank> m;
+        std::ifstream in(db(P));
+        std::string host;
+        for (Rank r; in >> host >> r.ms >> r.when;) m[host] = r;
+        return m;
+    }
+
+    static void store(const Paths &P, const std::map<std::string, Rank> &fresh) {
+        std::lock_guard<std::mutex> lk(mu);
+        auto m = load(P);
+        for (auto &[h, r] : fresh) m[h] = r;
+        fs::path tmp = db(P); tmp += ".tmp" + std::to_string(getpid());
+        {
+            std::ofstream o(tmp);
+            for (auto &[h, r] : m) o << h << ' ' << r.ms << ' ' << r.when << "\n";
+        }
+        std::error_code ec; fs::rename(tmp, db(P), ec);
+    }
+
+    static int64_t ttl() {
+        if (const char *s = std::getenv("SB_MIRROR_TTL")) return std::atoll(s);
+        return 3600;
+    }
+
+    // source= first, then the recipe's mirrors (an entry ending in / is a directory), then config prefixes.
+    static std::vector<std::string> candidates(const Paths &P, const Recipe &r) {
+        std::vector<std::string> out;
+        auto add = [&](const std::string &u){ if (!u.empty() && std::find(out.begin(), out.end(), u) == out.end()) out.push_back(u); };
+        const std::string &src = r.source_url;
+        add(src);
+        std::string file = src.substr(src.find_last_of('/') + 1);
+        for (auto &m : r.mirrors) add(m.back() == '/' ? m + file : m);
+        auto cfg = config::load(P);
+        for (auto &[prefix, alts] : cfg["mirrors"]) {
+            if (prefix.empty() || src.rfind(prefix, 0) != 0) continue;
+            std::stringstream ss(alts);
+            for (std::string a; std::getline(ss, a, ',');) if (!trim(a).empty()) add(trim(a) + src.substr(prefix.size()));
+        }
+        return out;
+    }
+
+    // urls ordered fastest host first; hosts that did not answer, and URLs a
+    // host answered with an error, go last (ties keep the given order).
+    // *report gets "host 12ms, host 300ms (cached), host down".
+    static std::vector<std::string> rank(const Paths &P, const std::vector<std::string> &urls, std::string *report = nullptr) {
+        if (urls.size() < 2) return urls;
+        int64_t now = (int64_t)std::time(nullptr);
+        auto known = load(P);
+        std::vector<std::string> probe;                 // one URL per host without a fresh ranking
+        std::set<std::string> seen;
+        for (auto &u : urls) {
+            std::string h = download::host_of(u);
+            auto it = known.find(h);
+            if (seen.insert(h).second && (it == known.end() || now - it->second.when > ttl())) probe.push_back(u);
+        }
+        std::map<std::string, Rank> fresh;
+        std::set<std::string> missing;
+        std::mutex fm;
+        parallel_for(probe.size(), (unsigned)probe.size(), [&](size_t i){
+            std::string h = download::host_of(probe[i]);
+            auto t0 = std::chrono::steady_clock::now();
+            download::Info in;
+            { download::HostGate::Slot slot(download::gate(), h); in = download::head(probe[i]); }
+            Rank r;
+            r.when = now;
+            // Any answer, even an HTTP error, measures the host; only this file is missing there.
+            if (!in.unreachable)
+                r.ms = std::chrono::duration_cast<std::chrono::milliseconds>(std::chrono::steady_clock::now() - t0).count();
+            std::lock_guard<std::mutex> g(fm);
+            fresh[h] = r;
+            if (!in.err.empty() && r.ms >= 0) missing.insert(probe[i]);
+        });
+        if (!fresh.empty()) store(P, fresh);
+        for (auto &[h, r] : fresh) known[h] = r;
+        auto cost = [&](const std::string &u) {
+            auto &r = known[download::host_of(u)];
+            return r.ms < 0 || missing.count(u) ? INT64_MAX : r.ms;
+        };
+        std::vector<std::string> out = urls;
+        std::stable_sort(out.begin(), out.end(), [&](const std::string &a, const std::string &b){ return cost(a) < cost(b); });
+        if (report) {
+            report->clear();
+            std::set<std::string> done;
+            for (auto &u : out) {
+                std::string h = download::host_of(u);
+                if (!done.insert(h).second) continue;
+                auto &r = known[h];
+                if (!report->empty()) *report += ", ";
+                *report += h.substr(h.find("://") + 3) + (r.ms < 0 ? " down" : " " + std::to_string(r.ms) + "ms") +
+                           (missing.count(u) ? " (no file)" : fresh.count(h) ? "" : " (cached)");
+            }
+        }
+        return out;
+    }
+}
+
+// =============== Git mirrors ===============
+// git= sources live as bare mirrors under .sbuild/cache/git, one per URL,
+// and are exported into work/ with `git archive` (nothing is built in the
+// mirror). A commit= or tag= pin the mirror already has needs no network;
+// otherwise just that ref is fetched shallow (--depth=1), with a full fetch
+// as fallback for servers that refuse to hand out an arbitrary commit.
+// Unpinned recipes ask `git ls-remote` for the remote HEAD and fetch it
+// (shallow) only when the mirror does not have that commit yet. One sync
+// per mirror at a time: a mutex in the process, flock(<mirror>.lock) across.
+namespace gitmirror {
+    static fs::path dir(const Paths &P, const std::string &url) {
+        std::string base = url.substr(url.find_last_of("/:") + 1);
+        if (base.size() > 4 && base.compare(base.size() - 4, 4, ".git") == 0) base.resize(base.size() - 4);
+        for (auto &c : base) if (!std::isalnum((unsigned char)c) && c != '-' && c != '_' && c != '.') c = '_';
+        return P.cache / "git" / (base + "-" + sha256::bytes(url).substr(0, 12) + ".git");
+    }
+
+    // git -C m <args>; output to the log, stdout also to *out when given.
+    static bool git(const fs::path &m, const proc::Argv &args, const std::string &log, std::string *out = nullptr) {
+        proc::Argv cmd = {"git", "-C", m.string()};
+        cmd.insert(cmd.end(), args.begin(), args.end());
+        proc::LogSink ls(log);
+        proc::Opts o;
+        o.out = [&](const char *d, size_t n){ if (out) out->append(d, n); else ls.write(d, n); };
+        o.err = ls.sink();
+        auto r = proc::run(cmd, o);
+        ls.line("# git " + (args.empty() ? std::string() : args[0]) + ": " + proc::summary(r));
+        return r.ok();
+    }
+
+    // Full commit id the pin names in the mirror, or "".
+    static std::string resolve(const fs::path &m, const std::string &ref) {
+        int ec = 0;
+        std::string id = trim(proc::capture({"git", "-C", m.string(), "rev-parse", "-q", "--verify", ref + "^{commit}"}, &ec));
+        return ec == 0 ? id : "";
+    }
+
+    // Makes sure the mirror of url has the pinned commit (commit= wins over
+    // tag=; neither means the remote HEAD) and returns its id in `commit`.
+    // *fetched tells whether the network was used.
+    static bool sync(const Paths &P, const std::string &url, const std::string &pin_commit, const std::string &pin_tag,
+                     std::string &commit, std::string &err, const std::string &log, bool *fetched = nullptr) {
+        static std::mutex locks_mu;
+        static std::map<fs::path, std::mutex> locks;          // one sync per mirror at a time in this process
+        fs::path m = dir(P, url);
+        std::unique_lock<std::mutex> lk([&]() -> std::mutex & { std::lock_guard<std::mutex> g(locks_mu); return locks[m]; }());
+        if (fetched) *fetched = false;
+        std::error_code ec;
+        fs::create_directories(m.parent_path(), ec);
+        // ...and across processes: a git= source and a git+ patch repo of one URL share the mirror.
+        fs::path lockf = m; lockf += ".lock";
+        struct FileLock { int fd; ~FileLock() { if (fd >= 0) ::close(fd); } } flk{::open(lockf.c_str(), O_RDWR | O_CREAT | O_CLOEXEC, 0644)};
+        if (flk.fd >= 0) flock(flk.fd, LOCK_EX);
+        if (!fs::exists(m / "HEAD", ec)) {
+            if (!git(m.parent_path(), {"init", "-q", "--bare", m.string()}, log) || !git(m, {"remote", "add", "origin", url}, log)) {
+                err = "cannot create mirror " + m.string();
+                return false;
+            }
+        }
+        std::string ref = !pin_commit.empty() ? pin_commit : !pin_tag.empty() ? "refs/tags/" + pin_tag : "refs/sbuild/HEAD";
+        if ((!pin_commit.empty() || !pin_tag.empty()) && !(commit = resolve(m, ref)).empty()) return true;
+        if (pin_commit.empty() && pin_tag.empty()) {
+            std::string ls;
+            bool asked = git(m, {"ls-remote", "origin", "HEAD"}, log, &ls);
+            std::string head = trim(ls.substr(0, ls.find('\t')));
+            if (asked && head.size() >= 40 && resolve(m, head) == head && git(m, {"update-ref", ref, head}, log)) {
+                commit = head;
+                return true;
+            }
+        }
+
+        if (fetched) *fetched = true;
+        std::string want = !pin_commit.empty() ? pin_commit : !pin_tag.empty() ? "+" + ref + ":" + ref : "+HEAD:" + ref;
+        bool ok = git(m, {"fetch", "-q", "--depth=1", "origin", want}, log);
+        if (!ok || (commit = resolve(m, ref)).empty()) {
+            std::string shallow;
+            git(m, {"rev-parse", "--is-shallow-repository"}, log, &shallow);
+            proc::Argv all = {"fetch", "-q", "origin", "+refs/heads/*:refs/heads/*", "+refs/tags/*:refs/tags/*"};
+            if (trim(shallow) == "true") all.insert(all.begin() + 2, "--unshallow");
+            if (pin_commit.empty() && pin_tag.empty()) all.push_back("+HEAD:" + ref);
+            ok = git(m, all, log);
+            commit = resolve(m, ref);
+        }
+        if (commit.empty()) err = !ok ? "cannot fetch " + url : !pin_commit.empty() ? "commit " + pin_commit + " not found in " + url
+                                : !pin_tag.empty() ? "tag " + pin_tag + " not found in " + url : "no HEAD in " + url;
+        return !commit.empty();
+    }
+}
+
+// =============== Patch store ===============
+// Remote patches by content: .sbuild/cache/patches/objects/<sha256>/<name>
+// (the name only keeps logs readable; the directory is the identity).
+// index.txt maps each http(s) patch URL to the object it last served, with
+// the ETag / Last-Modified of that response and when it was last checked.
+// Within SB_PATCH_TTL seconds (default 86400) the object is used as is;
+// after that the URL is revalidated with a conditional GET, so an unchanged
+// patch costs a 304. A sha256= the recipe gives for a patch pins it: if that
+// object is here, no request is made at all. git+ patch repos are gitmirror
+// mirrors whose *.patch files are exported as objects as well.
+// One line per URL, tab-separated: <url> <sha256> <checked> <etag|-> <last-modified|->
+namespace patchstore {
+    struct Entry { std::string sha, etag = "-", modified = "-"; int64_t checked = 0; };
+
+    static std::mutex mu;
+
+    static fs::path dir(const Paths &P) { return P.cache / "patches"; }
+    static fs::path db(const Paths &P) { return dir(P) / "index.txt"; }
+    static fs::path object(const Paths &P, const std::string &sha, const std::string &name) { return dir(P) / "objects" / sha / name; }
+
+    // Any stored copy of sha, or "".
+    static fs::path find(const Paths &P, const std::string &sha) {
+        std::error_code ec;
+        if (!store::valid(sha)) return {};
+        for (auto &e : fs::directory_iterator(dir(P) / "objects" / sha, ec))
+            if (e.is_regular_file(ec) && e.path().filename().string().find(".tmp") == std::string::npos) return e.path();
+        return {};
+    }
+
+    // File name for a patch from its URL or path: the last component, query dropped.
+    static std::string name_of(const std::string &u) {
+        std::string n = u.substr(0, u.find_first_of("?#"));
+        n = n.substr(n.find_last_of('/') + 1);
+        for (auto &c : n) if (!std::isalnum((unsigned char)c) && c != '-' && c != '_' && c != '.' && c != '+') c = '_';
+        return n.empty() || n[0] == '.' ? "patch" + n : n;
+    }
+
+    static std::map<std::string, Entry> load(const Paths &P) {
+        std::map<std::string, Entry> m;
+        std::ifstream in(db(P));
+        for (std::string line; std::getline(in, line);) {
+            std::vector<std::string> f;
+            std::stringstream ss(line);
+            for (std::string x; std::getline(ss, x, '\t');) f.push_back(x);
+            if (f.size() != 5) continue;
+            Entry e;
+            e.sha = f[1]; e.checked = std::atoll(f[2].c_str()); e.etag = f[3]; e.modified = f[4];
+            m[f[0]] = e;
+        }
+        return m;
+    }
+
+    static void store(const Paths &P, const std::string &url, const Entry &e) {
+        std::lock_guard<std::mutex> lk(mu);
+        auto m = load(P);
+        m[url] = e;
+        std::error_code ec;
+        fs::create_directories(dir(P), ec);
+        fs::path tmp = db(P); tmp += ".tmp" + std::to_string(getpid());
+        {
+            std::ofstream o(tmp);
+            for (auto &[u, x] : m) o << u << '\t' << x.sha << '\t' << x.checked << '\t' << x.etag << '\t' << x.modified << "\n";
+        }
+        fs::rename(tmp, db(P), ec);
+    }
+
+    static int64_t ttl() {
+        if (const char *s = std::getenv("SB_PATCH_TTL")) return std::atoll(s);
+        return 86400;
+    }
+
+    // Writes data as an object (once per sha256 and name); "" on error.
+    static fs::path put(const Paths &P, const std::string &data, const std::string &name) {
+        static std::atomic<unsigned> seq{0};
+        fs::path obj = object(P, sha256::bytes(data), name), tmp = obj;
+        std::error_code ec;
+        if (fs::exists(obj, ec)) return obj;
+        fs::create_directories(obj.parent_path(), ec);
+        tmp += ".tmp" + std::to_string(getpid()) + "-" + std::to_string(seq++);
+        {
+            std::ofstream o(tmp, std::ios::binary);
+            o.write(data.data(), (std::streamsize)data.size());
+            if (!o.flush()) { o.close(); fs::remove(tmp, ec); return {}; }
+        }
+        fs::rename(tmp, obj, ec);
+        if (ec) { fs::remove(tmp, ec); return {}; }
+        return obj;
+    }
+
+    // GET url, conditional on prev's validators when given; follows redirects.
+    // Returns the final status (304: unchanged, 0: no response, see err); the
+    // body and the new validators are only filled in for a 2xx.
+    static int get(const std::string &url, const Entry *prev, std::string &body, Entry &got, std::string &err) {
+        std::vector<std::string> hdrs;
+        if (prev && prev->etag != "-") hdrs.push_back("If-None-Match: " + prev->etag);
+        if (prev && prev->modified != "-") hdrs.push_back("If-Modified-Since: " + prev->modified);
+        std::map<std::string, std::string> h;
+        int status = 0;
+        body.clear();
+        if (download::native(url)) {
+            std::string u = url;
+            for (int hop = 0; hop < 5; ++hop) {
+                http::Url pu;
+                if (!http::parse_url(u, pu)) { err = "bad URL " + u; return 0; }
+                http::Response r;
+                {
+                    download::HostGate::Slot slot(download::gate(), download::host_of(u));
+                    r = http::exchange("GET", pu, hdrs, [&](const char *d, size_t n){ body.append(d, n); });
+                }
+                if (r.status >= 300 && r.status < 400 && r.status != 304 && r.headers.count("location")) {
+                    std::string loc = r.headers["location"];
+                    u = loc.find("://") != std::string::npos ? loc : "http://" + pu.host + ":" + pu.port + (loc[0] == '/' ? "" : "/") + loc;
+                    if (!download::native(u)) return get(u, prev, body, got, err);
+                    body.clear();
+                    continue;
+                }
+                status = r.status;
+                h = r.headers;
+                if (!status) err = r.err;
+                break;
+            }
+        } else {
+            proc::Argv cmd = {"curl", "-sSL", "-D", "/dev/stderr"};
+            for (auto &x : hdrs) { cmd.push_back("-H"); cmd.push_back(x); }
+            cmd.push_back(url);
+            std::string heads;
+            proc::Opts o;
+            o.out = [&](const char *d, size_t n){ body.append(d, n); };
+            o.err = [&](const char *d, size_t n){ heads.append(d, n); };
+            proc::Result r;
+            {
+                download::HostGate::Slot slot(download::gate(), download::host_of(url));
+                r = proc::run(cmd, o);
+            }
+            std::istringstream ss(heads);
+            std::string msg;
+            for (std::string l; std::getline(ss, l);) {
+                if (l.rfind("HTTP/", 0) == 0) { h.clear(); status = std::atoi(l.c_str() + l.find(' ')); continue; }   // keep the last hop only
+                auto colon = l.find(':');
+                if (l.rfind("curl:", 0) == 0) msg = trim(l);
+                else if (colon != std::string::npos) h[http::lower(l.substr(0, colon))] = trim(l.substr(colon + 1));
+            }
+            if (!r.ok()) { status = 0; err = msg.empty() ? "curl failed (" + proc::summary(r) + ")" : msg; }
+        }
+        if (status < 200 || status >= 300) { body.clear(); return status; }
+        got.etag = h.count("etag") ? h["etag"] : "-";
+        got.modified = h.count("last-modified") ? h["last-modified"] : "-";
+        return status;
+    }
+
+    // The object of an http(s) patch in `out`. want (if not empty) is the
+    // sha256 the recipe pins. *how: pinned, cached, revalidated, downloaded,
+    // changed or stale (the server could not be asked; the last copy is used).
+    // *fresh tells whether new bytes came over the network.
+    static bool fetch(const Paths &P, const std::string &url, const std::string &want, fs::path &out, std::string &how, std::string &err,
+                      const std::string &log, bool *fresh = nullptr) {
+        std::error_code ec;
+        std::string name = name_of(url);
+        if (fresh) *fresh = false;
+        if (!(out = find(P, want)).empty()) { how = "pinned"; return true; }
+        auto idx = load(P);
+        auto it = idx.find(url);
+        bool have = it != idx.end() && fs::exists(object(P, it->second.sha, name), ec);
+        int64_t now = (int64_t)std::time(nullptr);
+        Entry e = have ? it->second : Entry();
+        if (have && now - e.checked < ttl() && (want.empty() || want == e.sha)) { out = object(P, e.sha, name); how = "cached"; return true; }
+
+        std::string body;
+        Entry got;
+        int status = get(url, have ? &e : nullptr, body, got, err);
+        if (status == 304 && have) {
+            e.checked = now;
+            store(P, url, e);
+            how = "revalidated";
+        } else if (status >= 200 && status < 300) {
+            fs::path f = put(P, body, name);
+            if (f.empty()) { err = "cannot write to " + dir(P).string(); return false; }
+            got.sha = f.parent_path().filename().string();
+            got.checked = now;
+            how = !have ? "downloaded" : got.sha == e.sha ? "revalidated" : "changed";
+            if (fresh) *fresh = true;
+            e = got;
+            store(P, url, e);
+        } else if (have && (status == 0 || status >= 500)) {
+            how = "stale";
+        } else {
+            if (status) err = "HTTP " + std::to_string(status);
+            return false;
+        }
+        proc::LogSink(log).line("# patch " + url + ": " + how + " " + e.sha + (how == "stale" ? " (" + err + ")" : ""));
+        if (!want.empty() && e.sha != want) { err = "sha256 mismatch: got=" + e.sha + " expected=" + want; return false; }
+        out = object(P, e.sha, name);
+        return true;
+    }
+
+    // The *.patch files (path order) of the git repo's HEAD, as objects.
+    // gitmirror::sync only fetches when ls-remote shows a HEAD the mirror
+    // lacks; the files are read from the mirror in one `git cat-file --batch`.
+    static bool git(const Paths &P, const std::string &url, std::vector<fs::path> &out, std::string &how, std::string &err,
+                    const std::string &log, bool *fetched = nullptr) {
+        std::string commit, tree;
+        bool net = false;
+        if (fetched) *fetched = false;
+        if (!gitmirror::sync(P, url, "", "", commit, err, log, &net)) return false;
+        if (fetched) *fetched = net;
+        fs::path m = gitmirror::dir(P, url);
+        if (!gitmirror::git(m, {"ls-tree", "-r", "-z", commit}, log, &tree)) { err = "cannot list " + commit + " in " + url; return false; }
+        std::string blobs;                  // blob id of every *.patch, one per line
+        std::vector<std::string> names;
+        for (size_t pos = 0, end; pos < tree.size(); pos = end + 1) {
+            end = tree.find('\0', pos);
+            if (end == std::string::npos) end = tree.size();
+            std::string l = tree.substr(pos, end - pos);
+            auto tab = l.find('\t');
+            if (tab == std::string::npos || l.find(" blob ") == std::string::npos) continue;
+            if (l.size() < 6 || l.compare(l.size() - 6, 6, ".patch") != 0) continue;
+            blobs += l.substr(l.find(" blob ") + 6, tab - l.find(" blob ") - 6) + "\n";
+            names.push_back(name_of(l.substr(tab + 1)));
+        }
+        size_t n = names.size();
+        std::string data;
+        if (n && !proc::filter({"git", "-C", m.string(), "cat-file", "--batch"}, blobs.data(), blobs.size(), data).ok()) {
+            err = "git cat-file failed in " + m.string();
+            return false;
+        }
+        for (size_t pos = 0, k = 0; k < n; ++k) {           // "<id> blob <size>\n<bytes>\n" per blob
+            size_t nl = data.find('\n', pos);
+            if (nl == std::string::npos) { err = "short git cat-file output"; return false; }
+            std::string head = data.substr(pos, nl - pos);
+            size_t len = (size_t)std::atoll(head.c_str() + head.find_last_of(' ') + 1);
+            if (head.find(" blob ") == std::string::npos || nl + 1 + len > data.size()) { err = "git cat-file: " + head; return false; }
+            fs::path f = put(P, data.substr(nl + 1, len), names[k]);
+            if (f.empty()) { err = "cannot write to " + dir(P).string(); return false; }
+            out.push_back(f);
+            pos = nl + 1 + len + 1;
+        }
+        how = std::string(net ? "fetched " : "unchanged ") + commit.substr(0, 12) + ", " + std::to_string(n) + " patches";
+        proc::LogSink(log).line("# patch git+" + url + ": " + how);
+        return true;
+    }
+}
+
+// =============== Build cache ===============
+// .sbuild/cache/builds/<key>/ keeps the result of one build: staging/ (the
+// DESTDIR tree after install, postinstall and strip), dbg/ (the name-dbg tree,
+// if any) and packages/ (archives made from it by `package`). The key hashes
+// every build input (see build_key), so a hit can be restored instead of
+// running any phase. Entries are written to a tmp dir and renamed into place.
+namespace buildcache {
+    static fs::path entry(const Paths &P, const std::string &key) { return P.cache / "builds" / key; }
+
+    static bool has(const Paths &P, const std::string &key) {
+        return !key.empty() && fs::is_directory(entry(P, key) / "staging");
+    }
+
+    // Replaces staging (and dbg) with the cached trees; copies cached packages
+    // missing from packages/.
+    static bool restore(const Paths &P, const std::string &key, const fs::path &staging, const fs::path &dbg, treecopy::Stats &st) {
+        if (!has(P, key)) return false;
+        fs::path e = entry(P, key);
+        walk::remove_tree(staging);
+        walk::remove_tree(dbg);
+        bool ok = treecopy::tree(e / "staging", staging, true, &st);
+        if (ok && fs::is_directory(e / "dbg")) ok = treecopy::tree(e / "dbg", dbg, true, &st);
+        if (!ok) { walk::remove_tree(staging); walk::remove_tree(dbg); return false; }
+        std::error_code ec;
+        for (auto &f : fs::directory_iterator(e / "packages", ec)) {
+            fs::path to = P.packages / f.path().filename();
+            if (fs::exists(to)) continue;
+            fs::create_directories(P.packages);
+            treecopy::file(f.path(), to, true);
+        }
+        return true;
+    }
+
+    static bool store(const Paths &P, const std::string &key, const fs::path &staging, const fs::path &dbg) {
+        if (key.empty() || has(P, key)) return true;
+        fs::path e = entry(P, key);
+        fs::path tmp = e; tmp += ".tmp" + std::to_string(getpid());
+        walk::remove_tree(tmp);
+        bool ok = treecopy::tree(staging, tmp / "staging", true);
+        std::error_code ec;
+        if (ok && fs::is_directory(dbg, ec) && !fs::is_empty(dbg, ec)) ok = treecopy::tree(dbg, tmp / "dbg", true);
+        if (ok) { fs::create_directories(tmp / "packages", ec); fs::rename(tmp, e, ec); ok = !ec; }
+        if (!ok) walk::remove_tree(tmp);
+        return ok;
+    }
+
+    // Attaches freshly made package archives to an existing entry.
+    static void add_packages(const Paths &P, const std::string &key, const std::vector<fs::path> &pkgs) {
+        if (!has(P, key)) return;
+        fs::path dir = entry(P, key) / "packages";
+        std::error_code ec;
+        fs::create_directories(dir, ec);
+        for (auto &p : pkgs) {
+            fs::path to = dir / p.filename();
+            fs::remove(to, ec);
+            treecopy::file(p, to, true);
+        }
+    }
+}
+
+// =============== Pristine source trees ===============
+// .sbuild/cache/trees/<key>/tree is an extracted and patched source tree,
+// keyed by sha256(archive sha256, patch contents). Builds get a clone of it
+// instead of running tar and patch again: FICLONE where the filesystem can
+// share extents, otherwise a hardlink farm (SB_TREE_CLONE=copy forces plain
+// copies). A build that writes into a hardlinked file in place also changes
+// the pristine copy, so <key>/index records size, mtime and permission bits of
+// every file (a chmod through a link changes no mtime) and an entry that no
+// longer matches is dropped instead of being cloned.
+namespace pristine {
+    using Snapshot = std::map<std::string, std::tuple<uint64_t, int64_t, uint32_t>>;   // rel -> size, mtime, mode
+    static const char *INDEX_V2 = "pristine-index 2";
+
+    static fs::path entry(const Paths &P, const std::string &key) { return P.cache / "trees" / key; }
+
+    static bool allow_links() {
+        const char *m = std::getenv("SB_TREE_CLONE");
+        return !(m && std::string(m) == "copy");
+    }
+
+    static Snapshot snapshot(const fs::path &tree) {
+        Snapshot out;
+        for (auto &e : walk::tree(tree, {true, 0})) if (e.type == DT_REG) out[e.rel] = {e.size, e.mtime_ns, e.mode & 07777};
+        return out;
+    }
+
+    // True when the entry exists and none of its files changed since it was stored.
+    static bool valid(const Paths &P, const std::string &key) {
+        fs::path e = entry(P, key);
+        std::ifstream in(e / "index");
+        if (!in || !fs::is_directory(e / "tree")) return false;
+        std::string line;
+        if (!std::getline(in, line) || line != INDEX_V2) { walk::remove_tree(e); return false; }   // older index without modes
+        Snapshot want;
+        uint64_t size; int64_t mtime; uint32_t mode;
+        std::string rel;
+        while (in >> size >> mtime >> std::oct >> mode >> std::dec && std::getline(in >> std::ws, rel)) want[rel] = {size, mtime, mode};
+        if (snapshot(e / "tree") == want) return true;
+        term::warn("pristine tree " + key.substr(0, 16) + " was modified through a hardlink; dropping it");
+        walk::remove_tree(e);
+        return false;
+    }
+
+    static bool clone(const Paths &P, const std::string &key, const fs::path &out, treecopy::Stats &st) {
+        walk::remove_tree(out);
+        if (treecopy::tree(entry(P, key) / "tree", out, allow_links(), &st)) return true;
+        walk::remove_tree(out);
+        return false;
+    }
+
+    // Saves a freshly extracted and patched tree (before anything builds in it).
+    static bool store(const Paths &P, const std::string &key, const fs::path &tree) {
+        fs::path e = entry(P, key);
+        fs::path tmp = e; tmp += ".tmp" + std::to_string(getpid());
+        walk::remove_tree(tmp);
+        if (!treecopy::tree(tree, tmp / "tree", allow_links())) { walk::remove_tree(tmp); return false; }
+        {
+            std::ofstream idx(tmp / "index");
+            idx << INDEX_V2 << "\n";
+            for (auto &[rel, sm] : snapshot(tmp / "tree")) {
+                char mode[16]; std::snprintf(mode, sizeof(mode), "%04o", std::get<2>(sm));
+                idx << std::get<0>(sm) << ' ' << std::get<1>(sm) << ' ' << mode << ' ' << rel << "\n";
+            }
+        }
+        walk::remove_tree(e);
+        std::error_code ec;
+        fs::rename(tmp, e, ec);
+        if (ec) walk::remove_tree(tmp);
+        return !ec;
+    }
+}
+
+// =============== Remote build cache ===============
+// Extra tiers behind the local build cache, listed in SB_CACHE_REMOTE
+// (comma-separated, tried in order): a directory shared between build hosts
+// (NFS and the like) or an http:// base URL answering GET/HEAD/PUT (see
+// `cache-serve`). An entry travels as <key>.tar.zst plus <key>.sha256. A
+// download is hashed while it streams into tar and lands in the local cache
+// only when the digest matches; uploads run on background threads while the
+// rest of the install proceeds.
+namespace remotecache {
+    struct Stats {
+        std::mutex mu;
+        std::string outcome;            // "local hit", "remote hit (<tier>)", "miss"
+        uint64_t down = 0, up = 0;      // bytes
+        double down_secs = 0, up_secs = 0;
+        size_t uploads = 0, failed = 0;
+    };
+    static Stats &stats() { static Stats s; return s; }
+    static std::vector<std::thread> &uploads() { static std::vector<std::thread> v; return v; }
+
+    static std::vector<std::string> tiers() {
+        std::vector<std::string> out;
+        const char *env = std::getenv("SB_CACHE_REMOTE");
+        std::istringstream in(env ? env : "");
+        for (std::string t; std::getline(in, t, ',');) {
+            t = trim(t);
+            if (t.rfind("file://", 0) == 0) t = t.substr(7);
+            while (t.size() > 1 && t.back() == '/') t.pop_back();
+            if (!t.empty()) out.push_back(t);
+        }
+        return out;
+    }
+    static bool is_http(const std::string &tier) { return tier.rfind("http://", 0) == 0; }
+
+    // Streams tier/name to sink; false if absent or interrupted.
+    static bool get(const std::string &tier, const std::string &name, const proc::Sink &sink) {
+        if (is_http(tier)) return http::request("GET", tier + "/" + name, sink).ok();
+        int fd = ::open((fs::path(tier) / name).c_str(), O_RDONLY | O_CLOEXEC);
+        if (fd < 0) return false;
+        std::vector<char> buf(1 << 20);
+        ssize_t n;
+        while ((n = ::read(fd, buf.data(), buf.size())) > 0) sink(buf.data(), (size_t)n);
+        ::close(fd);
+        return n == 0;
+    }
+
+    static bool put(const std::string &tier, const std::string &name, const fs::path &file) {
+        if (is_http(tier)) {
+            int fd = ::open(file.c_str(), O_RDONLY | O_CLOEXEC);
+            struct stat st{};
+            if (fd < 0 || fstat(fd, &st) != 0) { if (fd >= 0) ::close(fd); return false; }
+            auto r = http::request("PUT", tier + "/" + name, {}, fd, (uint64_t)st.st_size);
+            ::close(fd);
+            return r.ok();
+        }
+        fs::path tmp = fs::path(tier) / ("." + name + ".tmp" + std::to_string(getpid()));
+        std::error_code ec;
+        if (!treecopy::file(file, tmp, false)) { fs::remove(tmp, ec); return false; }
+        fs::rename(tmp, fs::path(tier) / name, ec);
+        return !ec;
+    }
+
+    // Downloads `key` from the first tier that has it into the local build cache.
+    static bool pull(const Paths &P, const std::string &key, const std::string &log) {
+        proc::LogSink ls(log);
+        for (auto &tier : tiers()) {
+            std::string want;
+            if (!get(tier, key + ".sha256", [&](const char *d, size_t n){ want.append(d, n); })) continue;
+            want = trim(want).substr(0, 64);
+            fs::path entry = buildcache::entry(P, key);
+            fs::path tmp = entry; tmp += ".dl" + std::to_string(getpid());
+            walk::remove_tree(tmp);
+            fs::create_directories(tmp);
+            int fds[2];
+            if (pipe2(fds, O_CLOEXEC) != 0) { walk::remove_tree(tmp); return false; }
+            proc::Result untar;
+            std::thread tar([&]{
+                proc::Opts o; o.in = fds[0]; o.out = ls.sink();
+                untar = proc::run({"tar", "--zstd", "-xf", "-", "-C", tmp.string()}, o);
+            });
+            sha256::Hasher h;
+            uint64_t bytes = 0;
+            bool piped = true;
+            auto t0 = std::chrono::steady_clock::now();
+            bool got = get(tier, key + ".tar.zst", [&](const char *d, size_t n){
+                h.update(d, n);
+                bytes += n;
+                for (size_t off = 0; piped && off < n;) {
+                    ssize_t w = ::write(fds[1], d + off, n - off);
+                    if (w < 0 && errno == EINTR) continue;
+                    if (w <= 0) piped = false; else off += (size_t)w;
+                }
+            });
+            ::close(fds[1]);
+            tar.join();
+            ::close(fds[0]);
+            double secs = std::chrono::duration<double>(std::chrono::steady_clock::now() - t0).count();
+            std::string digest = h.hex();
+            std::error_code ec;
+            if (got && piped && untar.ok() && digest == want && fs::is_directory(tmp / "staging")) fs::rename(tmp, entry, ec);
+            else ec = std::make_error_code(std::errc::io_error);
+            if (ec) {
+                walk::remove_tree(tmp);
+                term::warn("build cache: " + tier + ": " + key.substr(0, 16) + (digest != want && got ? " failed hash verification" : " download failed"));
+                continue;
+            }
+            auto &s = stats();
+            std::lock_guard<std::mutex> lk(s.mu);
+            s.outcome = "remote hit (" + tier + ")";
+            s.down += bytes; s.down_secs += secs;
+            return true;
+        }
+        return false;
+    }
+
+    // Packs the local entry once and uploads it to every tier that lacks it, in the background.
+    static void push_async(const Paths &P, const std::string &key, const std::string &log) {
+        auto ts = tiers();
+        if (ts.empty() || !buildcache::has(P, key)) return;
+        uploads().emplace_back([P, key, log, ts]{
+            auto t0 = std::chrono::steady_clock::now();
+            fs::path archive = buildcache::entry(P, key); archive += ".up" + std::to_string(getpid()) + ".tar.zst";
+            fs::path sum = archive; sum += ".sha256";
+            proc::LogSink ls(log);
+            proc::Opts o; o.out = ls.sink();
+            bool ok = proc::run({"tar", "--zstd", "-C", buildcache::entry(P, key).string(), "-cf", archive.string(), "."}, o).ok();
+            std::string digest = ok ? sha256::file(archive) : std::string();
+            if (ok) { std::ofstream(sum) << digest << "  " << key << ".tar.zst\n"; }
+            uint64_t size = ok ? fs::file_size(archive) : 0, sent = 0;
+            size_t failed = ok ? 0 : ts.size(), pushed = 0;
+            for (auto &tier : ts) {
+                if (!ok) break;
+                bool present = is_http(tier) ? http::request("HEAD", tier + "/" + key + ".sha256").ok()
+                                             : fs::exists(fs::path(tier) / (key + ".sha256"));
+                if (present) continue;
+                // The checksum goes last: a reader that finds it will find the archive too.
+                if (put(tier, key + ".tar.zst", archive) && put(tier, key + ".sha256", sum)) { sent += size; pushed++; }
+                else { failed++; ls.line("build cache: upload of " + key + " to " + tier + " failed"); }
+            }
+            std::error_code ec;
+            fs::remove(archive, ec); fs::remove(sum, ec);
+            auto &s = stats();
+            std::lock_guard<std::mutex> lk(s.mu);
+            s.up += sent;
+            s.up_secs += std::chrono::duration<double>(std::chrono::steady_clock::now() - t0).count();
+            s.uploads += pushed;
+            s.failed += failed;
+        });
+    }
+
+    // Waits for pending uploads and prints this run's cache statistics.
+    static void finish() {
+        for (auto &t : uploads()) t.join();
+        uploads().clear();
+        auto &s = stats();
+        if (s.outcome.empty()) return;
+        auto rate = [](uint64_t b, double secs){ return secs > 0 ? ", " + human_size((double)b / secs) + "/s" : std::string(); };
+        char secs_down[32], secs_up[32];
+        std::snprintf(secs_down, sizeof(secs_down), "%.2fs", s.down_secs);
+        std::snprintf(secs_up, sizeof(secs_up), "%.2fs", s.up_secs);
+        std::string line = "build cache: " + s.outcome;
+        if (s.down) line += "; downloaded " + human_size((double)s.down) + " in " + secs_down + rate(s.down, s.down_secs);
+        if (s.uploads || s.failed) line += "; uploaded " + human_size((double)s.up) + " to " + std::to_string(s.uploads) + " tier(s) in " + secs_up + rate(s.up, s.up_secs);
+        if (s.failed) line += "; " + std::to_string(s.failed) + " upload(s) failed";
+        term::info(line);
+    }
+}
+
+// =============== Phase stamps ===============
+// .sbuild/stamps/<name>-<version>/<phase> holds the hash of what that phase
+// ran, chained with the stamp before it (see phase_stamps). A build resumes at
+// the first phase whose stamp is missing or different; work/ and the staging
+// tree are only reset by the phases that produce them.
+namespace stamps {
+    enum Phase { FETCH, EXTRACT, PATCH, PRECONFIG, CONFIG, BUILD, INSTALL, POSTINSTALL, STRIP, COUNT };
+    static const char *const NAMES[COUNT] = {"fetch", "extract", "patch", "preconfig", "config", "build", "install", "postinstall", "strip"};
+
+    static int index(const std::string &phase) {
+        for (int i = 0; i < COUNT; ++i) if (phase == NAMES[i]) return i;
+        return -1;
+    }
+
+    static fs::path dir(const Paths &P, const std::string &id) { return P.state / "stamps" / id; }
+
+    static std::string read(const Paths &P, const std::string &id, int phase) {
+        std::ifstream in(dir(P, id) / NAMES[phase]);
+        std::string s;
+        std::getline(in, s);
+        return s;
+    }
+
+    static void write(const Paths &P, const std::string &id, int phase, const std::string &value) {
+        std::error_code ec;
+        fs::create_directories(dir(P, id), ec);
+        fs::path f = dir(P, id) / NAMES[phase], tmp = f;
+        tmp += ".tmp";
+        { std::ofstream(tmp) << value << "\n"; }
+        fs::rename(tmp, f, ec);
+    }
+
+    // Removes the stamps of `from` and every later phase.
+    static void clear_from(const Paths &P, const std::string &id, int from) {
+        std::error_code ec;
+        for (int i = from; i < COUNT; ++i) fs::remove(dir(P, id) / NAMES[i], ec);
+    }
+
+    // First phase whose stamp differs from `want` (COUNT when all match).
+    static int first_stale(const Paths &P, const std::string &id, const std::vector<std::string> &want) {
+        for (int i = 0; i < COUNT; ++i) if (read(P, id, i) != want[i]) return i;
+        return COUNT;
+    }
+}
+
+// =============== Archive extraction ===============
+// Source archives are unpacked in-process. Tar streams are parsed here, fed
+// by the fastest decompressor installed (pzstd, pigz, lbzip2; xz -T0), and
+// zip members are inflated straight out of an mmap. Regular files are
+// written on the work pool while the parser moves on; links, directory
+// creation and the final directory modes/mtimes stay on the calling thread.
+// Members that would escape the tree (.., or through a symlink the archive
+// itself created) are skipped. Anything unsupported (sparse tar members,
+// encrypted or exotic zips) fails and extract_source falls back to tar/unzip.
+namespace unpack {
+    struct Stats {
+        std::atomic<size_t> files{0}, dirs{0}, links{0};
+        std::atomic<uint64_t> bytes{0};
+        std::string tool = "native";      // decompressor feeding the tar parser
+        std::string summary() const {
+            return std::to_string(files.load()) + " files, " + std::to_string(dirs.load()) + " dirs, " +
+                   std::to_string(links.load()) + " links, " + human_size((double)bytes.load()) + " via " + tool;
+        }
+    };
+
+    // The output tree: member name cleanup, directory creation and deferred
+    // directory metadata. file() may be called from several threads once the
+    // parents exist; everything else belongs to the parsing thread.
+    class Tree {
+    public:
+        Tree(const fs::path &root, int strip, Stats &st) : strip_(strip), st_(st) {
+            std::error_code ec;
+            fs::create_directories(root, ec);
+            fd_ = ::open(root.c_str(), O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+            mask_ = current_umask();
+            keep_mode_ = geteuid() == 0;    // like tar: root gets the archived modes, others the umask
+        }
+        ~Tree() { if (fd_ >= 0) ::close(fd_); }
+        Tree(const Tree&) = delete;
+        Tree &operator=(const Tree&) = delete;
+
+        bool ok() const { return fd_ >= 0 && !failed_; }
+        std::string error() { std::lock_guard<std::mutex> g(mu_); return err_; }
+        // sys: append strerror(errno), for failed syscalls.
+        bool fail(const std::string &what, bool sys = true) {
+            int e = errno;
+            std::lock_guard<std::mutex> g(mu_);
+            if (err_.empty()) err_ = what + (sys && e ? std::string(": ") + std::strerror(e) : "");
+            failed_ = true;
+            return false;
+        }
+
+        // Relative output path of an archive member, "" to skip it.
+        std::string rel(const std::string &name) const {
+            std::string out;
+            int skip = strip_;
+            for (size_t i = 0; i <= name.size();) {
+                size_t j = name.find('/', i);
+                if (j == std::string::npos) j = name.size();
+                std::string c = name.substr(i, j - i);
+                i = j + 1;
+                if (c.empty() || c == ".") continue;
+                if (c == "..") return "";
+                if (skip > 0) { skip--; continue; }
+                if (!out.empty()) out += '/';
+                out += c;
+            }
+            for (size_t k = out.find('/'); k != std::string::npos; k = out.find('/', k + 1))
+                if (links_.count(out.substr(0, k))) return "";
+            return out;
+        }
+
+        bool parents(const std::string &rel) {
+            for (size_t k = rel.find('/'); k != std::string::npos; k = rel.find('/', k + 1)) {
+                std::string d = rel.substr(0, k);
+                if (dirs_.insert(d).second && mkdirat(fd_, d.c_str(), 0755) != 0 && errno != EEXIST) return fail("mkdir " + d);
+            }
+            return true;
+        }
+
+        bool dir(const std::string &rel, mode_t mode, int64_t mtime) {
+            if (!parents(rel)) return false;
+            if (dirs_.insert(rel).second) {
+                if (mkdirat(fd_, rel.c_str(), 0700 | (mode & 0777)) != 0 && errno != EEXIST) return fail("mkdir " + rel);
+                st_.dirs++;
+            }
+            meta_.emplace_back(rel, mode, mtime);
+            return true;
+        }
+
+        bool symlink(const std::string &rel, const std::string &target, int64_t mtime) {
+            if (!parents(rel)) return false;
+            if (symlinkat(target.c_str(), fd_, rel.c_str()) != 0) {
+                if (errno != EEXIST || unlinkat(fd_, rel.c_str(), 0) != 0 || symlinkat(target.c_str(), fd_, rel.c_str()) != 0)
+                    return fail("symlink " + rel);
+            }
+            struct timespec t[2] = {{0, UTIME_NOW}, {(time_t)mtime, 0}};
+            utimensat(fd_, rel.c_str(), t, AT_SYMLINK_NOFOLLOW);
+            links_.insert(rel);
+            st_.links++;
+            return true;
+        }
+
+        bool hardlink(const std::string &rel, const std::string &target) {
+            if (!parents(rel)) return false;
+            if (linkat(fd_, target.c_str(), fd_, rel.c_str(), 0) != 0) {
+                if (errno != EEXIST || unlinkat(fd_, rel.c_str(), 0) != 0 || linkat(fd_, target.c_str(), fd_, rel.c_str(), 0) != 0)
+                    return fail("link " + rel + " -> " + target);
+            }
+            st_.links++;
+            return true;
+        }
+
+        // A new regular file (replacing any earlier member of the same name); parents must exist.
+        int create(const std::string &rel, mode_t mode) {
+            int fd = openat(fd_, rel.c_str(), O_WRONLY | O_CREAT | O_EXCL | O_CLOEXEC, mode & 07777);
+            if (fd < 0 && errno == EEXIST && unlinkat(fd_, rel.c_str(), 0) == 0)
+                fd = openat(fd_, rel.c_str(), O_WRONLY | O_CREAT | O_EXCL | O_CLOEXEC, mode & 07777);
+            if (fd < 0) fail("create " + rel);
+            return fd;
+        }
+
+        bool close(int fd, const std::string &rel, mode_t mode, int64_t mtime, uint64_t size) {
+            if (keep_mode_ && (mode & mask_)) fchmod(fd, mode & 07777);
+            struct timespec t[2] = {{0, UTIME_NOW}, {(time_t)mtime, 0}};
+            futimens(fd, t);
+            if (::close(fd) != 0) return fail("write " + rel);
+            st_.files++; st_.bytes += size;
+            return true;
+        }
+
+        bool file(const std::string &rel, const char *data, size_t n, mode_t mode, int64_t mtime) {
+            int fd = create(rel, mode);
+            if (fd < 0) return false;
+            for (size_t done = 0; done < n;) {
+                ssize_t w = ::write(fd, data + done, n - done);
+                if (w < 0 && errno == EINTR) continue;
+                if (w <= 0) { ::close(fd); return fail("write " + rel); }
+                done += (size_t)w;
+            }
+            return close(fd, rel, mode, mtime, n);
+        }
+
+        // Directory modes and mtimes, deepest first (files written above would bump the mtimes).
+        bool finish() {
+            std::sort(meta_.begin(), meta_.end(), [](const auto &a, const auto &b){ return std::get<0>(a) > std::get<0>(b); });
+            for (auto &[d, mode, mtime] : meta_) {
+                fchmodat(fd_, d.c_str(), (keep_mode_ ? mode : mode & ~mask_) & 07777, 0);
+                struct timespec t[2] = {{0, UTIME_NOW}, {(time_t)mtime, 0}};
+                utimensat(fd_, d.c_str(), t, 0);
+            }
+            return ok();
+        }
+
+    private:
+        // Read from /proc: umask() itself would briefly change it for every other thread.
+        static mode_t current_umask() {
+            std::ifstream f("/proc/self/status");
+            for (std::string line; std::getline(f, line);)
+                if (line.rfind("Umask:", 0) == 0) return (mode_t)std::strtoul(line.c_str() + 6, nullptr, 8);
+            return 022;
+        }
+
+        int fd_ = -1, strip_ = 0;
+        mode_t mask_ = 022;
+        bool keep_mode_ = false;
+        Stats &st_;
+        std::set<std::string> dirs_, links_;
+        std::vector<std::tuple<std::string, mode_t, int64_t>> meta_;
+        std::mutex mu_;
+        std::atomic<bool> failed_{false};
+        std::string err_;
+    };
+
+    // Small files queued for the work pool; bounded so a fast decompressor cannot run ahead unchecked.
+    class Writer {
+    public:
+        struct Job { std::string rel, data; mode_t mode; int64_t mtime; };
+
+        Writer(Tree &t, unsigned jobs) : tree_(t) {
+            for (unsigned i = 1; i < jobs; ++i) pool_.emplace_back([this]{ work(); });
+        }
+        ~Writer() { stop(); }
+
+        void push(Job &&j) {
+            if (pool_.empty()) { tree_.file(j.rel, j.data.data(), j.data.size(), j.mode, j.mtime); return; }
+            std::unique_lock<std::mutex> g(mu_);
+            room_.wait(g, [&]{ return queued_ < LIMIT || q_.empty(); });
+            queued_ += j.data.size();
+            q_.push_back(std::move(j));
+            ready_.notify_one();
+        }
+
+        // Waits until everything queued is on disk (hardlinks and duplicate names need this).
+        void drain() {
+            std::unique_lock<std::mutex> g(mu_);
+            idle_.wait(g, [&]{ return q_.empty() && busy_ == 0; });
+        }
+
+        void stop() {
+            { std::lock_guard<std::mutex> g(mu_); done_ = true; }
+            ready_.notify_all();
+            for (auto &t : pool_) t.join();
+            pool_.clear();
+        }
+
+    private:
+        static constexpr size_t LIMIT = 64u << 20;
+        Tree &tree_;
+        std::vector<std::thread> pool_;
+        std::mutex mu_;
+        std::condition_variable ready_, room_, idle_;
+        std::deque<Job> q_;
+        size_t queued_ = 0;
+        unsigned busy_ = 0;
+        bool done_ = false;
+
+        void work() {
+            std::unique_lock<std::mutex> g(mu_);
+            for (;;) {
+                ready_.wait(g, [&]{ return done_ || !q_.empty(); });
+                if (q_.empty()) return;
+                Job j = std::move(q_.front());
+                q_.pop_front();
+                queued_ -= j.data.size();
+                busy_++;
+                room_.notify_one();
+                g.unlock();
+                tree_.file(j.rel, j.data.data(), j.data.size(), j.mode, j.mtime);
+                g.lock();
+                busy_--;
+                if (q_.empty() && busy_ == 0) idle_.notify_all();
+            }
+        }
+    };
+
+    // Streaming tar reader (ustar, GNU long names, pax path/linkpath/size/mtime);
+    // feed() takes the archive in arbitrary chunks.
+    class TarStream {
+    public:
+        TarStream(Tree &t, unsigned jobs) : tree_(t), writer_(t, jobs) {}
+
+        void feed(const char *p, size_t n) {
+            while (n && tree_.ok()) {
+                size_t k = 0;
+                switch (state_) {
+                case HEADER:
+                    k = std::min(n, sizeof(hdr_) - have_);
+                    std::memcpy(hdr_ + have_, p, k);
+                    have_ += k;
+                    if (have_ == sizeof(hdr_)) { have_ = 0; header(); }
+                    break;
+                case DATA:
+                    k = (size_t)std::min<uint64_t>(n, left_);
+                    if (fd_ >= 0) {
+                        for (size_t done = 0; done < k;) {
+                            ssize_t w = ::write(fd_, p + done, k - done);
+                            if (w < 0 && errno == EINTR) continue;
+                            if (w <= 0) { tree_.fail("write " + cur_.rel); break; }
+                            done += (size_t)w;
+                        }
+                    } else cur_.data.append(p, k);
+                    left_ -= k;
+                    if (!left_) end_member();
+                    break;
+                case META:
+                    k = (size_t)std::min<uint64_t>(n, left_);
+                    meta_.append(p, k);
+                    left_ -= k;
+                    if (!left_) end_meta();
+                    break;
+                case SKIP:
+                    k = (size_t)std::min<uint64_t>(n, left_);
+                    left_ -= k;
+                    if (!left_) state_ = HEADER;
+                    break;
+                case END:
+                    return;
+                }
+                p += k; n -= k;
+            }
+        }
+
+        bool finish(std::string &err) {
+            writer_.stop();
+            if (fd_ >= 0) { ::close(fd_); fd_ = -1; }
+            if (tree_.ok() && state_ != END && !(state_ == HEADER && have_ == 0)) tree_.fail("truncated tar stream", false);
+            if (!tree_.finish()) { err = tree_.error(); return false; }
+            return true;
+        }
+
+    private:
+        enum State { HEADER, DATA, META, SKIP, END };
+        static constexpr uint64_t SMALL = 1u << 20;   // larger files are written by the parser as they stream in
+        Tree &tree_;
+        Writer writer_;
+        State state_ = HEADER;
+        char hdr_[512];
+        size_t have_ = 0;
+        uint64_t left_ = 0, pad_ = 0;
+        int zeros_ = 0, fd_ = -1;
+        char kind_ = 0;
+        std::string meta_, long_name_, long_link_, pax_path_, pax_link_;
+        int64_t pax_size_ = -1, pax_mtime_ = -1;
+        Writer::Job cur_;
+        std::set<std::string> written_;
+
+        static uint64_t num(const char *f, size_t len) {
+            if ((unsigned char)f[0] & 0x80) {           // GNU base-256
+                uint64_t v = (unsigned char)f[0] & 0x7f;
+                for (size_t i = 1; i < len; ++i) v = (v << 8) | (unsigned char)f[i];
+                return v;
+            }
+            uint64_t v = 0;
+            size_t i = 0;
+            while (i < len && (f[i] == ' ' || f[i] == 0)) i++;
+            for (; i < len && f[i] >= '0' && f[i] <= '7'; ++i) v = v * 8 + (uint64_t)(f[i] - '0');
+            return v;
+        }
+        static std::string str(const char *f, size_t len) { return std::string(f, strnlen(f, len)); }
+
+        void skip(uint64_t size) {
+            left_ = size + ((512 - size % 512) % 512);
+            state_ = left_ ? SKIP : HEADER;
+        }
+
+        void header() {
+            if (std::all_of(hdr_, hdr_ + 512, [](char c){ return c == 0; })) {
+                if (++zeros_ == 2) state_ = END;
+                return;
+            }
+            zeros_ = 0;
+            uint64_t sum = 0;
+            int64_t ssum = 0;
+            for (int i = 0; i < 512; ++i) {
+                char c = (i >= 148 && i < 156) ? ' ' : hdr_[i];
+                sum += (unsigned char)c; ssum += (signed char)c;
+            }
+            uint64_t want = num(hdr_ + 148, 8);
+            if (want != sum && (int64_t)want != ssum) { tree_.fail("bad tar header checksum", false); return; }
+
+            char type = hdr_[156];
+            uint64_t size = num(hdr_ + 124, 12);
+            if (pax_size_ >= 0 && type != 'x' && type != 'L' && type != 'K') size = (uint64_t)pax_size_;
+            if (type == 'L' || type == 'K' || type == 'x') {
+                kind_ = type; meta_.clear();
+                left_ = size; pad_ = (512 - size % 512) % 512;
+                state_ = META;
+                if (!left_) end_meta();
+                return;
+            }
+
+            std::string name = str(hdr_, 100);
+            if (std::memcmp(hdr_ + 257, "ustar", 6) == 0 && hdr_[345]) name = str(hdr_ + 345, 155) + "/" + name;
+            if (!long_name_.empty()) name = long_name_;
+            if (!pax_path_.empty()) name = pax_path_;
+            std::string link = str(hdr_ + 157, 100);
+            if (!long_link_.empty()) link = long_link_;
+            if (!pax_link_.empty()) link = pax_link_;
+            mode_t mode = (mode_t)num(hdr_ + 100, 8);
+            int64_t mtime = pax_mtime_ >= 0 ? pax_mtime_ : (int64_t)num(hdr_ + 136, 12);
+            long_name_.clear(); long_link_.clear(); pax_path_.clear(); pax_link_.clear();
+            pax_size_ = pax_mtime_ = -1;
+
+            std::string rel = tree_.rel(name);
+            if (type == 'S') { tree_.fail("sparse member " + name + " is not supported", false); return; }
+            if (type == 'g' || rel.empty()) { skip(size); return; }
+            if (type == '5') { tree_.dir(rel, mode, mtime); skip(size); return; }
+            if (type == '2') { tree_.symlink(rel, link, mtime); skip(size); return; }
+            if (type == '1') {
+                std::string target = tree_.rel(link);
+                if (!target.empty()) { writer_.drain(); tree_.hardlink(rel, target); }
+                skip(size); return;
+            }
+            if (type != '0' && type != 0 && type != '7') { skip(size); return; }   // devices, fifos, volume labels
+
+            if (!tree_.parents(rel)) return;
+            if (!written_.insert(rel).second) writer_.drain();   // a later member of the same name wins
+            cur_ = Writer::Job{rel, {}, mode, mtime};
+            left_ = size; pad_ = (512 - size % 512) % 512;
+            if (size > SMALL) { if ((fd_ = tree_.create(rel, mode)) < 0) return; }
+            else cur_.data.reserve(size);
+            state_ = DATA;
+            if (!left_) end_member();
+        }
+
+        void end_member() {
+            uint64_t size = fd_ >= 0 ? 0 : cur_.data.size();
+            if (fd_ >= 0) {
+                off_t end = lseek(fd_, 0, SEEK_CUR);
+                tree_.close(fd_, cur_.rel, cur_.mode, cur_.mtime, end > 0 ? (uint64_t)end : size);
+                fd_ = -1;
+            } else writer_.push(std::move(cur_));
+            left_ = pad_;
+            state_ = left_ ? SKIP : HEADER;
+        }
+
+        void end_meta() {
+            if (kind_ == 'L') long_name_ = str(meta_.data(), meta_.size());
+            else if (kind_ == 'K') long_link_ = str(meta_.data(), meta_.size());
+            else {
+                // pax records: "<len> <key>=<value>\n"
+                for (size_t pos = 0; pos < meta_.size();) {
+                    size_t sp = meta_.find(' ', pos);
+                    if (sp == std::string::npos) break;
+                    size_t len = (size_t)std::strtoull(meta_.c_str() + pos, nullptr, 10);
+                    if (len == 0 || pos + len > meta_.size()) break;
+                    std::string rec = meta_.substr(sp + 1, pos + len - sp - 2);
+                    pos += len;
+                    auto eq = rec.find('=');
+                    if (eq == std::string::npos) continue;
+                    std::string k = rec.substr(0, eq), v = rec.substr(eq + 1);
+                    if (k == "path") pax_path_ = v;
+                    else if (k == "linkpath") pax_link_ = v;
+                    else if (k == "size") pax_size_ = (int64_t)std::strtoull(v.c_str(), nullptr, 10);
+                    else if (k == "mtime") pax_mtime_ = (int64_t)std::strtoll(v.c_str(), nullptr, 10);
+                }
+            }
+            left_ = pad_;
+            state_ = left_ ? SKIP : HEADER;
+        }
+    };
+
+    // Raw DEFLATE (RFC 1951) into a buffer of the known output size.
+    class Inflate {
+    public:
+        Inflate(const uint8_t *in, size_t n, uint8_t *out, size_t cap) : in_(in), end_(in + n), out_(out), cap_(cap) {}
+
+        bool run() {
+            for (int last = 0; !last;) {
+                last = bits(1);
+                int type = bits(2);
+                bool ok = type == 0 ? stored() : type == 1 ? codes(fixed().first, fixed().second) : type == 2 && dynamic();
+                if (!ok || bad_) return false;
+            }
+            return pos_ == cap_;
+        }
+
+    private:
+        static constexpr int FAST = 9;
+        struct Huff {
+            uint16_t count[16]{}, symbol[288]{};
+            uint16_t fast[1 << FAST]{};     // (symbol << 4) | length for codes of up to FAST bits
+        };
+        const uint8_t *in_, *end_;
+        uint8_t *out_;
+        size_t cap_, pos_ = 0;
+        uint64_t buf_ = 0;
+        int cnt_ = 0, over_ = 0;
+        bool bad_ = false;
+
+        void need(int n) {
+            while (cnt_ < n) {
+                if (in_ < end_) buf_ |= (uint64_t)*in_++ << cnt_;
+                else if (++over_ > 4) bad_ = true;      // lookahead past the end reads zeros
+                cnt_ += 8;
+            }
+        }
+        int bits(int n) {
+            need(n);
+            int v = (int)(buf_ & ((1ull << n) - 1));
+            buf_ >>= n; cnt_ -= n;
+            return v;
+        }
+
+        static bool build(Huff &h, const uint8_t *len, int n) {
+            for (int i = 0; i < n; ++i) h.count[len[i]]++;
+            h.count[0] = 0;
+            int left = 1;
+            for (int l = 1; l < 16; ++l) { left <<= 1; left -= h.count[l]; if (left < 0) return false; }
+            uint16_t offs[16] = {0};
+            for (int l = 1; l < 15; ++l) offs[l + 1] = offs[l] + h.count[l];
+            for (int s = 0; s < n; ++s) if (len[s]) h.symbol[offs[len[s]]++] = (uint16_t)s;
+            unsigned code = 0, idx = 0;
+            for (int l = 1; l <= FAST; ++l, code <<= 1)
+                for (int k = 0; k < h.count[l]; ++k, ++code) {
+                    unsigned rev = 0;
+                    for (int b = 0; b < l; ++b) rev |= ((code >> b) & 1) << (l - 1 - b);
+                    for (unsigned r = rev; r < (1u << FAST); r += 1u << l) h.fast[r] = (uint16_t)(h.symbol[idx] << 4 | l);
+                    idx++;
+                }
+            return true;
+        }
+
+        int decode(const Huff &h) {
+            need(FAST);
+            if (uint16_t e = h.fast[buf_ & ((1u << FAST) - 1)]) { buf_ >>= (e & 15); cnt_ -= e & 15; return e >> 4; }
+            int code = 0, first = 0, index = 0;
+            for (int l = 1; l < 16; ++l) {
+                code |= bits(1);
+                int c = h.count[l];
+                if (code - c < first) return h.symbol[index + (code - first)];
+                index += c; first += c;
+                first <<= 1; code <<= 1;
+            }
+            bad_ = true;
+            return -1;
+        }
+
+        bool stored() {
+            bits(cnt_ & 7);
+            unsigned len = (unsigned)bits(16), nlen = (unsigned)bits(16);
+            if ((len ^ 0xffff) != nlen || len > cap_ - pos_) return false;
+            for (; len && cnt_ >= 8; --len) out_[pos_++] = (uint8_t)bits(8);
+            if ((size_t)(end_ - in_) < len) return false;
+            std::memcpy(out_ + pos_, in_, len);
+            in_ += len; pos_ += len;
+            return true;
+        }
+
+        static const std::pair<Huff, Huff> &fixed() {
+            static const std::pair<Huff, Huff> t = []{
+                std::pair<Huff, Huff> p;
+                uint8_t len[288];
+                for (int i = 0; i < 288; ++i) len[i] = i < 144 ? 8 : i < 256 ? 9 : i < 280 ? 7 : 8;
+                build(p.first, len, 288);
+                std::fill(len, len + 30, 5);
+                build(p.second, len, 30);
+                return p;
+            }();
+            return t;
+        }
+
+        bool dynamic() {
+            static const uint8_t order[19] = {16, 17, 18, 0, 8, 7, 9, 6, 10, 5, 11, 4, 12, 3, 13, 2, 14, 1, 15};
+            int nlen = bits(5) + 257, ndist = bits(5) + 1, ncode = bits(4) + 4;
+            if (nlen > 286 || ndist > 30) return false;
+            uint8_t len[320] = {0};
+            for (int i = 0; i < ncode; ++i) len[order[i]] = (uint8_t)bits(3);
+            Huff lencode;
+            if (!build(lencode, len, 19)) return false;
+            for (int i = 0; i < nlen + ndist && !bad_;) {
+                int sym = decode(lencode);
+                if (sym < 0) return false;
+                if (sym < 16) { len[i++] = (uint8_t)sym; continue; }
+                uint8_t v = 0;
+                int rep;
+                if (sym == 16) { if (!i) return false; v = len[i - 1]; rep = 3 + bits(2); }
+                else if (sym == 17) rep = 3 + bits(3);
+                else rep = 11 + bits(7);
+                if (i + rep > nlen + ndist) return false;
+                while (rep--) len[i++] = v;
+            }
+            if (!len[256]) return false;
+            Huff lit, dist;
+            if (!build(lit, len, nlen) || !build(dist, len + nlen, ndist)) return false;
+            return codes(lit, dist);
+        }
+
+        bool codes(const Huff &lit, const Huff &dist) {
+            static const uint16_t lbase[29] = {3, 4, 5, 6, 7, 8, 9, 10, 11, 13, 15, 17, 19, 23, 27, 31, 35, 43, 51, 59, 67, 83, 99, 115, 131, 163, 195, 227, 258};
+            static const uint8_t lext[29] = {0, 0, 0, 0, 0, 0, 0, 0, 1, 1, 1, 1, 2, 2, 2, 2, 3, 3, 3, 3, 4, 4, 4, 4, 5, 5, 5, 5, 0};
+            static const uint16_t dbase[30] = {1, 2, 3, 4, 5, 7, 9, 13, 17, 25, 33, 49, 65, 97, 129, 193, 257, 385, 513, 769,
+                                               1025, 1537, 2049, 3073, 4097, 6145, 8193, 12289, 16385, 24577};
+            static const uint8_t dext[30] = {0, 0, 0, 0, 1, 1, 2, 2, 3, 3, 4, 4, 5, 5, 6, 6, 7, 7, 8, 8, 9, 9, 10, 10, 11, 11, 12, 12, 13, 13};
+            while (!bad_) {
+                int sym = decode(lit);
+                if (sym < 256) {
+                    if (sym < 0 || pos_ >= cap_) return false;
+                    out_[pos_++] = (uint8_t)sym;
+                    continue;
+                }
+                if (sym == 256) return true;
+                sym -= 257;
+                if (sym >= 29) return false;
+                size_t n = lbase[sym] + (size_t)bits(lext[sym]);
+                int ds = decode(dist);
+                if (ds < 0 || ds >= 30) return false;
+                size_t d = dbase[ds] + (size_t)bits(dext[ds]);
+                if (d > pos_ || n > cap_ - pos_) return false;
+                uint8_t *o = out_ + pos_;
+                if (d >= n) std::memcpy(o, o - d, n);
+                else for (size_t i = 0; i < n; ++i) o[i] = o[i - d];
+                pos_ += n;
+            }
+            return false;
+        }
+    };
+
+    static int64_t dos_time(uint16_t time, uint16_t date) {
+        struct tm tm{};
+        tm.tm_year = ((date >> 9) & 0x7f) + 80; tm.tm_mon = ((date >> 5) & 0xf) - 1; tm.tm_mday = date & 0x1f;
+        tm.tm_hour = time >> 11; tm.tm_min = (time >> 5) & 0x3f; tm.tm_sec = (time & 0x1f) * 2;
+        tm.tm_isdst = -1;
+        return (int64_t)mktime(&tm);
+    }
+
+    // Zip archives through the central directory (zip64 sizes and offsets,
+    // unix modes, UT mtimes). `strip` only applies when every member sits
+    // under one top-level directory, as zips are often packed without one.
+    static bool zip(const fs::path &archive, const fs::path &out, int strip, std::string &err, Stats &st) {
+        int fd = ::open(archive.c_str(), O_RDONLY | O_CLOEXEC);
+        struct stat s{};
+        if (fd < 0 || fstat(fd, &s) != 0 || s.st_size < 22) { if (fd >= 0) ::close(fd); err = "cannot read " + archive.string(); return false; }
+        size_t size = (size_t)s.st_size;
+        void *m = mmap(nullptr, size, PROT_READ, MAP_PRIVATE, fd, 0);
+        ::close(fd);
+        if (m == MAP_FAILED) { err = "mmap failed"; return false; }
+        std::unique_ptr<void, std::function<void(void*)>> unmap(m, [size](void *p){ munmap(p, size); });
+        const uint8_t *base = (const uint8_t*)m;
+        auto u16 = [&](size_t o){ return (uint32_t)base[o] | (uint32_t)base[o + 1] << 8; };
+        auto u32 = [&](size_t o){ return u16(o) | u16(o + 2) << 16; };
+        auto u64 = [&](size_t o){ return (uint64_t)u32(o) | (uint64_t)u32(o + 4) << 32; };
+
+        size_t eocd = std::string::npos;
+        for (size_t o = size - 22, stop = size > 65557 ? size - 65557 : 0;; --o) {
+            if (u32(o) == 0x06054b50) { eocd = o; break; }
+            if (o == stop) break;
+        }
+        if (eocd == std::string::npos) { err = "no zip end of central directory"; return false; }
+        uint64_t count = u16(eocd + 10), cd = u32(eocd + 16);
+        if ((count == 0xffff || cd == 0xffffffffu) && eocd >= 20 && u32(eocd - 20) == 0x07064b50) {
+            uint64_t z = u64(eocd - 12);
+            if (z + 56 > size || u32((size_t)z) != 0x06064b50) { err = "bad zip64 directory"; return false; }
+            count = u64((size_t)z + 32); cd = u64((size_t)z + 48);
+        }
+
+        struct Member { std::string name; uint32_t method, crc; uint64_t csize, usize, off; mode_t mode; int64_t mtime; };
+        std::vector<Member> members;
+        size_t o = (size_t)cd;
+        for (uint64_t i = 0; i < count; ++i) {
+            if (o + 46 > size || u32(o) != 0x02014b50) { err = "bad zip central directory"; return false; }
+            Member e;
+            uint32_t made_by = u16(o + 4), flags = u16(o + 8), nlen = u16(o + 28), xlen = u16(o + 30), clen = u16(o + 32);
+            if (o + 46 + nlen + xlen > size) { err = "bad zip central directory"; return false; }
+            if (flags & 1) { err = "encrypted zip members are not supported"; return false; }
+            e.method = u16(o + 10); e.crc = u32(o + 16);
+            e.csize = u32(o + 20); e.usize = u32(o + 24); e.off = u32(o + 42);
+            e.name.assign((const char*)base + o + 46, nlen);
+            e.mtime = dos_time((uint16_t)u16(o + 12), (uint16_t)u16(o + 14));
+            bool dir = !e.name.empty() && e.name.back() == '/';
+            e.mode = (made_by >> 8) == 3 && (u32(o + 38) >> 16) ? (mode_t)(u32(o + 38) >> 16) : (dir ? S_IFDIR | 0755 : S_IFREG | 0644);
+            for (size_t x = o + 46 + nlen, xend = x + xlen; x + 4 <= xend;) {
+                uint32_t id = u16(x), len = u16(x + 2);
+                size_t v = x + 4;
+                if (id == 0x0001) {         // zip64: only the fields that overflowed, in this order
+                    if (e.usize == 0xffffffffu && v + 8 <= xend) { e.usize = u64(v); v += 8; }
+                    if (e.csize == 0xffffffffu && v + 8 <= xend) { e.csize = u64(v); v += 8; }
+                    if (e.off == 0xffffffffu && v + 8 <= xend) { e.off = u64(v); v += 8; }
+                } else if (id == 0x5455 && len >= 5 && (base[v] & 1)) e.mtime = (int64_t)u32(v + 1);
+                x += 4 + len;
+            }
+            if (e.method != 0 && e.method != 8) { err = "zip method " + std::to_string(e.method) + " is not supported"; return false; }
+            if (e.off + 30 > size || u32((size_t)e.off) != 0x04034b50) { err = "bad zip local header: " + e.name; return false; }
+            e.off += 30 + u16((size_t)e.off + 26) + u16((size_t)e.off + 28);
+            if (e.off + e.csize > size) { err = "truncated zip member: " + e.name; return false; }
+            members.push_back(std::move(e));
+            o += 46 + nlen + xlen + clen;
+        }
+
+        if (strip) {
+            std::string top;
+            for (auto &e : members) {
+                auto slash = e.name.find('/');
+                std::string t = e.name.substr(0, slash);
+                bool nested = slash != std::string::npos;
+                if (!nested || (!top.empty() && t != top)) { strip = 0; break; }
+                top = t;
+            }
+        }
+
+        Tree tree(out, strip, st);
+        if (!tree.ok()) { err = "cannot create " + out.string(); return false; }
+        // Symlinks first, so rel() refuses members routed through them; then directories; then files.
+        std::vector<std::pair<const Member*, std::string>> files;
+        for (int pass = 0; pass < 3; ++pass)
+            for (auto &e : members) {
+                if (e.name.empty()) continue;
+                int kind = S_ISLNK(e.mode) ? 0 : S_ISDIR(e.mode) || e.name.back() == '/' ? 1 : 2;
+                if (kind != pass) continue;
+                std::string rel = tree.rel(e.name);
+                if (rel.empty()) continue;
+                if (kind == 0) {
+                    std::string target((size_t)e.usize, '\0');
+                    if (e.method == 0) target.assign((const char*)base + e.off, (size_t)e.csize);
+                    else if (!Inflate(base + e.off, (size_t)e.csize, (uint8_t*)&target[0], target.size()).run()) continue;
+                    tree.symlink(rel, target, e.mtime);
+                }
+                else if (kind == 1) tree.dir(rel, e.mode, e.mtime);
+                else if (tree.parents(rel)) files.emplace_back(&e, rel);
+            }
+        parallel_for(files.size(), 0, [&](size_t i){
+            const Member &e = *files[i].first;
+            const std::string &rel = files[i].second;
+            const uint8_t *data = base + e.off;
+            std::vector<uint8_t> buf;
+            if (e.method == 8) {
+                buf.resize((size_t)e.usize);
+                if (!Inflate(data, (size_t)e.csize, buf.data(), buf.size()).run()) { tree.fail("corrupt deflate data: " + e.name, false); return; }
+                data = buf.data();
+            } else if (e.csize != e.usize) { tree.fail("bad stored size: " + e.name, false); return; }
+            if (crc32((const char*)data, (size_t)e.usize) != e.crc) { tree.fail("crc mismatch: " + e.name, false); return; }
+            tree.file(rel, (const char*)data, (size_t)e.usize, e.mode, e.mtime);
+        });
+        if (!tree.finish()) { err = tree.error(); return false; }
+        return true;
+    }
+
+    // Decompressor for a tar archive, parallel ones first; {} for plain .tar.
+    // With from_stdin the archive name only selects the format.
+    static proc::Argv decompressor(const fs::path &archive, std::string &tool, bool from_stdin = false) {
+        std::string f = archive.filename().string(), a = archive.string();
+        auto has = [&](const char *ext){ return f.find(ext) != std::string::npos; };
+        auto pick = [&](std::initializer_list<proc::Argv> cands) {
+            for (auto &c : cands) if (!find_program(c[0]).empty()) {
+                tool = c[0];
+                proc::Argv cmd = c;
+                if (from_stdin) cmd.pop_back();
+                return cmd;
+            }
+            return proc::Argv{};
+        };
+        if (has(".tar.zst") || has(".tzst")) return pick({{"pzstd", "-dcq", a}, {"zstd", "-dcq", a}});
+        if (has(".tar.xz") || has(".txz")) return pick({{"xz", "-dcq", "-T0", a}});
+        if (has(".tar.bz2") || has(".tbz2")) return pick({{"lbzip2", "-dc", a}, {"pbzip2", "-dc", a}, {"bzip2", "-dc", a}});
+        if (has(".tar.gz") || has(".tgz")) return pick({{"pigz", "-dc", a}, {"gzip", "-dc", a}});
+        return {};
+    }
+
+    // pzstd layout (also what transcode:: writes): every zstd frame preceded by
+    // a skippable frame (magic 0x184D2A50, length 4) holding its compressed
+    // size. Returns (offset, size) of each frame, or {} for any other layout.
+    static constexpr uint32_t SKIPPABLE = 0x184D2A50;
+    static std::vector<std::pair<size_t, size_t>> zstd_frames(const uint8_t *p, size_t n) {
+        auto u32 = [&](size_t o){ return (uint32_t)p[o] | (uint32_t)p[o + 1] << 8 | (uint32_t)p[o + 2] << 16 | (uint32_t)p[o + 3] << 24; };
+        std::vector<std::pair<size_t, size_t>> v;
+        for (size_t o = 0; o < n;) {
+            if (o + 12 > n || u32(o) != SKIPPABLE || u32(o + 4) != 4) return {};
+            size_t len = u32(o + 8);
+            if (o + 12 + len > n) return {};
+            v.emplace_back(o + 12, len);
+            o += 12 + len;
+        }
+        return v;
+    }
+
+    // Decompresses `jobs` frames at a time with zstd and feeds them to ts in order.
+    static bool zstd_parallel(const fs::path &archive, TarStream &ts, unsigned jobs, std::string &err, bool &used) {
+        used = false;
+        int fd = ::open(archive.c_str(), O_RDONLY | O_CLOEXEC);
+        struct stat s{};
+        if (fd < 0 || fstat(fd, &s) != 0 || s.st_size < 12) { if (fd >= 0) ::close(fd); return true; }
+        size_t size = (size_t)s.st_size;
+        void *m = mmap(nullptr, size, PROT_READ, MAP_PRIVATE, fd, 0);
+        ::close(fd);
+        if (m == MAP_FAILED) return true;
+        std::unique_ptr<void, std::function<void(void*)>> unmap(m, [size](void *p){ munmap(p, size); });
+        const char *base = (const char*)m;
+        auto frames = zstd_frames((const uint8_t*)base, size);
+        if (frames.size() < 2) return true;
+        used = true;
+        for (size_t w = 0; w < frames.size(); w += jobs) {
+            size_t k = std::min<size_t>(jobs, frames.size() - w);
+            std::vector<std::string> out(k);
+            std::atomic<bool> ok{true};
+            parallel_for(k, jobs, [&](size_t i){
+                auto [off, len] = frames[w + i];
+                if (!proc::filter({"zstd", "-dcq"}, base + off, len, out[i]).ok()) ok = false;
+            });
+            if (!ok) { err = "zstd failed on a frame of " + archive.filename().string(); return false; }
+            for (auto &o : out) ts.feed(o.data(), o.size());
+        }
+        return true;
+    }
+
+    static bool tar(const fs::path &archive, const fs::path &out, int strip, std::string &err, Stats &st) {
+        Tree tree(out, strip, st);
+        if (!tree.ok()) { err = "cannot create " + out.string(); return false; }
+        TarStream ts(tree, default_jobs());
+        proc::Argv cmd = decompressor(archive, st.tool);
+        std::string f = archive.filename().string();
+        if (cmd.empty() && f.size() > 4 && f.compare(f.size() - 4, 4, ".tar") != 0) {
+            err = "no decompressor for " + f;
+            ts.finish(err);
+            return false;
+        }
+        if (cmd.empty()) {
+            int fd = ::open(archive.c_str(), O_RDONLY | O_CLOEXEC);
+            if (fd < 0) { err = "cannot read " + archive.string(); ts.finish(err); return false; }
+            posix_fadvise(fd, 0, 0, POSIX_FADV_SEQUENTIAL);
+            std::vector<char> buf(1 << 20);
+            for (ssize_t n; (n = ::read(fd, buf.data(), buf.size())) > 0;) ts.feed(buf.data(), (size_t)n);
+            ::close(fd);
+            return ts.finish(err);
+        }
+        unsigned jobs = default_jobs();
+        if (st.tool == "zstd" && jobs > 1) {
+            bool used = false;
+            if (!zstd_parallel(archive, ts, jobs, err, used)) { std::string e2; ts.finish(e2); return false; }
+            if (used) { st.tool = "zstd x" + std::to_string(jobs); return ts.finish(err); }
+        }
+        proc::Opts o;
+        std::string msg;
+        o.out = [&](const char *d, size_t n){ ts.feed(d, n); };
+        o.err = [&](const char *d, size_t n){ if (msg.size() < 4096) msg.append(d, n); };
+        auto r = proc::run(cmd, o);
+        bool ok = ts.finish(err);
+        if (!r.ok()) { err = cmd[0] + " failed (" + proc::summary(r) + ")" + (msg.empty() ? "" : ": " + trim(msg)); return false; }
+        return ok;
+    }
+
+    static bool is_zip(const fs::path &archive) { return archive.filename().string().find(".zip") != std::string::npos; }
+
+    // Unpacks archive into out (created if needed), dropping `strip` leading path components.
+    static bool archive(const fs::path &archive, const fs::path &out, int strip, std::string &err, Stats &st) {
+        return is_zip(archive) ? zip(archive, out, strip, err, st) : tar(archive, out, strip, err, st);
+    }
+}
+
+// =============== Transcoded sources ===============
+// With --transcode, a verified .tar.{xz,gz,bz2} source is recompressed once
+// into .sbuild/cache/transcoded/<upstream sha256>.tar.zst and extracted from
+// there afterwards; zstd unpacks several times faster than xz, and the frames
+// (pzstd layout, CHUNK of tar each) decompress in parallel. The upstream
+// file stays in sources/ and keeps being verified as before.
+// index.txt: <upstream sha256> <sidecar sha256> <tar bytes> <upstream file name>
+namespace transcode {
+    static constexpr size_t CHUNK = 32u << 20;
+    static constexpr const char *LEVEL = "-6";
+
+    struct Entry { std::string sidecar_sha; uint64_t tar_bytes = 0; std::string name; };
+
+    static std::mutex mu;
+    static fs::path dir(const Paths &P) { return P.cache / "transcoded"; }
+    static fs::path sidecar(const Paths &P, const std::string &sha) { return dir(P) / (sha + ".tar.zst"); }
+
+    static std::map<std::string, Entry> load(const Paths &P) {
+        std::map<std::string, Entry> m;
+        std::ifstream in(dir(P) / "index.txt");
+        for (std::string line; std::getline(in, line);) {
+            std::istringstream iss(line);
+            std::string sha; Entry e;
+            if (!(iss >> sha >> e.sidecar_sha >> e.tar_bytes)) continue;
+            std::getline(iss >> std::ws, e.name);
+            m[sha] = e;
+        }
+        return m;
+    }
+
+    // Re-reads the index before writing, like hashcache::store. An empty Entry removes sha.
+    static void store(const Paths &P, const std::string &sha, const Entry &e) {
+        std::lock_guard<std::mutex> lk(mu);
+        auto m = load(P);
+        if (e.sidecar_sha.empty()) m.erase(sha); else m[sha] = e;
+        fs::path tmp = dir(P) / ("index.txt.tmp" + std::to_string(getpid()));
+        {
+            std::ofstream o(tmp);
+            for (auto &[k, x] : m) o << k << ' ' << x.sidecar_sha << ' ' << x.tar_bytes << ' ' << x.name << "\n";
+        }
+        std::error_code ec; fs::rename(tmp, dir(P) / "index.txt", ec);
+    }
+
+    static bool eligible(const fs::path &f) {
+        std::string n = f.filename().string();
+        for (auto ext : {".tar.xz", ".txz", ".tar.gz", ".tgz", ".tar.bz2", ".tbz2"})
+            if (n.find(ext) != std::string::npos) return true;
+        return false;
+    }
+
+    // The sidecar recorded for upstream sha, if it is still there and intact; else "".
+    static fs::path lookup(const Paths &P, const std::string &sha, bool paranoid) {
+        if (sha.empty()) return {};
+        Entry e;
+        {
+            std::lock_guard<std::mutex> lk(mu);
+            auto m = load(P);
+            auto it = m.find(sha);
+            if (it == m.end()) return {};
+            e = it->second;
+        }
+        fs::path f = sidecar(P, sha);
+        if (verified_sha256(P, f, paranoid) == e.sidecar_sha) return f;
+        term::warn("transcoded source " + f.filename().string() + " is missing or damaged; using the upstream archive");
+        store(P, sha, {});
+        return {};
+    }
+
+    // Writes the sidecar for src (already verified to hash to sha).
+    static bool make(const Paths &P, const fs::path &src, const std::string &sha, const std::string &log) {
+        std::string tool;
+        proc::Argv cmd = unpack::decompressor(src, tool);
+        if (cmd.empty()) return false;
+        std::error_code ec;
+        fs::create_directories(dir(P), ec);
+        fs::path out = sidecar(P, sha), tmp = out;
+        tmp += ".tmp" + std::to_string(getpid());
+        int fd = ::open(tmp.c_str(), O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0644);
+        if (fd < 0) return false;
 
-[hooks]
-postremove=
-postsync=
-)INI";
+        Spinner sp; sp.start("transcode " + src.filename().string());
+        auto t0 = std::chrono::steady_clock::now();
+        unsigned jobs = default_jobs();
+        std::vector<std::string> wave(1);
+        uint64_t tar_bytes = 0, written = 0;
+        bool ok = true;
+        // Compresses the queued chunks side by side, then appends them in order.
+        auto flush = [&]{
+            if (wave.back().empty()) wave.pop_back();
+            std::vector<std::string> frames(wave.size());
+            std::atomic<bool> good{true};
+            parallel_for(wave.size(), jobs, [&](size_t i){
+                if (!proc::filter({"zstd", "-cq", LEVEL}, wave[i].data(), wave[i].size(), frames[i]).ok()) good = false;
+            });
+            ok = ok && good;
+            for (auto &f : frames) {
+                uint32_t hdr[3] = {unpack::SKIPPABLE, 4, (uint32_t)f.size()};
+                ok = ok && ::write(fd, hdr, sizeof(hdr)) == (ssize_t)sizeof(hdr) && ::write(fd, f.data(), f.size()) == (ssize_t)f.size();
+                written += sizeof(hdr) + f.size();
+            }
+            wave.assign(1, {});
+        };
+        proc::Opts o;
+        std::string msg;
+        o.out = [&](const char *d, size_t n){
+            tar_bytes += n;
+            while (n) {
+                size_t k = std::min(n, CHUNK - wave.back().size());
+                wave.back().append(d, k);
+                d += k; n -= k;
+                if (wave.back().size() == CHUNK) {
+                    if (wave.size() == jobs) flush();
+                    else wave.emplace_back();
+                }
+            }
+        };
+        o.err = [&](const char *d, size_t n){ if (msg.size() < 4096) msg.append(d, n); };
+        auto r = proc::run(cmd, o);
+        flush();
+        ok = ok && r.ok() && fsync(fd) == 0;
+        ok = (::close(fd) == 0) && ok;
+        double secs = std::chrono::duration<double>(std::chrono::steady_clock::now() - t0).count();
+        {
+            proc::LogSink ls(log);
+            ls.line("# transcode " + src.filename().string() + ": " + proc::summary(r) + (msg.empty() ? "" : " " + trim(msg)));
+        }
+        if (!ok) {
+            fs::remove(tmp, ec);
+            sp.stop_fail("transcode " + src.filename().string() + " — failed, keeping the upstream archive only");
+            return false;
+        }
+        fs::rename(tmp, out, ec);
+        Entry e{verified_sha256(P, out, true), tar_bytes, src.filename().string()};
+        if (ec || e.sidecar_sha.empty()) { fs::remove(tmp, ec); sp.stop_fail("transcode — cannot store " + out.string()); return false; }
+        store(P, sha, e);
+        char buf[64]; std::snprintf(buf, sizeof(buf), " in %.1fs", secs);
+        sp.stop_ok("transcode " + src.filename().string() + " — " + human_size((double)fs::file_size(src)) + " " + tool + " -> " +
+                   human_size((double)written) + " zstd (" + human_size((double)tar_bytes) + " tar)" + buf);
+        return true;
+    }
 }
 
-// =============== Registry and manifests ===============
-static fs::path pkg_id_dir(const Paths &P, const Recipe &r) {
-    return P.registry / (r.name + "-" + r.version);
-}
-static fs::path pkg_manifest(const Paths &P, const Recipe &r) {
-    return pkg_id_dir(P,r)/"manifest.txt";
+// =============== Core operations ===============
+// Where stream_source leaves a tree extracted during the download, and the
+// sha256 it belongs to (written only once the download hashed correctly).
+static fs::path stream_dir(const Paths &P, const Recipe &r) { return P.work / ("." + r.name + "-" + r.version + ".stream"); }
+static fs::path stream_mark(const Paths &P, const Recipe &r) { fs::path m = stream_dir(P, r); m += ".sha256"; return m; }
+
+// Drops a streamed tree nobody is going to use (build or pristine cache hit).
+static void discard_stream(const Paths &P, const Recipe &r) {
+    std::error_code ec;
+    if (fs::remove(stream_mark(P, r), ec) || fs::exists(stream_dir(P, r), ec)) walk::remove_tree(stream_dir(P, r));
 }
-static fs::path pkg_meta(const Paths &P, const Recipe &r) {
-    return pkg_id_dir(P,r)/"meta.ini";
+
+static bool streamable(const fs::path &f) {
+    std::string tool;
+    std::string n = f.filename().string();
+    return !unpack::is_zip(f) && (!unpack::decompressor(f, tool).empty() || (n.size() > 4 && n.compare(n.size() - 4, 4, ".tar") == 0));
 }
 
-static void save_meta(const Paths &P, const Recipe &r) {
-    fs::create_directories(pkg_id_dir(P,r));
-    std::ofstream m(pkg_meta(P,r));
-    m << "name=" << r.name << "\n";
-    m << "version=" << r.version << "\n";
-    m << "time=" << ts_now() << "\n";
+// Download, sha256 and extraction in one pass: the bytes download:: writes to
+// <srcfile>.part are hashed and piped through the decompressor into the tar
+// parser as they land, which unpacks into stream_dir(). The archive moves
+// into sources/ and the tree is marked for extract_source only if the hash
+// matches the recipe; otherwise both are thrown away. An extraction failure
+// alone just leaves nothing to hand over (extract_source then unpacks as usual).
+static bool stream_source(const Paths &P, const Recipe &r, const std::vector<std::string> &urls, const fs::path &srcfile, const std::string &log) {
+    const std::string &url = urls[0];
+    fs::path prov = stream_dir(P, r), mark = stream_mark(P, r);
+    std::error_code ec;
+    fs::remove(mark, ec);
+    walk::remove_tree(prov);
+
+    Spinner sp; sp.start("download+extract");
+    unpack::Stats st;
+    download::Stats ds;
+    std::string why, dmsg, err, got;
+    bool extracted = false, ok = false;
+    sha256::Hasher hasher;
+    {
+        unpack::Tree tree(prov, 1, st);
+        unpack::TarStream ts(tree, default_jobs());
+        proc::Argv dcmd = unpack::decompressor(srcfile, st.tool, true);
+        int pfd[2] = {-1, -1};
+        bool piping = !dcmd.empty() && pipe2(pfd, O_CLOEXEC) == 0;
+        proc::Result dres;
+        std::thread dec;
+        if (piping) dec = std::thread([&]{
+            proc::Opts o;
+            o.in = pfd[0];
+            o.out = [&](const char *d, size_t n){ ts.feed(d, n); };
+            o.err = [&](const char *d, size_t n){ if (dmsg.size() < 4096) dmsg.append(d, n); };
+            dres = proc::run(dcmd, o);
+            ::close(pfd[0]);
+        });
+        // Bytes in file order (a resumed .part is replayed first), so hashing and unpacking start right away.
+        download::Opts o;
+        o.mirrors.assign(urls.begin() + 1, urls.end());
+        o.tee = [&](const char *d, size_t n){
+            hasher.update(d, n);
+            if (!piping) { if (dcmd.empty()) ts.feed(d, n); return; }
+            for (size_t done = 0; done < n;) {
+                ssize_t w = ::write(pfd[1], d + done, n - done);
+                if (w < 0 && errno == EINTR) continue;
+                if (w <= 0) break;          // decompressor gave up; keep downloading
+                done += (size_t)w;
+            }
+        };
+        o.commit = [&]{
+            got = hasher.hex();
+            if (r.checksum.empty() || got == r.checksum) return true;
+            err = "sha256 mismatch: got=" + got + " expected=" + r.checksum;
+            return false;
+        };
+        ok = download::fetch(url, srcfile, o, ds, err);
+        if (piping) { ::close(pfd[1]); dec.join(); }
+        extracted = ts.finish(why) && (!piping || dres.ok());
+        if (!piping && !dcmd.empty()) { extracted = false; why = "cannot start " + dcmd[0]; }
+        else if (piping && !dres.ok()) why = dcmd[0] + " failed (" + proc::summary(dres) + ")" + (dmsg.empty() ? "" : ": " + trim(dmsg));
+    }
+    proc::LogSink ls(log);
+    ls.line("# download+extract " + url + ": " + (ok ? ds.summary() : err));
+    // The stamp cache only gets a hash read back from the finished file; the
+    // tee's must agree with it, or the tree was unpacked from other bytes.
+    std::string disk = ok ? verified_sha256(P, srcfile, true) : "";
+    if (ok && disk != got) {
+        err = "downloaded file does not match the bytes streamed (" + got + " vs " + disk + ")";
+        fs::remove(srcfile, ec);
+        ok = false;
+    }
+    if (!ok) {
+        sp.stop_fail("download — " + err);
+        walk::remove_tree(prov);
+        return false;
+    }
+    if (extracted) {
+        std::ofstream(mark) << got << "\n";
+        ls.line("# download+extract: " + st.summary());
+        sp.stop_ok("download+extract — " + ds.summary() + "; " + st.summary());
+    } else {
+        walk::remove_tree(prov);
+        ls.line("# download+extract: extraction failed (" + why + "); extract will unpack the archive");
+        sp.stop_ok("download — " + ds.summary());
+    }
+    return true;
 }
 
-static void save_manifest_from_destdir(const Paths &P, const Recipe &r, const fs::path &staging) {
-    std::ofstream mf(pkg_manifest(P,r));
-    for (auto &p : fs::recursive_directory_iterator(staging)) {
-        if (fs::is_regular_file(p.path())) {
-            auto rel = fs::relative(p.path(), staging);
-            mf << "/" << rel.generic_string() << "\n";
-        }
+// Checks the source against the recipe's sha256 (stamp cache first) and keeps a transcoded copy if asked.
+static bool verify_source(const Paths &P, const Options &O, const Recipe &r, const fs::path &srcfile, const std::string &log) {
+    if (!r.checksum.empty()) {
+        bool cached = false;
+        auto got = verified_sha256(P, srcfile, O.paranoid, &cached);
+        if (got.empty() || got != r.checksum) {
+            term::err("sha256 mismatch: got=" + got + " expected=" + r.checksum);
+            return false;
+        } else term::ok("sha256 verified" + std::string(cached ? " (cached stamp)" : "") + ": " + got);
+        if (store::put(P, got, srcfile)) proc::LogSink(log).line("# store: added " + srcfile.filename().string() + " as " + got);
+        if (O.transcode && transcode::eligible(srcfile) && transcode::lookup(P, got, O.paranoid).empty())
+            transcode::make(P, srcfile, got, log);
     }
+    return true;
 }
 
-// =============== Core operations ===============
-static bool fetch_source(const Paths &P, Recipe &r, fs::path &out_srcfile, fs::path &out_srcdir, const std::string &log) {
+// sources/<last URL component>: where the recipe's tarball is kept.
+static fs::path source_file(const Paths &P, const Recipe &r) {
+    auto pos = r.source_url.find_last_of('/');
+    return P.sources / (pos==std::string::npos ? r.source_url : r.source_url.substr(pos+1));
+}
+
+static bool fetch_source(const Paths &P, const Options &O, Recipe &r, fs::path &out_srcfile, fs::path &out_srcdir, const std::string &log) {
     ensure_dirs(P);
     if (!r.git_url.empty()) {
-        // Clone into sources/name-version
-        out_srcdir = P.sources / (r.name + "-" + r.version);
-        if (fs::exists(out_srcdir)) {
-            term::info("Git source exists, pulling: " + out_srcdir.string());
-            return run_cmd_checked("git -C '"+out_srcdir.string()+"' pull --rebase", "git pull", log);
-        }
-        return run_cmd_checked("git clone '"+r.git_url+"' '"+out_srcdir.string()+"'", "git clone", log);
+        // Bare mirror in .sbuild/cache/git; extract_source exports the commit into work/.
+        out_srcdir = gitmirror::dir(P, r.git_url);
+        std::string pin = !r.git_commit.empty() ? r.git_commit : r.git_tag, commit, err;
+        bool fetched = false;
+        Spinner sp; sp.start("git fetch");
+        if (!gitmirror::sync(P, r.git_url, r.git_commit, r.git_tag, commit, err, log, &fetched)) { sp.stop_fail("git fetch — " + err); return false; }
+        if (fetched) sp.stop_ok("git fetch — " + r.git_url + " at " + commit.substr(0, 12));
+        else sp.stop_ok("git mirror already has " + (pin.empty() ? "remote HEAD" : pin) + " (" + commit.substr(0, 12) + "), no fetch");
+        r.git_commit = commit;
+        return true;
     }
     if (r.source_url.empty()) { term::err("No source= or git= defined in recipe"); return false; }
     // Download tarball to sources/
-    std::string fname = r.name + "-" + r.version;
-    std::string ext;
-    // Try to guess extension from URL
-    auto url = r.source_url;
-    auto pos = url.find_last_of('/'); std::string tail = pos==std::string::npos ? url : url.substr(pos+1);
-    ext = tail; // full filename
-    out_srcfile = P.sources / ext;
+    out_srcfile = source_file(P, r);
     if (fs::exists(out_srcfile)) {
         term::info("Source exists: " + out_srcfile.string());
-    } else {
-        std::string cmd = "curl -L --fail -o '"+out_srcfile.string()+"' '"+url+"'";
-        if (!run_cmd_checked(cmd, "download", log)) return false;
+        return verify_source(P, O, r, out_srcfile, log);
     }
-    if (!r.checksum.empty()) {
-        auto got = sha256_file(out_srcfile);
-        if (got.empty() || got != r.checksum) {
-            term::err("sha256 mismatch: got=" + got + " expected=" + r.checksum);
-            return false;
-        } else term::ok("sha256 verified: " + got);
+    // Fetched before, by this root or another one: no network at all.
+    std::string how;
+    if (store::take(P, r.checksum, out_srcfile, &how)) {
+        std::error_code ec;
+        fs::remove(download::part_of(out_srcfile), ec);
+        fs::remove(download::state_of(out_srcfile), ec);
+        term::ok("source from store (" + how + "): " + out_srcfile.string());
+        proc::LogSink(log).line("# store: " + how + " " + out_srcfile.string() + " from " + store::object(store::root(P), r.checksum).string());
+        return verify_source(P, O, r, out_srcfile, log);
     }
-    return true;
+    // With mirrors, start on the fastest one (download:: fails over to the others).
+    auto urls = mirrors::candidates(P, r);
+    if (urls.size() > 1) {
+        std::string report;
+        urls = mirrors::rank(P, urls, &report);
+        term::info("mirrors: " + report);
+        proc::LogSink(log).line("# mirrors: " + report);
+    }
+    auto url = urls[0];
+    if (O.stream && streamable(out_srcfile)) {
+        if (!stream_source(P, r, urls, out_srcfile, log)) return false;
+    } else {
+        Spinner sp; sp.start("download");
+        download::Opts o;
+        download::Stats ds;
+        std::string err;
+        o.mirrors.assign(urls.begin() + 1, urls.end());
+        bool ok = download::fetch(url, out_srcfile, o, ds, err);
+        proc::LogSink(log).line("# download " + url + ": " + (ok ? ds.summary() : err));
+        if (!ok) { sp.stop_fail("download — " + err); return false; }
+        sp.stop_ok("download — " + ds.summary());
+    }
+    return verify_source(P, O, r, out_srcfile, log);
 }
 
 static bool extract_source(const Paths &P, const Recipe &r, const fs::path &srcfile, fs::path &out_dir, const std::string &log) {
     if (!srcfile.empty()) {
+        // A transcoded sidecar of the same (verified) upstream archive unpacks faster.
+        fs::path from = srcfile;
+        if (auto sc = transcode::lookup(P, r.checksum, false); !sc.empty()) from = sc;
         // Determine extractor based on extension
-        std::string f = srcfile.filename().string();
+        std::string f = from.filename().string();
         out_dir = P.work / (r.name + "-" + r.version);
-        fs::remove_all(out_dir);
+        walk::remove_tree(out_dir);
+
+        // Already unpacked while downloading, and the download is still the file we have.
+        fs::path prov = stream_dir(P, r), mark = stream_mark(P, r);
+        std::string streamed;
+        std::ifstream(mark) >> streamed;
+        std::error_code ec;
+        fs::remove(mark, ec);
+        if (!streamed.empty() && fs::is_directory(prov) && hashcache::lookup(P, srcfile) == streamed) {
+            fs::rename(prov, out_dir, ec);
+            if (!ec) { term::ok("extract — unpacked during download"); return true; }
+        }
+        walk::remove_tree(prov);
         fs::create_directories(out_dir);
-        std::string cmd;
-        if (f.find(".tar.zst")!=std::string::npos) cmd = "tar --zstd -xf '"+srcfile.string()+"' -C '"+out_dir.string()+"' --strip-components=1";
-        else if (f.find(".tar.xz")!=std::string::npos) cmd = "tar -xJf '"+srcfile.string()+"' -C '"+out_dir.string()+"' --strip-components=1";
-        else if (f.find(".tar.bz2")!=std::string::npos) cmd = "tar -xjf '"+srcfile.string()+"' -C '"+out_dir.string()+"' --strip-components=1";
-        else if (f.find(".tar.gz")!=std::string::npos || f.find(".tgz")!=std::string::npos) cmd = "tar -xzf '"+srcfile.string()+"' -C '"+out_dir.string()+"' --strip-components=1";
-        else if (f.find(".zip")!=std::string::npos) cmd = "unzip -q '"+srcfile.string()+"' -d '"+out_dir.string()+"' && sh -c 'cd ""'"; // unzip keeps top dir; tolerate
+        proc::Argv cmd;
+        auto tar = [&](const std::string &flag){ return proc::Argv{"tar", flag, from.string(), "-C", out_dir.string(), "--strip-components=1"}; };
+        if (f.find(".tar.zst")!=std::string::npos) { cmd = tar("-xf"); cmd.insert(cmd.begin()+1, "--zstd"); }
+        else if (f.find(".tar.xz")!=std::string::npos) cmd = tar("-xJf");
+        else if (f.find(".tar.bz2")!=std::string::npos) cmd = tar("-xjf");
+        else if (f.find(".tar.gz")!=std::string::npos || f.find(".tgz")!=std::string::npos) cmd = tar("-xzf");
+        else if (f.size() > 4 && f.compare(f.size() - 4, 4, ".tar") == 0) cmd = tar("-xf");
+        else if (f.find(".zip")!=std::string::npos) cmd = {"unzip", "-q", from.string(), "-d", out_dir.string()}; // fallback keeps the top dir
         else { term::err("Unknown archive type: " + f); return false; }
-        return run_cmd_checked(cmd, "extract", log);
+
+        // Native first; tar/unzip only if it gives up on this archive.
+        Spinner sp; sp.start("extract");
+        unpack::Stats st;
+        std::string why;
+        auto t0 = std::chrono::steady_clock::now();
+        bool ok = unpack::archive(from, out_dir, 1, why, st);
+        if (from != srcfile) st.tool += " (transcoded)";
+        double secs = std::chrono::duration<double>(std::chrono::steady_clock::now() - t0).count();
+        {
+            proc::LogSink ls(log);
+            char buf[64]; std::snprintf(buf, sizeof(buf), " in %.2fs", secs);
+            ls.line("# extract: " + (ok ? st.summary() + buf : "native extraction failed: " + why + "; retrying with " + cmd[0]));
+        }
+        if (ok) { sp.stop_ok("extract — " + st.summary()); return true; }
+        sp.stop_fail("extract — " + why + ", falling back to " + cmd[0]);
+        walk::remove_tree(out_dir);
+        fs::create_directories(out_dir);
+        return run_checked(cmd, "extract", log);
     } else {
-        // git checkout is already a directory
-        out_dir = P.sources / (r.name + "-" + r.version);
-        if (!fs::exists(out_dir)) { term::err("Git source dir not found: "+out_dir.string()); return false; }
-        term::ok("Using git source at " + out_dir.string());
+        // git archive of the commit fetch_source resolved, read by the native tar reader; the mirror stays bare.
+        out_dir = P.work / (r.name + "-" + r.version);
+        walk::remove_tree(out_dir);
+        Spinner sp; sp.start("export");
+        unpack::Stats st;
+        std::string why, msg;
+        bool ok;
+        {
+            unpack::Tree tree(out_dir, 0, st);
+            unpack::TarStream ts(tree, default_jobs());
+            proc::Opts o;
+            o.out = [&](const char *d, size_t n){ ts.feed(d, n); };
+            o.err = [&](const char *d, size_t n){ if (msg.size() < 4096) msg.append(d, n); };
+            auto res = proc::run({"git", "-C", gitmirror::dir(P, r.git_url).string(), "archive", "--format=tar", r.git_commit}, o);
+            ok = ts.finish(why) && res.ok();
+            if (!res.ok()) why = "git archive failed (" + proc::summary(res) + ")" + (msg.empty() ? "" : ": " + trim(msg));
+        }
+        st.tool = "git archive";
+        proc::LogSink(log).line("# export " + r.git_commit + ": " + (ok ? st.summary() : why));
+        if (!ok) { sp.stop_fail("export — " + why); return false; }
+        sp.stop_ok("export " + r.git_commit.substr(0, 12) + " — " + st.summary());
         return true;
     }
 }
 
-static bool acquire_patch(const Paths &P, const std::string &p, fs::path &out, const std::string &log) {
-    if (p.rfind("git+",0)==0) {
-        std::string url = p.substr(4);
-        fs::path d = P.cache / ("patch-" + std::to_string(std::hash<std::string>{}(p)));
-        if (fs::exists(d)) {
-            return run_cmd_checked("git -C '"+d.string()+"' pull --rebase", "patch git pull", log);
-        } else {
-            fs::create_directories(P.cache);
-            return run_cmd_checked("git clone '"+url+"' '"+d.string()+"'", "patch git clone", log) && (out=d/".git");
-        }
-    } else if (p.rfind("http://",0)==0 || p.rfind("https://",0)==0) {
-        fs::path f = P.cache / ("patch-" + std::to_string(std::hash<std::string>{}(p)) + ".patch");
-        if (!fs::exists(f)) {
-            if (!run_cmd_checked("curl -L --fail -o '"+f.string()+"' '"+p+"'", "download patch", log)) return false;
-        }
-        out = f; return true;
-    } else if (p.rfind("file://",0)==0) {
-        out = fs::path(p.substr(7)); return fs::exists(out);
-    } else { // assume local path
-        out = fs::path(p); return fs::exists(out);
+// Acquires one patch into `out`: http(s) through the patch store, git+ repos
+// as their *.patch files, file:// and plain paths as they are (checked
+// against the recipe's sha256= when there is one). *how says where it came from.
+static bool acquire_patch(const Paths &P, const Options &O, const Recipe &r, const std::string &p, std::vector<fs::path> &out,
+                          std::string &how, std::string &err, const std::string &log) {
+    auto pin = r.patch_sha256.find(p);
+    std::string want = pin != r.patch_sha256.end() ? pin->second : "";
+    if (p.rfind("git+",0)==0) return patchstore::git(P, p.substr(4), out, how, err, log);
+    if (p.rfind("http://",0)==0 || p.rfind("https://",0)==0) {
+        fs::path f;
+        if (!patchstore::fetch(P, p, want, f, how, err, log)) return false;
+        out.push_back(f);
+        return true;
     }
+    fs::path f = p.rfind("file://",0)==0 ? fs::path(p.substr(7)) : fs::path(p);
+    if (!fs::exists(f)) { err = "not found"; return false; }
+    if (!want.empty()) {
+        auto got = verified_sha256(P, f, O.paranoid);
+        if (got != want) { err = "sha256 mismatch: got=" + got + " expected=" + want; return false; }
+    }
+    how = "local";
+    out.push_back(f);
+    return true;
 }
 
-static bool apply_patches(const Paths &P, const Recipe &r, const fs::path &srcdir, const std::string &log) {
+// Acquires every patch of the recipe and lists the patch files in the order
+// they apply (a git patch repo contributes its *.patch files). Prints
+// nothing, so it can run while fetch_source downloads: `report` gets
+// "2 cached, 1 downloaded" and `err` the patch that failed.
+static bool patch_files(const Paths &P, const Options &O, const Recipe &r, std::vector<fs::path> &out, const std::string &log,
+                        std::string &report, std::string &err) {
+    std::map<std::string, int> hows;
     for (auto &p : r.patches) {
-        fs::path got;
-        if (!acquire_patch(P, p, got, log)) { term::err("Failed to acquire patch: " + p); return false; }
-        std::string cmd;
-        if (fs::is_directory(got)) {
-            cmd = "sh -c 'cd '"+srcdir.string()+"' && for f in $(git -C '"+got.string()+"' ls-files \"*.patch\"); do patch -p1 < \""+ (got/"$f").string() + "\"; done'";
-        } else {
-            cmd = "sh -c 'cd '"+srcdir.string()+"' && patch -p1 < '"+got.string()+"''";
+        std::string how, why;
+        if (!acquire_patch(P, O, r, p, out, how, why, log)) {
+            err = p + " — " + why;
+            proc::LogSink(log).line("# patch " + p + ": " + why);
+            return false;
         }
-        if (!run_cmd_checked(cmd, "apply patch", log)) return false;
+        hows[how.substr(0, how.find(' '))]++;
     }
+    report.clear();
+    for (auto &[how, n] : hows) report += (report.empty() ? "" : ", ") + std::to_string(n) + " " + how;
+    return true;
+}
+
+// fetch_source and patch_files side by side: the patches are acquired on a
+// thread of their own while the source downloads. 0, or the exit code of
+// the step that failed (2 source, 4 patches).
+static int fetch_inputs(const Paths &P, const Options &O, Recipe &r, fs::path &srcfile, fs::path &srcdir, std::vector<fs::path> &patches,
+                        const std::string &log) {
+    bool patched = false;
+    std::string report, err;
+    std::thread t([&]{ patched = patch_files(P, O, r, patches, log, report, err); });
+    bool fetched = fetch_source(P, O, r, srcfile, srcdir, log);
+    t.join();
+    if (!patched) term::err("Failed to acquire patch " + err);
+    else if (!r.patches.empty()) term::ok("patches — " + std::to_string(patches.size()) + " files (" + report + ")");
+    return !fetched ? 2 : !patched ? 4 : 0;
+}
+
+static bool apply_patches(const std::vector<fs::path> &patches, const fs::path &srcdir, const std::string &log) {
+    proc::Opts in_src; in_src.cwd = srcdir;
+    for (auto &p : patches)
+        if (!run_checked({"patch", "-p1", "-i", p.string()}, "apply patch " + p.filename().string(), log, in_src)) return false;
     return true;
 }
 
-static bool run_phase(const std::string &phase, const std::string &cmd, const fs::path &cwd, const fs::path &destdir, const Recipe &r, const std::string &log) {
+// Environment added for every phase; the job counts come last (build_key
+// leaves them out: they change the speed of a build, not its result).
+static std::vector<std::string> phase_env(const fs::path &destdir) {
+    std::string jobs = std::to_string(std::thread::hardware_concurrency());
+    return {"DESTDIR=" + destdir.string(), "PREFIX=/usr", "JOBS=" + jobs, "MAKEFLAGS=-j" + jobs};
+}
+
+static bool run_phase(const std::string &phase, const std::string &cmd, const fs::path &cwd, const fs::path &destdir, const Recipe &r, const std::string &log, bool fakeroot=false) {
     if (cmd.empty()) { term::info("skip " + phase); return true; }
-    std::ostringstream oss;
-    oss << "sh -c '";
-    oss << "set -e; cd '" << cwd.string() << "'; ";
-    oss << "export DESTDIR='"<<destdir.string()<<"'; ";
-    oss << "export PREFIX='/usr'; ";
-    oss << "export JOBS='"<< std::thread::hardware_concurrency() <<"'; ";
-    oss << "export MAKEFLAGS='-j'\"$JOBS\"'; ";
-    oss << cmd;
-    oss << "'";
-    return run_cmd_checked(oss.str(), phase, log);
+    proc::Opts o;
+    o.cwd = cwd;
+    o.env = phase_env(destdir);
+    proc::Argv argv = proc::sh("set -e; " + cmd);
+    if (fakeroot) argv.insert(argv.begin(), "fakeroot");
+    return run_checked(argv, phase, log, o);
+}
+
+// gcc/ld identity plus the compiler-related variables inherited from the caller.
+static std::string toolchain_fingerprint() {
+    static const std::string fp = []{
+        auto first_line = [](const proc::Argv &argv){
+            int ec = 0;
+            std::string out = find_program(argv[0]).empty() ? std::string() : proc::capture(argv, &ec);
+            return ec != 0 || out.empty() ? std::string("none") : trim(out.substr(0, out.find('\n')));
+        };
+        std::string s = "gcc " + first_line({"gcc", "--version"}) + "\n" +
+                        "target " + first_line({"gcc", "-dumpmachine"}) + "\n" +
+                        "ld " + first_line({"ld", "--version"}) + "\n";
+        for (const char *v : {"CC", "CXX", "CFLAGS", "CXXFLAGS", "CPPFLAGS", "LDFLAGS"})
+            if (const char *val = std::getenv(v)) s += std::string(v) + "=" + val + "\n";
+        return s;
+    }();
+    return fp;
+}
+
+// "source-sha256=<sum>" or "source-git=<commit>" (as resolved by fetch_source); "" when it cannot be determined.
+static std::string source_identity(const Paths &P, const Options &O, const Recipe &r, const fs::path &srcfile, const fs::path &) {
+    if (!srcfile.empty()) {
+        std::string sum = r.checksum.empty() ? verified_sha256(P, srcfile, O.paranoid) : r.checksum;
+        return sum.empty() ? std::string() : "source-sha256=" + sum;
+    }
+    return r.git_commit.size() >= 40 ? "source-git=" + r.git_commit : std::string();
+}
+
+// "patch-sha256=<sum>" lines in apply order; "" when a patch cannot be read.
+static std::string patches_identity(const std::vector<fs::path> &patches) {
+    std::string out;
+    auto sums = sha256::files(patches, 0);
+    for (auto &s : sums) {
+        if (s.empty()) return "-";
+        out += "patch-sha256=" + s + "\n";
+    }
+    return out;
+}
+
+// Phase environment minus the job counts, plus the toolchain fingerprint.
+static std::string build_env_identity(const fs::path &staging) {
+    std::string out = toolchain_fingerprint();
+    auto env = phase_env(staging);
+    for (size_t i = 0; i + 2 < env.size(); ++i) out += env[i] + "\n";
+    return out;
+}
+
+// Build cache key: sha256 over the parsed recipe, the source checksum (or git
+// HEAD), the contents of every patch, the toolchain fingerprint, the phase
+// environment and the strip/debuginfo choice. "" when an input cannot be
+// pinned down, which disables the cache for this build.
+static std::string build_key(const Paths &P, const Options &O, const Recipe &r, const fs::path &srcfile, const fs::path &srcdir,
+                             const std::vector<fs::path> &patches, const fs::path &staging, bool strip, bool split) {
+    std::ostringstream k;
+    k << "name=" << r.name << "\nversion=" << r.version << "\nsource=" << r.source_url << "\ngit=" << r.git_url
+      << "\nstrip=" << strip << "\ndebuginfo=" << split << "\nfakeroot=" << r.opt_fakeroot
+      << "\npreconfig=" << r.preconfig << "\nconfig=" << r.config << "\nbuild=" << r.build
+      << "\ninstall=" << r.install << "\npostinstall=" << r.postinstall << "\n";
+    for (auto &p : r.patches) k << "patch=" << p << "\n";
+    std::string src = source_identity(P, O, r, srcfile, srcdir), pat = patches_identity(patches);
+    if (src.empty() || pat == "-") return {};
+    k << src << "\n" << pat << build_env_identity(staging);
+    return sha256::bytes(k.str());
+}
+
+// Expected stamp of every phase in stamps::NAMES order. Each one hashes the
+// previous stamp with that phase's own input: the source for fetch, the
+// archive name for extract, the patch contents, each phase's command (the
+// first build phase also the toolchain and environment), and the
+// strip/debuginfo choice.
+static std::vector<std::string> phase_stamps(const Paths &P, const Options &O, const Recipe &r, const fs::path &srcfile, const fs::path &srcdir,
+                                             const std::vector<fs::path> &patches, const fs::path &staging, bool strip, bool split) {
+    std::string install = r.install.empty() ? "make DESTDIR=\"$DESTDIR\" install" : r.install;
+    std::string src = source_identity(P, O, r, srcfile, srcdir);
+    std::string inputs[stamps::COUNT] = {
+        r.source_url + "\n" + r.git_url + "\n" + (src.empty() ? "unpinned " + ts_now() : src),
+        srcfile.filename().string(),
+        patches_identity(patches),
+        build_env_identity(staging) + r.preconfig,
+        r.config,
+        r.build,
+        install + (r.opt_fakeroot ? "\nfakeroot" : ""),
+        r.postinstall,
+        std::string(strip ? "strip" : "nostrip") + (split ? "+debuginfo" : ""),
+    };
+    std::vector<std::string> out;
+    std::string prev;
+    for (int i = 0; i < stamps::COUNT; ++i) {
+        prev = sha256::bytes(std::string(stamps::NAMES[i]) + "\n" + prev + "\n" + inputs[i]);
+        out.push_back(prev);
+    }
+    return out;
+}
+
+// Extracted (or git-exported) and patched source tree in workdir: cloned
+// from the pristine cache when possible, otherwise extracted, patched and
+// then stored there.
+static bool prepare_tree(const Paths &P, const Options &O, const Recipe &r, const fs::path &srcfile, const fs::path &srcdir,
+                         const std::vector<fs::path> &patches, fs::path &workdir, const std::string &log) {
+    std::string src = source_identity(P, O, r, srcfile, srcdir);
+    std::string pat = patches_identity(patches);
+    std::string key = src.empty() || pat == "-" ? std::string() : sha256::bytes(src + "\n" + pat);
+    if (!key.empty() && pristine::valid(P, key)) {
+        workdir = P.work / (r.name + "-" + r.version);
+        treecopy::Stats st;
+        auto t0 = std::chrono::steady_clock::now();
+        if (pristine::clone(P, key, workdir, st)) {
+            char secs[32];
+            std::snprintf(secs, sizeof(secs), "%.2fs", std::chrono::duration<double>(std::chrono::steady_clock::now() - t0).count());
+            term::ok("extract+patch — pristine tree " + key.substr(0, 16) + " cloned in " + secs + " (" + st.summary() + ")");
+            discard_stream(P, r);
+            return true;
+        }
+    }
+    if (!extract_source(P,r,srcfile,workdir,log)) return false;
+    if (!apply_patches(patches,workdir,log)) return false;
+    if (!key.empty() && !pristine::store(P, key, workdir)) term::warn("pristine tree cache: could not store " + key.substr(0, 16));
+    return true;
+}
+
+static std::vector<fs::path> list_regular_files(const fs::path &dir) {
+    std::vector<fs::path> files;
+    for (auto &e : walk::tree(dir, {false, 0})) if (e.type == DT_REG) files.push_back(dir / e.rel);
+    return files;
+}
+
+// Regular (non-symlink) ELF files under dir; classification runs on the work pool.
+static std::vector<fs::path> find_elf_files(const fs::path &dir, bool only_unstripped) {
+    auto files = list_regular_files(dir);
+    std::vector<char> keep(files.size(), 0);
+    parallel_for(files.size(), 0, [&](size_t i){
+        auto e = elf::classify(files[i]);
+        keep[i] = e.is_elf && !(only_unstripped && e.stripped());
+    });
+    std::vector<fs::path> out;
+    for (size_t i = 0; i < files.size(); ++i) if (keep[i]) out.push_back(std::move(files[i]));
+    return out;
+}
+
+// Executables lose everything the loader does not need, shared libraries keep
+// the symbols other objects link against, and relocatable objects (.o, .ko)
+// only lose debug info so they can still be linked.
+static std::string strip_flag(const elf::Info &in, const elf::Dynamic &dy, const fs::path &f) {
+    if (in.type == ET_REL) return "--strip-debug";
+    if (in.type == ET_DYN && (!dy.has_interp || sonames::looks_like_soname(f.filename().string()))) return "--strip-unneeded";
+    return "--strip-all";
+}
+
+// Where the detached debug info of an object goes: the build-id tree when the
+// object has one (what gdb/elfutils look up), else a path mirroring the file.
+static fs::path debug_file_for(const fs::path &dbgroot, const std::string &installed, const std::string &build_id) {
+    fs::path d = dbgroot / "usr/lib/debug";
+    if (build_id.size() > 2) return d / ".build-id" / build_id.substr(0, 2) / (build_id.substr(2) + ".debug");
+    return d / (fs::path(installed).relative_path().string() + ".debug");
 }
 
-static bool maybe_strip(const fs::path &destdir, const std::string &log) {
-    std::string cmd = "sh -c 'set -e; if command -v strip >/dev/null 2>&1; then find '"+destdir.string()+"' -type f -exec sh -c \"file -b \"'{}'\" | grep -q 'ELF' && strip -s \"'{}'\" || true\" \"\\;\" ; fi'";
-    return run_cmd_checked(cmd, "strip", log);
+// Strips every unstripped ELF object under destdir. Files are classified on
+// the work pool, grouped by flag and handed to strip (objcopy if strip is
+// missing) in small batches spread over SB_JOBS workers. With a dbgroot,
+// executables and shared libraries first have their debug info copied
+// (compressed) under dbgroot/usr/lib/debug and get a .gnu_debuglink back.
+static bool maybe_strip(const fs::path &destdir, const std::string &log, const fs::path &dbgroot = {}) {
+    std::string tool = find_program("strip");
+    std::string objcopy = find_program("objcopy");
+    if (tool.empty()) tool = objcopy;
+    if (tool.empty()) { term::warn("strip: neither strip nor objcopy found, skipping"); return true; }
+    bool split = !dbgroot.empty();
+    if (split && objcopy.empty()) { term::warn("strip: objcopy not found, debug info will not be kept"); split = false; }
+    std::string zflag;
+    if (split) {
+        bool zstd = proc::capture({objcopy, "--help"}).find("zstd") != std::string::npos;
+        zflag = std::string("--compress-debug-sections=") + (zstd ? "zstd" : "zlib");
+    }
+    Spinner sp; sp.start(split ? "strip + debuginfo" : "strip");
+
+    auto files = list_regular_files(destdir);
+    std::vector<std::string> flag(files.size()), build_id(files.size());
+    std::vector<char> detach(files.size(), 0);
+    parallel_for(files.size(), 0, [&](size_t i){
+        int fd = open(files[i].c_str(), O_RDONLY | O_CLOEXEC | O_NOFOLLOW);
+        if (fd < 0) return;
+        auto in = elf::classify_fd(fd);
+        if (in.is_elf && !in.stripped()) {
+            auto dy = elf::dynamic_fd(fd, in);
+            flag[i] = strip_flag(in, dy, files[i]);
+            if (split && (in.type == ET_EXEC || in.type == ET_DYN)) { detach[i] = 1; build_id[i] = elf::build_id(fd, in); }
+        }
+        close(fd);
+    });
+    std::map<std::string, std::vector<size_t>> by_flag;
+    std::vector<size_t> singles;    // files that go through keep-debug/strip/debuglink one by one
+    for (size_t i = 0; i < files.size(); ++i) {
+        if (flag[i].empty()) continue;
+        if (detach[i]) singles.push_back(i); else by_flag[flag[i]].push_back(i);
+    }
+
+    // strip takes a list of files; objcopy (the fallback) one input and an optional output per call.
+    const size_t batch_size = tool == objcopy ? 1 : 16;
+    std::vector<std::pair<std::string, std::vector<size_t>>> batches;
+    for (auto &[f, idx] : by_flag)
+        for (size_t b = 0; b < idx.size(); b += batch_size)
+            batches.emplace_back(f, std::vector<size_t>(idx.begin() + b, idx.begin() + std::min(idx.size(), b + batch_size)));
+
+    auto size_of = [&](const fs::path &f){ struct stat st{}; return stat(f.c_str(), &st) == 0 ? (uint64_t)st.st_size : 0; };
+    std::atomic<uint64_t> before{0}, after{0}, debug_bytes{0};
+    std::atomic<int> failed{0};
+    std::mutex log_mu;
+    proc::LogSink out(log);
+    auto step = [&](const proc::Argv &cmd, const std::string &what) {
+        int ec = 0;
+        std::string text = proc::capture(cmd, &ec);
+        std::lock_guard<std::mutex> lk(log_mu);
+        out.write(text.data(), text.size());
+        if (ec != 0) out.line("# " + what + ": exit=" + std::to_string(ec));
+        return ec == 0;
+    };
+    parallel_for(batches.size() + singles.size(), 0, [&](size_t b){
+        if (b < batches.size()) {
+            auto &[f, idx] = batches[b];
+            proc::Argv cmd = {tool, f};
+            for (size_t i : idx) { before += size_of(files[i]); cmd.push_back(files[i].string()); }
+            if (!step(cmd, "strip " + f)) failed++;
+            for (size_t i : idx) after += size_of(files[i]);
+            return;
+        }
+        size_t i = singles[b - batches.size()];
+        std::string f = files[i].string();
+        fs::path dbg = debug_file_for(dbgroot, "/" + files[i].lexically_relative(destdir).generic_string(), build_id[i]);
+        std::error_code ec; fs::create_directories(dbg.parent_path(), ec);
+        before += size_of(files[i]);
+        bool ok = step({objcopy, "--only-keep-debug", zflag, f, dbg.string()}, "keep-debug " + f)
+               && step({tool, flag[i], f}, "strip " + f)
+               && step({objcopy, "--add-gnu-debuglink=" + dbg.string(), f}, "debuglink " + f);
+        if (!ok) failed++;
+        after += size_of(files[i]);
+        debug_bytes += size_of(dbg);
+    });
+
+    size_t n = singles.size();
+    for (auto &[f, idx] : by_flag) n += idx.size();
+    std::string msg = "strip — " + std::to_string(n) + " file(s), saved " + human_size((double)before - (double)after);
+    if (split) msg += ", debug info " + human_size((double)debug_bytes) + " (" + std::to_string(singles.size()) + " file(s))";
+    out.line("# " + msg);
+    if (failed) { sp.stop_fail(msg + ", " + std::to_string(failed.load()) + " batch(es) failed"); return false; }
+    sp.stop_ok(msg);
+    return true;
 }
 
-static bool pack_destdir(const Paths &P, const Recipe &r, const fs::path &destdir, fs::path &out_pkg, const std::string &log) {
+// Packs destdir into packages/name-version.tar.*; a non-empty debug staging
+// tree is packed alongside as packages/name-dbg-version.tar.*.
+static bool pack_destdir(const Paths &P, const Recipe &r, const fs::path &destdir, fs::path &out_pkg, const std::string &log, std::vector<fs::path> *made = nullptr) {
     fs::create_directories(P.packages);
-    std::string base = r.name + "-" + r.version;
-    if (r.pack_fmt=="zst") { out_pkg = P.packages / (base + ".tar.zst"); }
-    else if (r.pack_fmt=="xz") { out_pkg = P.packages / (base + ".tar.xz"); }
-    else { out_pkg = P.packages / (base + ".tar.gz"); }
+    std::string ext = r.pack_fmt=="zst" ? ".tar.zst" : r.pack_fmt=="xz" ? ".tar.xz" : ".tar.gz";
     std::string comp = (r.pack_fmt=="zst"?"--zstd": r.pack_fmt=="xz"?"-J":"-z");
-    std::string cmd = "tar " + comp + " -C '"+destdir.string()+"' -cf '"+out_pkg.string()+"' .";
-    return run_cmd_checked(cmd, "package", log);
+    out_pkg = P.packages / (r.name + "-" + r.version + ext);
+    std::error_code ec;
+    fs::remove(out_pkg, ec);   // may be a hardlink into the build cache: never rewrite it in place
+    if (!run_checked({"tar", comp, "-C", destdir.string(), "-cf", out_pkg.string(), "."}, "package", log)) return false;
+    if (made) made->push_back(out_pkg);
+    fs::path dbg = dbg_staging(P, r.name, r.version);
+    if (fs::is_directory(dbg, ec) && !fs::is_empty(dbg, ec)) {
+        fs::path dbg_pkg = P.packages / (r.name + "-dbg-" + r.version + ext);
+        fs::remove(dbg_pkg, ec);
+        if (!run_checked({"tar", comp, "-C", dbg.string(), "-cf", dbg_pkg.string(), "."}, "package " + r.name + "-dbg", log)) return false;
+        if (made) made->push_back(dbg_pkg);
+        term::ok("Debug package: " + dbg_pkg.string());
+    }
+    return true;
 }
 
-static bool revdep_check(const fs::path &destdir, const std::string &log) {
-    std::string cmd = "sh -c 'set -e; for f in $(find '"+destdir.string()+"' -type f); do if file -b \"$f\" | grep -q ELF; then if ! ldd \"$f\" >/dev/null 2>&1; then echo \"Broken: $f\"; fi; fi; done'";
-    return run_cmd_checked(cmd, "revdep", log);
+// Checks that every DT_NEEDED of every ELF object under destdir resolves,
+// treating destdir as the root the package will be installed into. Sonames
+// in `provided` (shipped by installed packages) count as satisfied.
+static bool revdep_check(const fs::path &destdir, const std::string &log, const std::set<std::string> &provided = {}) {
+    Spinner sp; sp.start("revdep");
+    auto files = find_elf_files(destdir, false);
+    ldso::Resolver res(destdir);
+    std::vector<std::vector<std::string>> missing(files.size());
+    parallel_for(files.size(), 0, [&](size_t i){
+        elf::Dynamic dy;
+        auto in = elf::inspect(files[i], &dy);
+        dy.needed.erase(std::remove_if(dy.needed.begin(), dy.needed.end(),
+            [&](const std::string &so){ return provided.count(so) != 0; }), dy.needed.end());
+        std::string installed = "/" + files[i].lexically_relative(destdir).generic_string();
+        missing[i] = res.missing(installed, in, dy);
+    });
+    proc::LogSink out(log);
+    std::vector<std::string> report;
+    for (size_t i = 0; i < files.size(); ++i) {
+        if (missing[i].empty()) continue;
+        std::string line = "Broken: " + files[i].string() + ":";
+        for (auto &so : missing[i]) line += " " + so;
+        out.line(line);
+        report.push_back(line);
+    }
+    if (report.empty()) { sp.stop_ok("revdep — " + std::to_string(files.size()) + " ELF file(s) ok"); return true; }
+    sp.stop_fail("revdep — " + std::to_string(report.size()) + " broken file(s)");
+    for (size_t i = 0; i < report.size() && i < 20; ++i) term::warn(report[i]);
+    if (report.size() > 20) term::warn("... see " + log);
+    return false;
 }
 
 // =============== Commands ===============
@@ -446,15 +5776,24 @@ static int cmd_new(const Paths &P, const std::string &name) {
     return 0;
 }
 
+// Every *.ini under recipes/, sorted.
+static std::vector<fs::path> recipe_files(const Paths &P) {
+    std::vector<fs::path> out;
+    auto entries = walk::tree(P.recipes, {false, 0});
+    std::sort(entries.begin(), entries.end(), [](const walk::Entry &a, const walk::Entry &b){ return a.rel < b.rel; });
+    for (auto &e : entries) {
+        fs::path p = P.recipes / e.rel;
+        if ((e.type==DT_REG || e.type==DT_LNK) && p.extension()==".ini") out.push_back(p);
+    }
+    return out;
+}
+
 static fs::path find_recipe(const Paths &P, const std::string &name) {
     fs::path f1 = P.recipes / name / (name+".ini");
     if (fs::exists(f1)) return f1;
     // fuzzy search
-    for (auto &p : fs::recursive_directory_iterator(P.recipes)) {
-        if (p.is_regular_file() && p.path().extension()==".ini") {
-            if (p.path().filename().string().find(name)!=std::string::npos) return p.path();
-        }
-    }
+    for (auto &p : recipe_files(P))
+        if (p.filename().string().find(name)!=std::string::npos) return p;
     return {};
 }
 
@@ -466,81 +5805,341 @@ static int cmd_info(const Paths &P, const std::string &name) {
     std::cout << r.desc << "\n";
     if(!r.homepage.empty()) std::cout << "homepage: " << r.homepage << "\n";
     if(!r.source_url.empty()) std::cout << "source: " << r.source_url << "\n";
-    if(!r.git_url.empty()) std::cout << "git:    " << r.git_url << "\n";
-    std::cout << "strip:  " << (r.opt_strip?"yes":"no") << ", fakeroot: " << (r.opt_fakeroot?"yes":"no") << ", pack: " << r.pack_fmt << "\n";
+    for (auto &m : r.mirrors) std::cout << "mirror: " << m << "\n";
+    if(!r.git_url.empty()) std::cout << "git:    " << r.git_url << (r.git_commit.empty() ? "" : " @" + r.git_commit) << (r.git_tag.empty() ? "" : " tag " + r.git_tag) << "\n";
+    std::cout << "strip:  " << (r.opt_strip?"yes":"no") << (r.opt_debuginfo?" (+dbg)":"") << ", fakeroot: " << (r.opt_fakeroot?"yes":"no") << ", pack: " << r.pack_fmt << "\n";
     return 0;
 }
 
 static int cmd_search(const Paths &P, const std::string &q) {
     int n=0;
-    for (auto &p : fs::recursive_directory_iterator(P.recipes)) {
-        if (p.is_regular_file() && p.path().extension()==".ini") {
-            std::string fn = p.path().filename().string();
-            if (fn.find(q)!=std::string::npos) {
-                std::cout << fn << "\n"; n++;
-            }
+    for (auto &p : recipe_files(P)) {
+        std::string fn = p.filename().string();
+        if (fn.find(q)!=std::string::npos) {
+            std::cout << fn << "\n"; n++;
         }
     }
     if (n==0) term::warn("No matches.");
     return 0;
 }
 
-static int cmd_fetch_extract_patch(const Paths &P, const std::string &name) {
+static int cmd_fetch_extract_patch(const Paths &P, const Options &O, const std::string &name) {
     auto f = find_recipe(P,name);
     if (f.empty()) { term::err("Recipe not found: "+name); return 1; }
     Recipe r; if (!parse_ini(f,r)) { term::err("Invalid recipe."); return 1; }
     fs::create_directories(P.logs);
     fs::path logfile = P.logs / (r.name + "-" + r.version + ".log");
     fs::path srcfile, srcdir, workdir;
-    if (!fetch_source(P,r,srcfile,srcdir,logfile.string())) return 2;
-    if (!extract_source(P,r,srcfile,workdir,logfile.string())) return 3;
-    if (!apply_patches(P,r,workdir,logfile.string())) return 4;
+    std::vector<fs::path> patches;
+    if (int rc = fetch_inputs(P,O,r,srcfile,srcdir,patches,logfile.string())) return rc;
+    std::string id = r.name + "-" + r.version;
+    stamps::clear_from(P, id, stamps::EXTRACT);   // the work tree is about to be replaced
+    if (!prepare_tree(P,O,r,srcfile,srcdir,patches,workdir,logfile.string())) return 3;
+    auto want = phase_stamps(P,O,r,srcfile,srcdir,patches,P.destdir / id,false,false);
+    for (int i : {stamps::FETCH, stamps::EXTRACT, stamps::PATCH}) stamps::write(P, id, i, want[i]);
     term::ok("fetch+extract+patch complete: " + workdir.string());
     return 0;
 }
 
-static int cmd_build_install(const Paths &P, const std::string &name, bool do_strip, bool do_revdep) {
+// `fetch --all` / `fetch a b c [-j N]`: downloads and verifies the sources
+// and remote patches of many recipes without extracting anything. Identical
+// URLs are fetched once; files already in sources/ are only re-verified (on
+// the work pool, stamp cache first). Downloads run -j at a time (default 8),
+// each checked against its sha256 as it lands and read back once finished
+// for the stamp cache, with download::gate() capping connections per host.
+static int cmd_fetch_many(const Paths &P, const Options &O, const std::vector<std::string> &names) {
+    struct Item {
+        enum Kind { FILE, PATCH, GIT, MIRROR, LOCAL } kind = FILE;  // PATCH: http(s) patch, GIT: git+ patch repo, MIRROR: git= source
+        std::string url, checksum, commit, tag, label, err, note;
+        fs::path dest;
+        std::vector<std::string> users, logs, mirrors;
+        bool present = false, done = false;
+        download::Stats ds;
+    };
+    std::vector<Item> items;
+    std::map<std::string, size_t> by_key;
+    std::map<fs::path, std::string> dest_url;
+    std::vector<std::string> bad;          // recipes that could not be read
+    size_t recipes = 0, refs = 0;
+    auto add = [&](Item::Kind kind, const std::string &url, const fs::path &dest, const std::string &sum, const Recipe &r, const std::string &log) {
+        std::string id = r.name + "-" + r.version;
+        std::string key = (kind == Item::PATCH ? "patch " : kind == Item::GIT ? "git " : kind == Item::MIRROR ? "mirror " + r.git_commit + " " + r.git_tag + " " : "") + url;
+        refs++;
+        auto it = by_key.find(key);
+        if (it != by_key.end()) {
+            Item &x = items[it->second];
+            x.users.push_back(id);
+            x.logs.push_back(log);
+            if (!sum.empty() && x.checksum.empty()) x.checksum = sum;
+            else if (!sum.empty() && sum != x.checksum && x.err.empty()) x.err = "recipes disagree on sha256 (" + x.users[0] + " vs " + id + ")";
+            return;
+        }
+        Item x;
+        x.kind = kind; x.url = url; x.dest = dest; x.checksum = sum;
+        x.label = kind == Item::GIT ? dest.filename().string() + " (git)" : url.substr(url.find_last_of('/') + 1);
+        if (kind == Item::MIRROR) {
+            x.commit = r.git_commit; x.tag = r.git_tag;
+            std::string pin = !x.commit.empty() ? x.commit : x.tag;
+            x.label = dest.filename().string() + (pin.empty() ? "" : " @" + pin.substr(0, 12));
+        }
+        x.users.push_back(id);
+        x.logs.push_back(log);
+        auto [d, fresh] = dest_url.emplace(dest, url);     // a git mirror serves every pin of its URL
+        if (!dest.empty() && !fresh && d->second != url) x.err = dest.string() + " already comes from " + d->second;
+        by_key[key] = items.size();
+        items.push_back(std::move(x));
+    };
+
+    std::vector<fs::path> files;
+    if (O.all) files = recipe_files(P);
+    for (auto &n : names) {
+        auto f = find_recipe(P, n);
+        if (f.empty()) bad.push_back(n + ": recipe not found"); else files.push_back(f);
+    }
+    std::sort(files.begin(), files.end());
+    files.erase(std::unique(files.begin(), files.end()), files.end());
+    fs::create_directories(P.logs);
+    for (auto &f : files) {
+        Recipe r;
+        if (!parse_ini(f, r)) { bad.push_back(f.string() + ": invalid recipe"); continue; }
+        recipes++;
+        std::string log = (P.logs / (r.name + "-" + r.version + ".log")).string();
+        if (!r.git_url.empty()) add(Item::MIRROR, r.git_url, gitmirror::dir(P, r.git_url), "", r, log);
+        else if (!r.source_url.empty()) {
+            add(Item::FILE, r.source_url, source_file(P, r), r.checksum, r, log);
+            auto &x = items[by_key[r.source_url]];
+            if (x.mirrors.empty()) x.mirrors = mirrors::candidates(P, r);
+        }
+        for (auto &p : r.patches) {
+            auto pin = r.patch_sha256.find(p);
+            std::string sum = pin != r.patch_sha256.end() ? pin->second : "";
+            if (p.rfind("git+",0)==0) add(Item::GIT, p.substr(4), gitmirror::dir(P, p.substr(4)), "", r, log);
+            else if (p.rfind("http://",0)==0 || p.rfind("https://",0)==0) add(Item::PATCH, p, fs::path(), sum, r, log);
+            else add(Item::LOCAL, p, p.rfind("file://",0)==0 ? fs::path(p.substr(7)) : fs::path(p), sum, r, log);
+        }
+    }
+    for (auto &b : bad) term::err(b);
+    if (items.empty()) { term::warn("Nothing to fetch."); return bad.empty() ? 0 : 1; }
+    term::info(std::to_string(items.size()) + " sources/patches for " + std::to_string(recipes) + " recipes" +
+               (refs > items.size() ? " (" + std::to_string(refs - items.size()) + " shared)" : ""));
+
+    std::mutex out_mu;
+    size_t finished = 0;
+    auto report = [&](Item &x) {
+        std::lock_guard<std::mutex> g(out_mu);
+        std::string n = "[" + std::to_string(++finished) + "/" + std::to_string(items.size()) + "] " + x.label;
+        if (!x.err.empty()) term::err(n + " — " + x.err);
+        else term::ok(n + " — " + x.note);
+        for (auto &l : x.logs) proc::LogSink(l).line("# fetch " + x.url + ": " + (x.err.empty() ? x.note : x.err));
+    };
+
+    // What is already here only needs its hash checked: CPU work for the hash pool.
+    std::vector<size_t> verify;
+    for (size_t i = 0; i < items.size(); ++i) {
+        Item &x = items[i];
+        std::error_code ec;
+        if (!x.err.empty()) { x.done = true; report(x); continue; }
+        if (x.kind == Item::LOCAL) {
+            x.present = x.done = true;
+            std::string got;
+            if (!fs::exists(x.dest, ec)) x.err = "not found";
+            else if (!x.checksum.empty() && (got = verified_sha256(P, x.dest, O.paranoid)) != x.checksum) x.err = "sha256 mismatch: got=" + got + " expected=" + x.checksum;
+            else x.note = x.checksum.empty() ? "local" : "local, sha256 verified";
+            report(x);
+        } else if (x.kind == Item::FILE && fs::exists(x.dest, ec)) verify.push_back(i);
+        else if (std::string how; x.kind == Item::FILE && store::take(P, x.checksum, x.dest, &how)) {
+            x.present = x.done = true;
+            x.note = "from store (" + how + ")";
+            report(x);
+        }
+    }
+    parallel_for(verify.size(), 0, [&](size_t k){
+        Item &x = items[verify[k]];
+        x.present = x.done = true;
+        if (x.checksum.empty()) x.note = "present";
+        else {
+            bool cached = false;
+            auto got = verified_sha256(P, x.dest, O.paranoid, &cached);
+            if (got != x.checksum) x.err = "sha256 mismatch: got=" + got + " expected=" + x.checksum;
+            else {
+                x.note = std::string("present, sha256 verified") + (cached ? " (cached stamp)" : "");
+                if (store::put(P, got, x.dest)) x.note += ", added to store";
+            }
+        }
+        report(x);
+    });
+
+    std::vector<size_t> todo;
+    std::vector<std::string> all_mirrors;
+    for (size_t i = 0; i < items.size(); ++i) {
+        if (items[i].done) continue;
+        todo.push_back(i);
+        if (items[i].mirrors.size() > 1) all_mirrors.insert(all_mirrors.end(), items[i].mirrors.begin(), items[i].mirrors.end());
+    }
+    // Every mirror host is probed once up front; each download then ranks its own list from that.
+    if (!all_mirrors.empty()) {
+        std::string report;
+        mirrors::rank(P, all_mirrors, &report);
+        term::info("mirrors: " + report);
+    }
+    unsigned jobs = O.jobs ? O.jobs : 8;
+    auto t0 = std::chrono::steady_clock::now();
+    parallel_for(todo.size(), jobs, [&](size_t k){
+        Item &x = items[todo[k]];
+        if (x.kind == Item::MIRROR) {
+            std::string commit;
+            bool fetched = false;
+            if (gitmirror::sync(P, x.url, x.commit, x.tag, commit, x.err, x.logs[0], &fetched))
+                x.note = (fetched ? "fetched " : "mirror has ") + commit.substr(0, 12);
+            x.present = !fetched;
+        } else if (x.kind == Item::GIT) {
+            std::vector<fs::path> files;
+            bool fetched = false;
+            if (patchstore::git(P, x.url, files, x.note, x.err, x.logs[0], &fetched)) x.present = !fetched;
+        } else if (x.kind == Item::PATCH) {
+            fs::path f;
+            bool fresh = false;
+            if (patchstore::fetch(P, x.url, x.checksum, f, x.note, x.err, x.logs[0], &fresh)) {
+                x.present = !fresh;
+                x.ds.bytes = fresh ? fs::file_size(f) : 0;
+                x.note = "patch " + x.note + " (" + f.parent_path().filename().string().substr(0, 12) + ")";
+            }
+        } else {
+            sha256::Hasher hasher;
+            std::string got;
+            download::Opts o;
+            std::vector<std::string> urls = x.mirrors.size() > 1 ? mirrors::rank(P, x.mirrors) : std::vector<std::string>{x.url};
+            o.mirrors.assign(urls.begin() + 1, urls.end());
+            o.tee = [&](const char *d, size_t n){ hasher.update(d, n); };
+            o.commit = [&]{
+                got = hasher.hex();
+                if (x.checksum.empty() || got == x.checksum) return true;
+                x.err = "sha256 mismatch: got=" + got + " expected=" + x.checksum;
+                return false;
+            };
+            std::string err;
+            bool ok = download::fetch(urls[0], x.dest, o, x.ds, err);
+            // Only a hash of the finished file goes into the stamp cache; it has to agree with the tee's.
+            if (std::string disk; ok && (disk = verified_sha256(P, x.dest, true)) != got) {
+                std::error_code ec;
+                fs::remove(x.dest, ec);
+                x.err = "downloaded file does not match the bytes hashed (" + got + " vs " + disk + ")";
+                ok = false;
+            }
+            if (ok) {
+                x.note = x.ds.summary() + (x.checksum.empty() ? "" : ", sha256 verified");
+                if (!x.checksum.empty() && store::put(P, got, x.dest)) x.note += ", added to store";
+            } else if (x.err.empty()) x.err = err;
+        }
+        x.done = true;
+        report(x);
+    });
+    double secs = std::chrono::duration<double>(std::chrono::steady_clock::now() - t0).count();
+
+    size_t got = 0, present = 0, failed = bad.size();
+    uint64_t bytes = 0;
+    for (auto &x : items) {
+        if (!x.err.empty()) failed++;
+        else if (x.present) present++;
+        else { got++; bytes += x.ds.bytes; }
+    }
+    char rate[96];
+    std::snprintf(rate, sizeof(rate), " (%s in %.1fs, %s/s)", human_size((double)bytes).c_str(), secs, human_size(bytes / std::max(secs, 1e-3)).c_str());
+    std::string sum = std::to_string(got) + " fetched" + (bytes ? rate : "") + ", " +
+                      std::to_string(present) + " already present, " + std::to_string(failed) + " failed" +
+                      " (-j " + std::to_string(jobs) + ", " + std::to_string(download::gate().limit()) + " per host)";
+    if (failed) {
+        term::err("fetch: " + sum);
+        for (auto &x : items) if (!x.err.empty()) std::cout << "  " << x.label << " [" << x.users[0] << (x.users.size() > 1 ? " +" + std::to_string(x.users.size() - 1) : "") << "]: " << x.err << "\n";
+        for (auto &b : bad) std::cout << "  " << b << "\n";
+        return 2;
+    }
+    term::ok("fetch: " + sum);
+    return 0;
+}
+
+static int build_install(const Paths &P, const Options &O, const std::string &name, bool do_strip, bool do_revdep) {
     auto f = find_recipe(P,name);
     if (f.empty()) { term::err("Recipe not found: "+name); return 1; }
     Recipe r; if (!parse_ini(f,r)) { term::err("Invalid recipe."); return 1; }
     fs::path logfile = P.logs / (r.name + "-" + r.version + ".log");
     fs::path srcfile, srcdir, workdir;
-    if (!fetch_source(P,r,srcfile,srcdir,logfile.string())) return 2;
-    if (!extract_source(P,r,srcfile,workdir,logfile.string())) return 3;
-    if (!apply_patches(P,r,workdir,logfile.string())) return 4;
+    std::vector<fs::path> patches;
+    if (int rc = fetch_inputs(P,O,r,srcfile,srcdir,patches,logfile.string())) return rc;
 
     fs::path staging = P.destdir / (r.name + "-" + r.version);
-    fs::remove_all(staging); fs::create_directories(staging);
-
-    if (!run_phase("preconfig", r.preconfig, workdir, staging, r, logfile.string())) return 5;
-    if (!run_phase("config", r.config, workdir, staging, r, logfile.string())) return 6;
-    if (!run_phase("build", r.build, workdir, staging, r, logfile.string())) return 7;
+    fs::path dbg = dbg_staging(P, r.name, r.version);
+    bool strip = do_strip || r.opt_strip;
+    bool split = strip && (O.debuginfo || r.opt_debuginfo);
+    std::string key = O.cache ? build_key(P,O,r,srcfile,srcdir,patches,staging,strip,split) : std::string();
+    bool rebuild = O.force || !O.from.empty();   // explicit phase requests bypass the cache lookup
+    treecopy::Stats restored;
+    bool hit = !rebuild && buildcache::restore(P, key, staging, dbg, restored);
+    if (hit) remotecache::stats().outcome = "local hit";
+    else if (!rebuild && !key.empty() && remotecache::pull(P, key, logfile.string())) hit = buildcache::restore(P, key, staging, dbg, restored);
+    if (hit) {
+        term::ok("build cache hit " + key.substr(0, 16) + ": " + restored.summary() + ", " + human_size((double)restored.bytes));
+        discard_stream(P, r);
+    } else {
+        if (!key.empty() && !rebuild) { term::info("build cache miss " + key.substr(0, 16)); remotecache::stats().outcome = "miss"; }
+        std::string id = r.name + "-" + r.version;
+        auto want = phase_stamps(P,O,r,srcfile,srcdir,patches,staging,strip,split);
+        int start = O.force ? 0 : stamps::first_stale(P, id, want);
+        if (!O.from.empty()) start = std::min(start, stamps::index(O.from));
+        workdir = P.work / id;
+        if (start == stamps::PATCH) start = stamps::EXTRACT;          // patches only apply to a fresh tree
+        if (start > stamps::EXTRACT && !fs::is_directory(workdir)) start = stamps::EXTRACT;
+        if (start > stamps::INSTALL && start < stamps::COUNT) start = stamps::INSTALL;   // postinstall/strip edit the installed tree
+        if (start == stamps::COUNT && !fs::is_directory(staging)) start = stamps::INSTALL;
+        stamps::clear_from(P, id, start);
+        stamps::write(P, id, stamps::FETCH, want[stamps::FETCH]);
+        if (start == stamps::COUNT) term::ok("all phases up to date (stamps in " + stamps::dir(P, id).string() + ")");
+        else if (start > stamps::FETCH) term::info("resuming at " + std::string(stamps::NAMES[start]) + " (earlier phases up to date)");
 
-    // Install (optionally under fakeroot)
-    {
-        std::string phase = "install";
-        std::ostringstream oss;
-        oss << (r.opt_fakeroot?"fakeroot ":"");
-        oss << "sh -c 'set -e; cd '"<<workdir.string()<<"'; export DESTDIR='"<<staging.string()<<"'; export PREFIX=/usr; export JOBS='"<< std::thread::hardware_concurrency() <<"'; export MAKEFLAGS='-j'\"$JOBS\"'; ";
-        if (!r.install.empty()) oss << r.install; else oss << "make DESTDIR=\"$DESTDIR\" install";
-        oss << "'";
-        if (!run_cmd_checked(oss.str(), phase, logfile.string())) return 8;
+        std::string install = r.install.empty() ? "make DESTDIR=\"$DESTDIR\" install" : r.install;
+        auto step = [&](int phase, const std::function<bool()> &fn) {
+            if (phase < start) return true;
+            if (!fn()) return false;
+            stamps::write(P, id, phase, want[phase]);
+            return true;
+        };
+        // extract+patch always run together (see above); prepare_tree does both
+        if (!step(stamps::EXTRACT, [&]{ return prepare_tree(P,O,r,srcfile,srcdir,patches,workdir,logfile.string()); })) return 3;
+        if (!step(stamps::PATCH, []{ return true; })) return 4;
+        if (!step(stamps::PRECONFIG, [&]{ return run_phase("preconfig", r.preconfig, workdir, staging, r, logfile.string()); })) return 5;
+        if (!step(stamps::CONFIG, [&]{ return run_phase("config", r.config, workdir, staging, r, logfile.string()); })) return 6;
+        if (!step(stamps::BUILD, [&]{ return run_phase("build", r.build, workdir, staging, r, logfile.string()); })) return 7;
+        // Install (optionally under fakeroot) into a fresh staging tree
+        if (!step(stamps::INSTALL, [&]{
+            walk::remove_tree(staging); fs::create_directories(staging);
+            walk::remove_tree(dbg);
+            return run_phase("install", install, workdir, staging, r, logfile.string(), r.opt_fakeroot);
+        })) return 8;
+        if (!step(stamps::POSTINSTALL, [&]{ return r.postinstall.empty() || run_phase("postinstall", r.postinstall, workdir, staging, r, logfile.string()); })) return 9;
+        if (!step(stamps::STRIP, [&]{ return !strip || maybe_strip(staging, logfile.string(), split ? dbg : fs::path()); })) return 10;
+        if (!key.empty()) {
+            if (buildcache::store(P, key, staging, dbg)) remotecache::push_async(P, key, logfile.string());
+            else term::warn("build cache: could not store " + key.substr(0, 16));
+        }
     }
 
-    if (!r.postinstall.empty()) if (!run_phase("postinstall", r.postinstall, workdir, staging, r, logfile.string())) return 9;
-
-    if (do_strip || r.opt_strip) if (!maybe_strip(staging, logfile.string())) return 10;
-
     // Save registry manifest
-    save_meta(P,r);
-    save_manifest_from_destdir(P,r,staging);
+    if (!save_manifest_from_destdir(P,r,staging,O.overwrite)) return 11;
+    save_meta(P,r,key);
+    sonames::update(P, r.name + "-" + r.version, staging, pkg_id_dir(P,r));
 
-    if (do_revdep) if (!revdep_check(staging, logfile.string())) term::warn("revdep found issues (see log)");
+    if (do_revdep) if (!revdep_check(staging, logfile.string(), sonames::provided(sonames::load(P)))) term::warn("revdep found issues (see log)");
 
     term::ok("Installed to DESTDIR: " + staging.string());
     return 0;
 }
 
+static int cmd_build_install(const Paths &P, const Options &O, const std::string &name, bool do_strip, bool do_revdep) {
+    int rc = build_install(P, O, name, do_strip, do_revdep);
+    remotecache::finish();
+    return rc;
+}
+
 static int cmd_package(const Paths &P, const std::string &name) {
     auto f = find_recipe(P,name);
     if (f.empty()) { term::err("Recipe not found: "+name); return 1; }
@@ -549,53 +6148,196 @@ static int cmd_package(const Paths &P, const std::string &name) {
     if (!fs::exists(staging)) { term::err("Nothing to package — build/install first"); return 2; }
     fs::path logfile = P.logs / (r.name + "-" + r.version + ".log");
     fs::path out;
-    if (!pack_destdir(P,r,staging,out,logfile.string())) return 3;
+    std::vector<fs::path> made;
+    if (!pack_destdir(P,r,staging,out,logfile.string(),&made)) return 3;
+    auto db = open_registry(P);
+    if (auto p = db.find(r.name + "-" + r.version)) buildcache::add_packages(P, p->build, made);
     term::ok("Package: " + out.string());
     return 0;
 }
 
+// Registry directory of an installed package, by name or name-version.
+static fs::path find_installed(const Paths &P, const std::string &name) {
+    auto db = open_registry(P);
+    auto p = db.find(name);
+    return p ? P.registry / p->id() : fs::path();
+}
+
 static int cmd_remove(const Paths &P, const std::string &name) {
     // Remove from DESTDIR using manifest
     // We accept name or name-version
-    std::string id = name;
-    fs::path pkgdir;
-    for (auto &p : fs::directory_iterator(P.registry)) {
-        if (p.is_directory()) {
-            if (p.path().filename()==id || p.path().filename().string().rfind(name+"-",0)==0) { pkgdir = p.path(); break; }
-        }
-    }
-    if (pkgdir.empty()) { term::err("No registry entry for: "+name); return 1; }
-    std::ifstream mf(pkgdir/"manifest.txt");
-    if (!mf) { term::err("Manifest missing for: "+name); return 2; }
+    auto db = open_registry(P);
+    auto pkg = db.find(name);
+    if (!pkg) { term::err("No registry entry for: "+name); return 1; }
+    regdb::Pkg meta = *pkg;
+    fs::path pkgdir = P.registry / meta.id();
+    if (!fs::exists(pkgdir/"manifest.txt")) { term::err("Manifest missing for: "+name); return 2; }
     std::string pkgname = pkgdir.filename().string();
     fs::path staging = P.destdir / pkgname;
+    auto entries = manifest::entries(pkgdir);
+    std::vector<std::string> owned;
+    for (auto &e : entries) if (e.second != DT_DIR) owned.push_back(e.first);
     int removed=0;
-    for (std::string line; std::getline(mf,line);) {
-        fs::path f = staging / fs::path(line).relative_path();
-        std::error_code ec; if (fs::exists(f,ec)) { fs::remove(f,ec); removed++; }
+    for (auto it = entries.rbegin(); it != entries.rend(); ++it) {   // children before their directories
+        fs::path f = staging / fs::path(it->first).relative_path();
+        std::error_code ec;
+        if (it->second == DT_DIR) { fs::remove(f, ec); continue; }   // only if empty
+        if (fs::symlink_status(f, ec).type() != fs::file_type::not_found) { fs::remove(f,ec); removed++; }
     }
-    fs::remove_all(staging);
+    walk::remove_tree(staging);
     term::ok("Removed files from DESTDIR for " + pkgname + ": " + std::to_string(removed));
 
+    walk::remove_tree(dbg_staging(P, meta.name, meta.version));
+
     // hook
-    std::ifstream meta(pkgdir/"meta.ini");
     Recipe r; r.name=pkgname; // minimal
     // If a recipe exists, try to read hooks
-    auto f = find_recipe(P, pkgname.substr(0,pkgname.find_last_of('-')));
+    auto f = find_recipe(P, meta.name);
     if (!f.empty()) parse_ini(f,r);
     if (!r.postremove.empty()) {
         fs::path logfile = P.logs / (pkgname + ".log");
         run_phase("postremove", r.postremove, fs::current_path(), staging, r, logfile.string());
     }
 
+    {
+        owners::Lock lk(P);
+        sonames::drop(P, pkgname);
+        owners::drop(P, pkgname, owned);
+    }
+    if (!db.del(pkgname)) term::warn("registry: could not record removal of " + pkgname);
     fs::remove_all(pkgdir);
     return 0;
 }
 
+static int cmd_list(const Paths &P) {
+    auto db = open_registry(P);
+    uint64_t total = 0;
+    for (auto p : db.list()) {
+        char buf[400];
+        std::snprintf(buf, sizeof(buf), "%-40s %10s %7llu files  %s", p->id().c_str(), human_size((double)p->size).c_str(),
+                      (unsigned long long)p->files, p->time.c_str());
+        std::cout << buf << "\n";
+        total += p->size;
+    }
+    term::info(std::to_string(db.size()) + " package(s), " + human_size((double)total));
+    return 0;
+}
+
+// Which installed package owns a path. Accepts the installed path
+// (/usr/lib/libz.so.1) or its location under DESTDIR/<pkg>/.
+static int cmd_owns(const Paths &P, const std::string &arg) {
+    std::string path = arg;
+    std::string root = P.destdir.string() + "/";
+    if (path.rfind(root, 0) == 0) {
+        auto slash = path.find('/', root.size());
+        path = slash == std::string::npos ? "/" : path.substr(slash);
+    }
+    if (path.empty() || path[0] != '/') path = "/" + path;
+    std::string owner = owners::lookup(P, path);
+    if (owner.empty()) { term::err(path + ": not owned by any installed package"); return 1; }
+    std::cout << path << ": " << owner << "\n";
+    return 0;
+}
+
+// Compares the staging tree of an installed package with its manifest:
+// missing entries, changed type/mode/size and changed contents.
+static int cmd_verify(const Paths &P, const std::string &name) {
+    fs::path pkgdir = find_installed(P, name);
+    if (pkgdir.empty()) { term::err("No registry entry for: "+name); return 1; }
+    manifest::View v;
+    if (!v.open(manifest::bin_of(pkgdir))) { term::err("No binary manifest for: "+name+" (reinstall with bi)"); return 2; }
+    fs::path staging = P.destdir / pkgdir.filename();
+    std::vector<std::string> problems(v.size());
+    std::vector<std::pair<std::string, const manifest::Record*>> items;
+    items.reserve(v.size());
+    v.each([&](const std::string &p, const manifest::Record &r){ items.emplace_back(p, &r); });
+    parallel_for(items.size(), 0, [&](size_t i){
+        auto &[path, rec] = items[i];
+        fs::path full = staging / fs::path(path).relative_path();
+        struct stat st{};
+        if (lstat(full.c_str(), &st) != 0) { problems[i] = "missing"; return; }
+        uint8_t type = S_ISREG(st.st_mode) ? DT_REG : S_ISDIR(st.st_mode) ? DT_DIR : S_ISLNK(st.st_mode) ? DT_LNK : DT_UNKNOWN;
+        if (type != rec->type) { problems[i] = std::string("type ") + manifest::type_name(rec->type) + " -> " + manifest::type_name(type); return; }
+        std::string what;
+        if ((st.st_mode & 07777) != (rec->mode & 07777)) what += " mode";
+        if (type == DT_REG && (uint64_t)st.st_size != rec->size) what += " size";
+        std::string want = manifest::hex(rec->sha256, 32), got;
+        if (type == DT_REG && what.empty()) got = sha256::file(full);
+        else if (type == DT_LNK) { std::error_code ec; got = sha256::bytes(fs::read_symlink(full, ec).string()); }
+        if (!got.empty() && got != want) what += type == DT_LNK ? " target" : " content";
+        if (!what.empty()) problems[i] = "changed:" + what;
+    });
+    int bad = 0;
+    for (size_t i = 0; i < items.size(); ++i)
+        if (!problems[i].empty()) { std::cout << items[i].first << ": " << problems[i] << "\n"; bad++; }
+    if (bad) { term::err(pkgdir.filename().string() + ": " + std::to_string(bad) + " of " + std::to_string(items.size()) + " entries differ"); return 3; }
+    term::ok(pkgdir.filename().string() + ": " + std::to_string(items.size()) + " entries verified");
+    return 0;
+}
+
+// Every installed binary whose DT_NEEDED is neither provided by an installed
+// package nor resolvable on the host.
+static int cmd_revdep_all(const Paths &P) {
+    Spinner sp; sp.start("revdep --all");
+    auto rows = sonames::load(P);
+    auto provided = sonames::provided(rows);
+    std::vector<std::pair<std::string, std::string>> files;   // (pkg, path) with unsatisfied needs
+    for (auto &r : rows)
+        if (r.kind == 'N' && !provided.count(r.soname) && (files.empty() || files.back() != std::make_pair(r.pkg, r.path)))
+            files.emplace_back(r.pkg, r.path);
+    std::map<std::string, std::unique_ptr<ldso::Resolver>> resolvers;
+    for (auto &f : files) if (!resolvers.count(f.first)) resolvers[f.first] = std::make_unique<ldso::Resolver>(P.destdir / f.first);
+    std::vector<std::vector<std::string>> missing(files.size());
+    parallel_for(files.size(), 0, [&](size_t i){
+        fs::path full = P.destdir / files[i].first / fs::path(files[i].second).relative_path();
+        elf::Dynamic dy;
+        auto in = elf::inspect(full, &dy);
+        if (!in.is_elf) return;   // the file vanished from DESTDIR; remove/bi will refresh the index
+        dy.needed.erase(std::remove_if(dy.needed.begin(), dy.needed.end(),
+            [&](const std::string &so){ return provided.count(so) != 0; }), dy.needed.end());
+        missing[i] = resolvers[files[i].first]->missing(files[i].second, in, dy);
+    });
+    std::vector<std::string> report;
+    for (size_t i = 0; i < files.size(); ++i) {
+        if (missing[i].empty()) continue;
+        std::string line = files[i].first + ": " + files[i].second + ":";
+        for (auto &so : missing[i]) line += " " + so;
+        report.push_back(line);
+    }
+    if (report.empty()) { sp.stop_ok("revdep --all — no broken binaries"); return 0; }
+    sp.stop_fail("revdep --all — " + std::to_string(report.size()) + " broken file(s)");
+    for (auto &l : report) std::cout << l << "\n";
+    return 1;
+}
+
+// Packages that link against a soname, i.e. what to rebuild after bumping it.
+static int cmd_rdeps(const Paths &P, const std::string &soname) {
+    auto rows = sonames::load(P);
+    std::map<std::string, std::vector<std::string>> users;
+    std::set<std::string> providers;
+    for (auto &r : rows) {
+        if (r.soname != soname) continue;
+        if (r.kind == 'N') users[r.pkg].push_back(r.path);
+        else providers.insert(r.pkg);
+    }
+    for (auto &p : providers) term::info("provided by " + p);
+    if (users.empty()) { term::warn("No installed package needs " + soname); return 0; }
+    for (auto &[pkg, paths] : users) {
+        std::cout << term::bold << pkg << term::reset << "\n";
+        for (auto &f : paths) std::cout << "  " << f << "\n";
+    }
+    return 0;
+}
+
 static int cmd_sync(const Paths &P, const std::string &msg) {
     fs::path logfile = P.logs/"sync.log";
-    std::string cmd = "sh -c 'git add -A && git commit -m " + std::string("\"") + (msg.empty()?"sbuild sync":msg) + "\" || true; git push'";
-    if (!run_cmd_checked(cmd, "git sync", logfile.string())) return 1;
+    {
+        proc::LogSink log(logfile.string());
+        proc::Opts o; o.out = log.sink();
+        if (proc::run({"git", "add", "-A"}, o).ok())
+            proc::run({"git", "commit", "-m", msg.empty()?"sbuild sync":msg}, o); // nothing to commit is fine
+    }
+    if (!run_checked({"git", "push"}, "git sync", logfile.string())) return 1;
     // postsync hook (global)
     // (Optional) Users can define a postsync command in .sbuild/hooks.ini
     fs::path hook = P.state/"hooks.ini";
@@ -607,6 +6349,371 @@ static int cmd_sync(const Paths &P, const std::string &msg) {
     return 0;
 }
 
+// =============== Benchmarks ===============
+// Developer microbenchmarks: sbuild bench <target> [args]
+template <class F> static double bench_time(int n, F f) {
+    auto t0 = std::chrono::steady_clock::now();
+    for (int i = 0; i < n; ++i) f();
+    return std::chrono::duration<double>(std::chrono::steady_clock::now() - t0).count();
+}
+
+static void bench_report(const std::string &label, int n, double secs) {
+    char buf[200];
+    std::snprintf(buf, sizeof(buf), "  %-34s %9.1f us/op  (%d ops, %.2fs)", label.c_str(), secs * 1e6 / n, n, secs);
+    std::cout << buf << "\n";
+}
+
+// Spawn cost: the old popen/system path (always via /bin/sh) vs proc::run.
+static int bench_spawn(int n) {
+    std::cout << term::bold << "spawn" << term::reset << " (" << n << " iterations)\n";
+    bench_report("popen(\"true 2>&1\") + fgets", n, bench_time(n, []{
+        FILE *p = popen("true 2>&1", "r");
+        if (!p) return;
+        char b[256]; while (fgets(b, sizeof(b), p)) {}
+        pclose(p);
+    }));
+    bench_report("system(\"true >> log 2>&1\")", n, bench_time(n, []{
+        int rc = std::system("true >> /dev/null 2>&1"); (void)rc;
+    }));
+    bench_report("proc::run({\"true\"})", n, bench_time(n, []{ proc::run({"true"}); }));
+    bench_report("proc::run(sh -c true)", n, bench_time(n, []{ proc::run(proc::sh("true")); }));
+    return 0;
+}
+
+// SHA-256 throughput: each native block function, the batch API and a forked
+// sha256sum. Without an existing file argument a temporary file of N MB
+// (default 1024) is generated first; run twice to compare cold vs warm cache.
+static int bench_sha256(const std::vector<std::string> &args) {
+    fs::path file;
+    bool temp = false;
+    if (!args.empty() && fs::is_regular_file(args[0])) file = args[0];
+    else {
+        size_t mb = args.empty() ? 1024 : (size_t)std::max(1, std::atoi(args[0].c_str()));
+        file = fs::temp_directory_path() / ("sbuild-bench-sha256-" + std::to_string(getpid()));
+        std::ofstream o(file, std::ios::binary);
+        std::vector<uint64_t> chunk(1 << 17);
+        uint64_t x = 0x9e3779b97f4a7c15ULL;
+        for (size_t i = 0; i < mb; ++i) {
+            for (auto &v : chunk) { x ^= x << 13; x ^= x >> 7; x ^= x << 17; v = x; }
+            o.write(reinterpret_cast<const char*>(chunk.data()), chunk.size() * sizeof(uint64_t));
+        }
+        temp = true;
+    }
+    double mb = fs::file_size(file) / 1048576.0;
+    std::cout << term::bold << "sha256" << term::reset << " " << file.string() << " (" << (size_t)mb << " MB)\n";
+    auto report = [&](const std::string &label, double bytes_mb, double secs) {
+        char buf[200];
+        std::snprintf(buf, sizeof(buf), "  %-34s %9.1f MB/s  (%.2fs)", label.c_str(), bytes_mb / secs, secs);
+        std::cout << buf << "\n";
+    };
+    auto timed = [](auto f) {
+        auto t0 = std::chrono::steady_clock::now(); f();
+        return std::chrono::duration<double>(std::chrono::steady_clock::now() - t0).count();
+    };
+    std::string ref;
+    for (auto &impl : sha256::available()) {
+        std::string got;
+        double secs = timed([&]{ got = sha256::file(file, impl.fn); });
+        if (ref.empty()) ref = got;
+        else if (got != ref) term::err(std::string(impl.name) + " digest mismatch: " + got);
+        report(std::string("native ") + impl.name, mb, secs);
+    }
+    std::string forked;
+    double secs = timed([&]{ forked = proc::capture({"sha256sum", file.string()}); });
+    if (forked.compare(0, 64, ref) != 0) term::err("sha256sum disagrees: " + forked.substr(0, 64));
+    report("sha256sum (forked)", mb, secs);
+    unsigned jobs = default_jobs();
+    std::vector<fs::path> batch(jobs, file);
+    secs = timed([&]{ sha256::files(batch, jobs); });
+    report("batch x" + std::to_string(jobs) + " (" + sha256::active().name + ")", mb * jobs, secs);
+    std::cout << "  digest " << ref << "\n";
+    if (temp) fs::remove(file);
+    return 0;
+}
+
+// Tree walking on a synthetic tree of N files (default 1M; 1000 per directory,
+// 100 directories per parent): the old recursive_directory_iterator +
+// fs::relative manifest loop against walk::tree, then a parallel removal.
+static int bench_walk(size_t nfiles) {
+    fs::path root = fs::temp_directory_path() / ("sbuild-bench-walk-" + std::to_string(getpid()));
+    size_t ndirs = (nfiles + 999) / 1000;
+    std::cout << term::bold << "walk" << term::reset << " " << root.string() << " (" << nfiles << " files, " << ndirs << " dirs)\n";
+    auto timed = [](auto f) {
+        auto t0 = std::chrono::steady_clock::now(); f();
+        return std::chrono::duration<double>(std::chrono::steady_clock::now() - t0).count();
+    };
+    auto report = [&](const std::string &label, size_t n, double secs) {
+        char buf[200];
+        std::snprintf(buf, sizeof(buf), "  %-40s %8.2fs  (%zu entries)", label.c_str(), secs, n);
+        std::cout << buf << "\n";
+    };
+    double secs = timed([&]{
+        parallel_for(ndirs, 0, [&](size_t d){
+            fs::path dir = root / ("d" + std::to_string(d / 100)) / ("s" + std::to_string(d % 100));
+            std::error_code ec; fs::create_directories(dir, ec);
+            for (size_t f = d * 1000; f < std::min(nfiles, (d + 1) * 1000); ++f) {
+                int fd = open((dir / ("f" + std::to_string(f))).c_str(), O_WRONLY | O_CREAT | O_CLOEXEC, 0644);
+                if (fd >= 0) close(fd);
+            }
+        });
+    });
+    report("create tree", nfiles, secs);
+
+    size_t n = 0;
+    secs = timed([&]{
+        n = 0;
+        for (auto &p : fs::recursive_directory_iterator(root))
+            if (fs::is_regular_file(p.path())) { auto rel = fs::relative(p.path(), root); n += !rel.empty(); }
+    });
+    report("recursive_directory_iterator+relative", n, secs);
+    secs = timed([&]{
+        n = 0;
+        for (auto &p : fs::recursive_directory_iterator(root))
+            if (p.is_regular_file()) { auto rel = p.path().lexically_relative(root); n += !rel.empty(); }
+    });
+    report("recursive_directory_iterator+lexical", n, secs);
+    secs = timed([&]{ n = walk::tree(root, {false, 1}).size(); });
+    report("walk::tree d_type, 1 thread", n, secs);
+    secs = timed([&]{ n = walk::tree(root, {false, 0}).size(); });
+    report("walk::tree d_type, " + std::to_string(default_jobs()) + " threads", n, secs);
+    secs = timed([&]{ n = walk::tree(root, {true, 0}).size(); });
+    report("walk::tree +stat, " + std::to_string(default_jobs()) + " threads", n, secs);
+    secs = timed([&]{ walk::remove_tree(root); });
+    report("walk::remove_tree", n, secs);
+    return 0;
+}
+
+// Getting a source tree into work/: tar -x of an archive (given, or a
+// synthetic .tar.zst of N 4 KiB files, default 20000) against cloning the
+// extracted tree as the pristine cache does (reflink/hardlink, then copies).
+static int bench_clone(const std::vector<std::string> &args) {
+    fs::path base = fs::temp_directory_path() / ("sbuild-bench-clone-" + std::to_string(getpid()));
+    fs::create_directories(base);
+    fs::path archive;
+    if (!args.empty() && fs::is_regular_file(args[0])) archive = fs::absolute(args[0]);
+    else {
+        size_t n = args.empty() ? 20000 : (size_t)std::max(1, std::atoi(args[0].c_str()));
+        fs::path gen = base / "gen";
+        std::string data(4096, 'x');
+        for (size_t i = 0; i < n; ++i) {
+            fs::path d = gen / ("d" + std::to_string(i / 500));
+            if (i % 500 == 0) fs::create_directories(d);
+            std::snprintf(&data[0], data.size(), "file %zu\n", i);
+            std::ofstream(d / ("f" + std::to_string(i) + ".c"), std::ios::binary).write(data.data(), data.size());
+        }
+        archive = base / "src.tar.zst";
+        if (!proc::run({"tar", "--zstd", "-C", gen.string(), "-cf", archive.string(), "."}).ok()) { term::err("tar failed"); return 1; }
+        walk::remove_tree(gen);
+    }
+    std::cout << term::bold << "clone" << term::reset << " " << archive.string() << " (" << human_size((double)fs::file_size(archive)) << ")\n";
+    auto timed = [](auto f) {
+        auto t0 = std::chrono::steady_clock::now(); f();
+        return std::chrono::duration<double>(std::chrono::steady_clock::now() - t0).count();
+    };
+    auto report = [&](const std::string &label, double secs, const std::string &extra = {}) {
+        char buf[200];
+        std::snprintf(buf, sizeof(buf), "  %-32s %8.3fs  %s", label.c_str(), secs, extra.c_str());
+        std::cout << buf << "\n";
+    };
+    fs::path x = base / "extracted";
+    fs::create_directories(x);
+    double secs = timed([&]{ proc::run({"tar", "-xf", archive.string(), "-C", x.string()}); });
+    size_t files = 0;
+    for (auto &e : walk::tree(x, {false, 0})) files += e.type == DT_REG;
+    report("tar -x", secs, std::to_string(files) + " files");
+    for (bool links : {true, false}) {
+        treecopy::Stats st;
+        fs::path out = base / (links ? "linked" : "copied");
+        secs = timed([&]{ treecopy::tree(x, out, links, &st); });
+        report(links ? "clone (reflink/hardlink)" : "clone (reflink/copy)", secs, st.summary());
+    }
+    secs = timed([&]{ walk::remove_tree(base); });
+    report("cleanup", secs);
+    return 0;
+}
+
+// Archive extraction: the external tool (tar -x, unzip) against unpack::archive
+// for each archive given, or for a synthetic tree of N files (default 20000,
+// plus long names, links and a few large files) packed as .tar.gz, .tar.xz,
+// .tar.bz2, .tar.zst and .zip. Both results are compared entry by entry
+// (type, mode, size, mtime, sha256).
+static int bench_extract(const std::vector<std::string> &args) {
+    fs::path base = fs::temp_directory_path() / ("sbuild-bench-extract-" + std::to_string(getpid()));
+    fs::create_directories(base);
+    std::vector<fs::path> archives;
+    for (auto &a : args) if (fs::is_regular_file(a)) archives.push_back(fs::absolute(a));
+    if (archives.empty()) {
+        size_t n = args.empty() ? 20000 : (size_t)std::max(1, std::atoi(args[0].c_str()));
+        fs::path gen = base / "gen", top = gen / "src-1.0";
+        std::string data(4096, 'x');
+        for (size_t i = 0; i < n; ++i) {
+            fs::path d = top / ("d" + std::to_string(i / 500));
+            if (i % 500 == 0) fs::create_directories(d);
+            std::snprintf(&data[0], data.size(), "file %zu\n", i);
+            std::ofstream(d / ("f" + std::to_string(i) + ".c"), std::ios::binary).write(data.data(), (std::streamsize)(64 + i % 4000));
+        }
+        std::string big(8u << 20, 0);
+        uint64_t x = 0x9e3779b97f4a7c15ULL;
+        for (size_t i = 0; i < big.size(); i += 8) { x ^= x << 13; x ^= x >> 7; x ^= x << 17; std::memcpy(&big[i], &x, 8); }
+        std::ofstream(top / "random.bin", std::ios::binary) << big;
+        std::ofstream(top / "zeros.bin", std::ios::binary) << std::string(8u << 20, 0);
+        fs::path deep = top / std::string(90, 'n') / std::string(90, 'm');
+        fs::create_directories(deep);
+        std::ofstream(deep / (std::string(80, 'l') + ".txt")) << "long name\n";
+        std::ofstream(top / "configure") << "#!/bin/sh\n";
+        fs::permissions(top / "configure", fs::perms::owner_all | fs::perms::group_read | fs::perms::group_exec);
+        fs::create_symlink("d0/f0.c", top / "link.c");
+        fs::create_hard_link(top / "d0" / "f1.c", top / "hard.c");
+        std::vector<std::pair<std::string, proc::Argv>> packs = {
+            {"src.tar.gz", {"tar", "-czf"}}, {"src.tar.xz", {"tar", "-cJf"}}, {"src.tar.bz2", {"tar", "-cjf"}}, {"src.tar.zst", {"tar", "--zstd", "-cf"}}};
+        for (auto &[name, cmd] : packs) {
+            cmd.push_back((base / name).string());
+            for (auto a : {"-C", gen.c_str(), "src-1.0"}) cmd.push_back(a);
+            if (proc::run(cmd).ok()) archives.push_back(base / name);
+            else term::warn("could not create " + name);
+        }
+        proc::Opts in_gen; in_gen.cwd = gen;
+        if (proc::run({"zip", "-qry", (base / "src.zip").string(), "src-1.0"}, in_gen).ok()) archives.push_back(base / "src.zip");
+        else term::warn("could not create src.zip (zip missing?)");
+        walk::remove_tree(gen);
+    }
+    auto timed = [](auto f) {
+        auto t0 = std::chrono::steady_clock::now(); f();
+        return std::chrono::duration<double>(std::chrono::steady_clock::now() - t0).count();
+    };
+    auto report = [&](const std::string &label, double secs, double mb, const std::string &extra) {
+        char buf[240];
+        std::snprintf(buf, sizeof(buf), "  %-26s %8.3fs %8.1f MB/s  %s", label.c_str(), secs, mb / secs, extra.c_str());
+        std::cout << buf << "\n";
+    };
+    auto listing = [](const fs::path &root) {
+        auto v = walk::tree(root, {true, 0});
+        std::sort(v.begin(), v.end(), [](const walk::Entry &a, const walk::Entry &b){ return a.rel < b.rel; });
+        return v;
+    };
+    int rc = 0;
+    for (auto &a : archives) {
+        std::cout << term::bold << "extract" << term::reset << " " << a.string() << " (" << human_size((double)fs::file_size(a)) << ")\n";
+        fs::path ext = base / "external", nat = base / "native";
+        walk::remove_tree(ext); walk::remove_tree(nat);
+        fs::create_directories(ext);
+        bool zip = unpack::is_zip(a);
+        proc::Argv cmd = zip ? proc::Argv{"unzip", "-q", a.string(), "-d", ext.string()} : proc::Argv{"tar", "-xf", a.string(), "-C", ext.string()};
+        bool ok = true;
+        double secs = timed([&]{ ok = proc::run(cmd).ok(); });
+        uint64_t bytes = 0;
+        auto want = listing(ext);
+        for (auto &e : want) if (e.type == DT_REG) bytes += e.size;
+        double mb = bytes / 1048576.0;
+        report(cmd[0] + (ok ? "" : " (failed)"), secs, mb, std::to_string(want.size()) + " entries");
+        unpack::Stats st;
+        std::string err;
+        secs = timed([&]{ ok = unpack::archive(a, nat, 0, err, st); });
+        report("native", secs, mb, ok ? st.summary() : "failed: " + err);
+        auto got = listing(nat);
+        size_t diffs = got.size() != want.size() ? 1 : 0;
+        std::vector<size_t> regs;
+        for (size_t i = 0; !diffs && i < got.size(); ++i) {
+            auto &g = got[i], &w = want[i];
+            if (g.rel != w.rel || g.type != w.type || g.size != w.size || (g.mode & 07777) != (w.mode & 07777) ||
+                (g.type != DT_LNK && g.mtime_ns / 1000000000 != w.mtime_ns / 1000000000)) {
+                term::warn("differs: " + g.rel + " / " + w.rel);
+                diffs++;
+            }
+            if (g.type == DT_REG) regs.push_back(i);
+        }
+        std::atomic<size_t> content{0};
+        if (!diffs) parallel_for(regs.size(), 0, [&](size_t k){
+            auto &rel = got[regs[k]].rel;
+            if (sha256::file(nat / rel) != sha256::file(ext / rel)) content++;
+        });
+        diffs += content;
+        if (diffs) { term::err("native tree differs from " + cmd[0] + "'s"); rc = 1; }
+        else std::cout << "  identical (" << got.size() << " entries)\n";
+    }
+    walk::remove_tree(base);
+    return rc;
+}
+
+// Registry database: n puts, reopen (log replay), lookups, list, then
+// n deletes and the compaction they trigger.
+static int bench_registry(size_t n) {
+    fs::path file = fs::temp_directory_path() / ("sbuild-bench-registry-" + std::to_string(getpid()) + ".db");
+    std::cout << term::bold << "registry" << term::reset << " " << file.string() << " (" << n << " packages)\n";
+    auto timed = [](auto f) {
+        auto t0 = std::chrono::steady_clock::now(); f();
+        return std::chrono::duration<double>(std::chrono::steady_clock::now() - t0).count();
+    };
+    auto report = [&](const std::string &label, size_t count, double secs) {
+        char buf[200];
+        std::snprintf(buf, sizeof(buf), "  %-28s %10.3f ms  (%zu)", label.c_str(), secs * 1e3, count);
+        std::cout << buf << "\n";
+    };
+    regdb::Db db(file);
+    db.compact();
+    auto pkg = [](size_t i){ regdb::Pkg p; p.name = "pkg" + std::to_string(i); p.version = "1.0"; p.time = ts_now(); p.size = i * 4096; p.files = i % 300; return p; };
+    double secs = timed([&]{ for (size_t i = 0; i < n; ++i) db.put(pkg(i)); });
+    report("put (fdatasync each)", n, secs);
+    regdb::Db again(file);
+    secs = timed([&]{ again.load(); });
+    report("open (replay)", again.size(), secs);
+    size_t hits = 0;
+    secs = timed([&]{ for (size_t i = 0; i < n; ++i) hits += again.find("pkg" + std::to_string(i)) != nullptr; });
+    report("find by name", hits, secs);
+    secs = timed([&]{ hits = again.list().size(); });
+    report("list", hits, secs);
+    secs = timed([&]{ for (size_t i = 0; i < n; ++i) again.del(pkg(i).id()); });
+    report("delete (+compaction)", again.log_records(), secs);
+    std::error_code ec; fs::remove(file, ec);
+    return 0;
+}
+
+// Byte counts with an optional k/m/g suffix (powers of 1024): "512k", "2M".
+static uint64_t parse_size(const std::string &v) {
+    char *end = nullptr;
+    double n = std::strtod(v.c_str(), &end);
+    int shift = 0;
+    switch (end && *end ? std::tolower((unsigned char)*end) : 0) { case 'k': shift = 10; break; case 'm': shift = 20; break; case 'g': shift = 30; break; }
+    return n > 0 ? (uint64_t)(n * (double)(1ull << shift)) : 0;
+}
+
+// `cache-serve [dir] [[host:]port] [--throttle=<rate>] [--latency=<ms>] [--drop-after=<size>]`:
+// the HTTP tier for SB_CACHE_REMOTE, also a local source mirror for testing fetches.
+static int cmd_cache_serve(const Paths &P, const std::vector<std::string> &args) {
+    http::ServeOpts so;
+    std::vector<std::string> pos;
+    for (auto &a : args) {
+        if (a.rfind("--throttle=", 0) == 0) so.rate = parse_size(a.substr(11));
+        else if (a.rfind("--latency=", 0) == 0) so.latency_ms = std::atoi(a.c_str() + 10);
+        else if (a.rfind("--drop-after=", 0) == 0) so.drop_after = parse_size(a.substr(13));
+        else pos.push_back(a);
+    }
+    std::string dir = pos.size() > 0 ? pos[0] : "", listen = pos.size() > 1 ? pos[1] : "";
+    fs::path root = dir.empty() ? P.cache / "served" : fs::path(dir);
+    std::error_code ec;
+    fs::create_directories(root, ec);
+    std::string host = "127.0.0.1", port = listen.empty() ? "8765" : listen;
+    auto colon = port.rfind(':');
+    if (colon != std::string::npos) { host = port.substr(0, colon); port = port.substr(colon + 1); }
+    if (host.size() > 1 && host.front() == '[' && host.back() == ']') host = host.substr(1, host.size() - 2);
+    if (so.rate) term::info("cache-serve: throttled to " + human_size((double)so.rate) + "/s per response");
+    if (so.latency_ms) term::info("cache-serve: " + std::to_string(so.latency_ms) + " ms before every response");
+    if (so.drop_after) term::info("cache-serve: dropping connections after " + human_size((double)so.drop_after) + " of a body");
+    return http::serve(fs::absolute(root), host, port, so);
+}
+
+static int cmd_bench(const std::string &what, const std::vector<std::string> &args) {
+    auto num = [&](size_t i, int dflt){ return i < args.size() ? std::max(1, std::atoi(args[i].c_str())) : dflt; };
+    if (what=="spawn") return bench_spawn(num(0, 500));
+    if (what=="sha256") return bench_sha256(args);
+    if (what=="walk") return bench_walk((size_t)num(0, 1000000));
+    if (what=="registry") return bench_registry((size_t)num(0, 5000));
+    if (what=="clone") return bench_clone(args);
+    if (what=="extract") return bench_extract(args);
+    term::err("Unknown bench target: " + what + " (spawn, sha256, walk, registry, clone, extract)");
+    return 1;
+}
+
 static void usage() {
     std::cout << term::bold << "sbuild" << term::reset << " — simples helper de build (LFS)\n\n";
     std::cout << "Uso: sbuild <comando> [args]\n\n";
@@ -615,6 +6722,7 @@ static void usage() {
     std::cout << "  info <nome>                Info da receita\n";
     std::cout << "  search <termo>       (srch)Buscar receitas pelo nome\n";
     std::cout << "  fetch <nome>         (dl)  Baixar fonte (curl/git)\n";
+    std::cout << "  fetch --all | a b c [-j N] Baixar e verificar fontes e patches de várias receitas em paralelo (sem extrair)\n";
     std::cout << "  extract <nome>       (ex)  Extrair fonte para work/\n";
     std::cout << "  patch <nome>         (pt)  Aplicar patches\n";
     std::cout << "  build <nome>         (b)   Executar preconfig, config, build\n";
@@ -622,19 +6730,68 @@ static void usage() {
     std::cout << "  bi <nome>                  build+install+patch em um passo (recomendado)\n";
     std::cout << "  package <nome>       (pkg) Empacotar DESTDIR -> packages/*.tar.{zst,xz,gz}\n";
     std::cout << "  remove <nome>        (rm)  Desfazer instalação em DESTDIR com manifest\n";
+    std::cout << "  list                 (ls)  Pacotes instalados (nome-versão, tamanho, arquivos, data)\n";
+    std::cout << "  owns <caminho>             Qual pacote instalado é dono do arquivo\n";
+    std::cout << "  verify <nome>              Conferir DESTDIR do pacote contra o manifest (sha256, modo, tamanho)\n";
     std::cout << "  revdep <nome>              Checar libs quebradas no DESTDIR desse pacote\n";
+    std::cout << "  revdep --all               Checar todos os pacotes instalados (índice de sonames)\n";
+    std::cout << "  rdeps <soname>             Pacotes que dependem de um soname (rebuild após bump)\n";
     std::cout << "  sync [mensagem]            git add/commit/push do repositório atual\n";
+    std::cout << "  cache-serve [dir] [[host:]porta] Servidor HTTP do cache de builds (padrão 127.0.0.1:8765; testes: --throttle=512k, --latency=ms, --drop-after=1M)\n";
+    std::cout << "  bench <alvo> [args]        Microbenchmarks internos (spawn [n], sha256 [arquivo|MB], walk [n], registry [n], clone [arquivo|n], extract [arquivos|n])\n";
     std::cout << "  help                  (h)  Esta ajuda\n\n";
     std::cout << "Opções/variáveis de ambiente úteis:\n";
     std::cout << "  SB_STRIP=1            Força strip após install\n";
+    std::cout << "  SB_CACHE_REMOTE=...   Camadas remotas do cache de builds: diretórios e/ou http://host:porta, separados por vírgula\n";
+    std::cout << "  --from=<fase>         Refaz a partir da fase (fetch, extract, patch, preconfig, config, build, install, postinstall, strip)\n";
+    std::cout << "  --force               Refaz todas as fases, ignorando carimbos e o cache de builds\n";
+    std::cout << "  SB_TREE_CLONE=copy    Árvores pristine em work/ por cópia em vez de hardlinks (sem reflink)\n";
+    std::cout << "  SB_TRANSCODE=1        Guarda cópia .tar.zst (multi-frame) das fontes verificadas e extrai dela (--transcode)\n";
+    std::cout << "  SB_FETCH_SEGMENTS=4   Faixas HTTP paralelas por download grande (retomável via .part)\n";
+    std::cout << "  SB_FETCH_PER_HOST=6   Máximo de conexões simultâneas por servidor nos downloads\n";
+    std::cout << "  SB_STORE=/dir         Depósito de fontes por sha256 compartilhado entre raízes ([store] path= em .sbuild/config.ini)\n";
+    std::cout << "  SB_MIRROR_TTL=3600    Segundos que o ranking de latência dos mirrors (mirrors= e .sbuild/config.ini) vale\n";
+    std::cout << "  SB_PATCH_TTL=86400    Segundos até revalidar um patch http(s) (If-None-Match/If-Modified-Since)\n";
+    std::cout << "  SB_NO_STREAM=1        Baixa, verifica e só então extrai (sem extrair durante o download)\n";
+    std::cout << "  SB_NO_CACHE=1         Ignora o cache de builds em .sbuild/cache/builds (--no-cache)\n";
+    std::cout << "  SB_OVERWRITE=1        Instala mesmo com arquivos de outros pacotes, tomando posse deles (--overwrite)\n";
+    std::cout << "  SB_DEBUGINFO=1        Com strip, guarda debug info em pacote <nome>-dbg (--debuginfo)\n";
+    std::cout << "  --paranoid            Recalcula sha256 mesmo com carimbo válido em .sbuild/cache (SB_PARANOID=1)\n";
     std::cout << "  SB_NODEP=1            (no-op, placeholder)\n";
 }
 
 int main(int argc, char **argv) {
     Paths P; ensure_dirs(P);
-    if (argc<2) { usage(); return 0; }
-    std::string cmd = argv[1];
-    auto arg = [&](int i){ return (i<argc)? std::string(argv[i]) : std::string(); };
+    proc::forward_signals();
+    std::signal(SIGPIPE, SIG_IGN);   // a dead tar or peer shows up as EPIPE; children get the default back
+    Options O;
+    std::vector<std::string> args; // argv without the switches below
+    for (int i=0; i<argc; ++i) {
+        std::string a = argv[i];
+        if (i>0 && a=="--paranoid") O.paranoid = true;
+        else if (i>0 && a=="--all") O.all = true;
+        else if (i>0 && a=="--debuginfo") O.debuginfo = true;
+        else if (i>0 && a=="--overwrite") O.overwrite = true;
+        else if (i>0 && a=="--no-cache") O.cache = false;
+        else if (i>0 && a=="--force") O.force = true;
+        else if (i>0 && a=="--transcode") O.transcode = true;
+        else if (i>0 && a.rfind("--from=",0)==0) O.from = a.substr(7);
+        else if (i>0 && a=="-j" && i+1<argc) O.jobs = (unsigned)std::max(1, std::atoi(argv[++i]));
+        else if (i>0 && a.rfind("-j",0)==0 && a.size()>2 && std::isdigit((unsigned char)a[2])) O.jobs = (unsigned)std::max(1, std::atoi(a.c_str()+2));
+        else if (i>0 && a.rfind("--jobs=",0)==0) O.jobs = (unsigned)std::max(1, std::atoi(a.c_str()+7));
+        else args.push_back(a);
+    }
+    if (std::getenv("SB_PARANOID")) O.paranoid = true;
+    if (std::getenv("SB_DEBUGINFO")) O.debuginfo = true;
+    if (std::getenv("SB_OVERWRITE")) O.overwrite = true;
+    if (std::getenv("SB_NO_CACHE")) O.cache = false;
+    if (std::getenv("SB_TRANSCODE")) O.transcode = true;
+    if (std::getenv("SB_NO_STREAM")) O.stream = false;
+    if (!O.from.empty() && stamps::index(O.from) < 0) { term::err("--from: unknown phase " + O.from); return 1; }
+    int argn = (int)args.size();
+    if (argn<2) { usage(); return 0; }
+    std::string cmd = args[1];
+    auto arg = [&](int i){ return (i<argn)? args[i] : std::string(); };
 
     // aliases
     if (cmd=="h"||cmd=="--help"||cmd=="help"||cmd=="-h") { usage(); return 0; }
@@ -647,54 +6804,82 @@ int main(int argc, char **argv) {
     if (cmd=="i") cmd = "install";
     if (cmd=="pkg") cmd = "package";
     if (cmd=="rm") cmd = "remove";
+    if (cmd=="ls") cmd = "list";
 
     if (cmd=="new") {
-        if (argc<3) { term::err("Falta nome: sbuild new <nome>"); return 1; }
+        if (argn<3) { term::err("Falta nome: sbuild new <nome>"); return 1; }
         return cmd_new(P, arg(2));
     }
     else if (cmd=="info") {
-        if (argc<3) { term::err("Falta nome"); return 1; }
+        if (argn<3) { term::err("Falta nome"); return 1; }
         return cmd_info(P, arg(2));
     }
     else if (cmd=="search") {
-        if (argc<3) { term::err("Falta termo"); return 1; }
+        if (argn<3) { term::err("Falta termo"); return 1; }
         return cmd_search(P, arg(2));
     }
+    else if (cmd=="fetch" && (O.all || O.jobs || argn>3)) {
+        if (argn<3 && !O.all) { term::err("Falta nome (ou --all)"); return 1; }
+        return cmd_fetch_many(P, O, std::vector<std::string>(args.begin()+std::min(argn,2), args.end()));
+    }
     else if (cmd=="fetch"||cmd=="extract"||cmd=="patch") {
-        if (argc<3) { term::err("Falta nome"); return 1; }
-        return cmd_fetch_extract_patch(P, arg(2));
+        if (argn<3) { term::err("Falta nome"); return 1; }
+        return cmd_fetch_extract_patch(P, O, arg(2));
     }
     else if (cmd=="bi") {
-        if (argc<3) { term::err("Falta nome"); return 1; }
+        if (argn<3) { term::err("Falta nome"); return 1; }
         bool do_strip = std::getenv("SB_STRIP")!=nullptr;
         bool do_revdep = true;
-        return cmd_build_install(P, arg(2), do_strip, do_revdep);
+        return cmd_build_install(P, O, arg(2), do_strip, do_revdep);
     }
     else if (cmd=="build"||cmd=="install") {
-        if (argc<3) { term::err("Falta nome"); return 1; }
+        if (argn<3) { term::err("Falta nome"); return 1; }
         bool do_strip = std::getenv("SB_STRIP")!=nullptr;
         bool do_revdep = false;
-        return cmd_build_install(P, arg(2), do_strip, do_revdep);
+        return cmd_build_install(P, O, arg(2), do_strip, do_revdep);
     }
     else if (cmd=="package") {
-        if (argc<3) { term::err("Falta nome"); return 1; }
+        if (argn<3) { term::err("Falta nome"); return 1; }
         return cmd_package(P, arg(2));
     }
     else if (cmd=="remove") {
-        if (argc<3) { term::err("Falta nome"); return 1; }
+        if (argn<3) { term::err("Falta nome"); return 1; }
         return cmd_remove(P, arg(2));
     }
+    else if (cmd=="list") {
+        return cmd_list(P);
+    }
+    else if (cmd=="owns") {
+        if (argn<3) { term::err("Falta caminho"); return 1; }
+        return cmd_owns(P, arg(2));
+    }
+    else if (cmd=="verify") {
+        if (argn<3) { term::err("Falta nome"); return 1; }
+        return cmd_verify(P, arg(2));
+    }
     else if (cmd=="revdep") {
-        if (argc<3) { term::err("Falta nome"); return 1; }
+        if (O.all) return cmd_revdep_all(P);
+        if (argn<3) { term::err("Falta nome"); return 1; }
         auto f = find_recipe(P,arg(2)); if (f.empty()) { term::err("Recipe não encontrada"); return 1; }
         Recipe r; parse_ini(f,r);
         fs::path staging = P.destdir / (r.name + "-" + r.version);
         if (!fs::exists(staging)) { term::err("Nada instalado em DESTDIR para este pacote"); return 2; }
         fs::path logfile = P.logs / (r.name + "-" + r.version + ".log");
-        return revdep_check(staging, logfile.string()) ? 0 : 1;
+        return revdep_check(staging, logfile.string(), sonames::provided(sonames::load(P))) ? 0 : 1;
+    }
+    else if (cmd=="rdeps") {
+        if (argn<3) { term::err("Falta soname: sbuild rdeps libfoo.so.N"); return 1; }
+        return cmd_rdeps(P, arg(2));
     }
     else if (cmd=="sync") {
-        std::string msg = argc>=3 ? arg(2) : ""; return cmd_sync(P, msg);
+        std::string msg = argn>=3 ? arg(2) : ""; return cmd_sync(P, msg);
+    }
+    else if (cmd=="cache-serve") {
+        return cmd_cache_serve(P, std::vector<std::string>(args.begin() + 2, args.end()));
+    }
+    else if (cmd=="bench") {
+        if (argn<3) { term::err("Falta alvo"); return 1; }
+        return cmd_bench(arg(2), std::vector<std::string>(args.begin()+std::min(argn,3), args.end()));
     }
     else {
         term::err("Comando desconhecido: " + cmd);